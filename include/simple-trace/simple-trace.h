@@ -24,6 +24,7 @@ USA.
 #define __SIMPLE_TRACE_H__
 
 #include <stddef.h>                                 /* NULL */
+#include <stdint.h>                                 /* uint64_t */
 #include <sys/types.h>                              /* size_t */
 #include <sys/time.h>
 
@@ -71,6 +72,25 @@ typedef struct {
 #define TRACE_FLAG_END { .name = NULL, .descr = NULL }
 
 
+/*
+ * 64-bit trace flags
+ *
+ * An int flag id can only address the first 127 contexts and the first
+ * 256 flags of a context. Modules registered with trace_add_module64 get
+ * 64-bit flag ids instead, which cover every context and flag the library
+ * can hold. Both kinds of modules can live in the same context. Use the
+ * trace_*64 functions and trace_write64 with 64-bit flag ids.
+ */
+
+typedef uint64_t trace_flag64_t;
+
+typedef struct {
+    char           *name;                    /* symbolic flag name */
+    char           *descr;                   /* description of flag */
+    trace_flag64_t *flagptr;                 /* reported to trace 'client' */
+} trace_flagdef64_t;
+
+
 
 /*
  * a trace module definition (a named set of trace flags)
@@ -95,6 +115,80 @@ typedef struct {
     }
 
 
+typedef struct {
+    char              *name;                 /* symbolic module name */
+    trace_flagdef64_t *flags;                /* trace flags of this module */
+    int                nflag;                /* number of flags */
+} trace_moduledef64_t;
+
+
+#define TRACE_DECLARE_MODULE64(v, n, ...)                                 \
+    trace_flagdef64_t __trace_flags_##v[] = {                             \
+        __VA_ARGS__,                                                      \
+        TRACE_FLAG_END,                                                   \
+    };                                                                    \
+    trace_moduledef64_t v = {                                             \
+        .name  = (n),                                                     \
+        .flags = __trace_flags_##v,                                       \
+        .nflag = sizeof(__trace_flags_##v) / sizeof(__trace_flags_##v[0]) \
+    }
+
+
+
+/*
+ * statically registered modules
+ *
+ * Modules defined with TRACE_DEFINE_MODULE_STATIC[64] are also described
+ * in a __trace_modules section. A constructor registers the section with
+ * the library, and trace_init adds all modules found there to the default
+ * context in a single pass. Their flag bits are allocated in bulk, and
+ * their module and flag names are borrowed instead of copied. The modules
+ * of an object are deleted again when it is unloaded.
+ */
+
+typedef struct {
+    void *module;                            /* trace_moduledef{,64}_t */
+    int   wide;                              /* module has 64-bit flags */
+} trace_modstatic_t;
+
+void __trace_modules_register(trace_modstatic_t *start,
+                              trace_modstatic_t *stop);
+void __trace_modules_unregister(trace_modstatic_t *start,
+                                trace_modstatic_t *stop);
+
+extern trace_modstatic_t __start___trace_modules[]
+    __attribute__((weak, visibility("hidden")));
+extern trace_modstatic_t __stop___trace_modules[]
+    __attribute__((weak, visibility("hidden")));
+
+#define __TRACE_MODULE_STATIC(v, w)                                       \
+    static trace_modstatic_t __trace_static_##v                           \
+    __attribute__((section("__trace_modules"), used,                      \
+                   aligned(sizeof(void *)))) = {                          \
+        .module = &v,                                                     \
+        .wide   = (w),                                                    \
+    };                                                                    \
+    static void __attribute__((constructor))                              \
+    __trace_static_load_##v(void)                                         \
+    {                                                                     \
+        __trace_modules_register(__start___trace_modules,                 \
+                                 __stop___trace_modules);                 \
+    }                                                                     \
+    static void __attribute__((destructor))                               \
+    __trace_static_unload_##v(void)                                       \
+    {                                                                     \
+        __trace_modules_unregister(__start___trace_modules,               \
+                                   __stop___trace_modules);               \
+    }
+
+#define TRACE_DEFINE_MODULE_STATIC(v, n, ...)                             \
+    TRACE_DECLARE_MODULE(v, n, __VA_ARGS__);                              \
+    __TRACE_MODULE_STATIC(v, 0)
+
+#define TRACE_DEFINE_MODULE_STATIC64(v, n, ...)                           \
+    TRACE_DECLARE_MODULE64(v, n, __VA_ARGS__);                            \
+    __TRACE_MODULE_STATIC(v, 1)
+
 
 /*
  * trace destinations
@@ -103,17 +197,299 @@ typedef struct {
 #define TRACE_TO_STDERR     ((char *)0x0)
 #define TRACE_TO_STDOUT     ((char *)0x1)
 #define TRACE_TO_FILE(path) (path)
+#define TRACE_TO_MMAP(path, size) TRACE_TO_MMAP_PREFIX path ":size=" size
+
+#define TRACE_TO_MMAP_PREFIX "mmap:"
+
+
+/*
+ * output modes
+ */
+
+#define TRACE_MODE_DIRECT   "direct"         /* write from the caller */
+#define TRACE_MODE_RING     "ring"           /* per-thread rings, drainer */
+#define TRACE_MODE_BINARY   "binary"         /* rings, deferred formatting */
+#define TRACE_MODE_ASYNC    "async"          /* queue, writer thread */
+
+
+/*
+ * overflow policies for async mode output
+ */
+
+#define TRACE_OVERFLOW_BLOCK       "block"       /* wait for the writer */
+#define TRACE_OVERFLOW_DROP_NEWEST "drop-newest" /* drop the new message */
+#define TRACE_OVERFLOW_DROP_OLDEST "drop-oldest" /* drop the oldest queued */
+#define TRACE_OVERFLOW_SPILL       "spill-count" /* drop new, count in output */
+
+
+/*
+ * clock sources for %u and %N
+ */
+
+#define TRACE_CLOCK_REALTIME      "realtime"       /* CLOCK_REALTIME */
+#define TRACE_CLOCK_MONOTONIC     "monotonic"      /* CLOCK_MONOTONIC */
+#define TRACE_CLOCK_MONOTONIC_RAW "monotonic_raw"  /* CLOCK_MONOTONIC_RAW */
+#define TRACE_CLOCK_TSC           "tsc"            /* invariant TSC, x86-64 */
+
+
+/*
+ * flush policies for direct mode output
+ */
+
+#define TRACE_FLUSH_LINE        "line"           /* write every message */
+#define TRACE_FLUSH_NEVER       "never"          /* write when forced to */
+#define TRACE_FLUSH_SIZE(s)     "size="s         /* buffer s bytes, eg. 64k */
+#define TRACE_FLUSH_INTERVAL(t) "interval="t     /* write every t, eg. 10ms */
+
 
+/*
+ * per-flag message statistics
+ *
+ * The bytes of a message are what trace_printf returned for it, so in
+ * binary mode they are the size of its binary record, not of its text.
+ */
+
+#define TRACE_STATS_ON    "on"                   /* start counting */
+#define TRACE_STATS_OFF   "off"                  /* stop counting */
+#define TRACE_STATS_RESET "reset"                /* clear counters */
+
+typedef struct {
+    uint64_t emitted;                        /* messages written */
+    uint64_t suppressed;                     /* messages not written */
+    uint64_t bytes;                          /* bytes written */
+    uint64_t format_ns;                      /* time spent formatting */
+} trace_stats_t;
+
+
+/*
+ * structured key/value tags of a message
+ *
+ * Tags are declared on the stack with TRACE_DECLARE_TAGS, which reserves
+ * room for n tags and len bytes of values formatted by trace_tag_addf,
+ * and passed along with a message to trace_write_tags. Tags are shown in
+ * messages with %T in the context format.
+ *
+ * Tagged messages are checked against the tag filters of their context,
+ * if there are any, and written only if they match at least one filter.
+ * A filter is a set of tags and matches a message if each of its tags is
+ * matched by a tag of the message with the same key and value. A filter
+ * value of "*" matches any value, in regexp filters values are extended
+ * regular expressions. A filter without tags matches every message.
+ * Messages written without tags are never filtered.
+ */
+
+typedef struct {
+    const char *key;                         /* tag name */
+    const char *value;                       /* tag value */
+} trace_tag_t;
+
+typedef struct {
+    trace_tag_t *tags;                       /* tags, usually on the stack */
+    int          ntag;                       /* number of tags */
+    int          size;                       /* room for tags */
+    char        *buf;                        /* room for formatted values */
+    int          bufsize;                    /* size of buf */
+    int          used;                       /* bytes of buf used */
+} trace_tags_t;
+
+#define TRACE_DECLARE_TAGS(v, n, len)                                     \
+    trace_tag_t  __trace_tags_##v[(n) > 0 ? (n) : 1];                     \
+    char         __trace_tagbuf_##v[(len) > 0 ? (len) : 1];               \
+    trace_tags_t v = {                                                    \
+        .tags    = __trace_tags_##v,                                      \
+        .ntag    = 0,                                                     \
+        .size    = (n),                                                   \
+        .buf     = __trace_tagbuf_##v,                                    \
+        .bufsize = (len),                                                 \
+        .used    = 0,                                                     \
+    }
+
+#define TRACE_FILTER_ANY "*"                     /* matches any tag value */
 
 
 /*
- * macro to generate trace messages
+ * trace_show formats
+ *
+ * trace_show fills the given buffer like snprintf and returns the length
+ * of the full output, which is larger than the buffer if it was too small.
+ * Flags are shown as configuration commands by default, or as one JSON
+ * object per line for each context and each of its flags.
  */
 
-#define trace_write(id, format, args...)        \
-    __trace_printf(id, __FILE__, __LINE__, __FUNCTION__, format"\n", ## args)
-#define trace_printf(id, format, args...)        \
-    __trace_printf(id, __FILE__, __LINE__, __FUNCTION__, format"\n", ## args)
+#define TRACE_SHOW_FLAGS  "flags"                /* context.module=+flag */
+#define TRACE_SHOW_STATS  "stats"                /* flag statistics */
+#define TRACE_SHOW_JSON   "json"                 /* JSON lines */
+
+
+
+/*
+ * exported effective flag state (flag mask of enabled contexts)
+ *
+ * The library keeps a copy of the mask of every context here, cleared for
+ * disabled contexts, so trace_write can test a flag inline with a single
+ * load and branch without ever calling into the library for disabled flags.
+ * The table covers the full context field of a flag id so no range check
+ * is needed. 64-bit flag ids are tested against a wider table the same
+ * way. These are not part of the API, do not touch them directly.
+ */
+
+#define TRACE_ID_CONTEXTS    256
+#define TRACE_ID_FLAGS       256
+#define TRACE_BITS_PER_LONG  ((int)sizeof(unsigned long) * 8)
+#define TRACE_MASK_WORDS     (TRACE_ID_FLAGS / TRACE_BITS_PER_LONG)
+
+#define TRACE_ID64_CONTEXTS  512
+#define TRACE_ID64_FLAGS     4096
+#define TRACE_MASK64_WORDS   (TRACE_ID64_FLAGS / TRACE_BITS_PER_LONG)
+
+extern unsigned long __trace_mask[TRACE_ID_CONTEXTS][TRACE_MASK_WORDS];
+extern unsigned long __trace_mask64[TRACE_ID64_CONTEXTS][TRACE_MASK64_WORDS];
+
+static inline int
+__trace_enabled(int id)
+{
+    unsigned int c = ((unsigned int)id >> 24) & (TRACE_ID_CONTEXTS - 1);
+    unsigned int b =  (unsigned int)id        & (TRACE_ID_FLAGS    - 1);
+
+    return (__atomic_load_n(&__trace_mask[c][b / TRACE_BITS_PER_LONG],
+                            __ATOMIC_RELAXED) &
+            (1UL << (b & (TRACE_BITS_PER_LONG - 1)))) != 0;
+}
+
+static inline int
+__trace_enabled64(trace_flag64_t id)
+{
+    unsigned int c = (unsigned int)(id >> 48) & (TRACE_ID64_CONTEXTS - 1);
+    unsigned int b = (unsigned int) id        & (TRACE_ID64_FLAGS    - 1);
+
+    return (__atomic_load_n(&__trace_mask64[c][b / TRACE_BITS_PER_LONG],
+                            __ATOMIC_RELAXED) &
+            (1UL << (b & (TRACE_BITS_PER_LONG - 1)))) != 0;
+}
+
+
+
+/*
+ * jump labels for disabled trace points
+ *
+ * Code compiled with TRACE_JUMP_LABEL defined turns each trace point into
+ * a jump the library patches into a NOP while the flag of the trace point
+ * is off, so disabled trace points cost no load and no branch. Every site
+ * is described in a __trace_jump section, registered with the library by
+ * a constructor when its object is loaded. Sites start out as jumps to the
+ * ordinary flag check, so they stay correct wherever patching fails.
+ * Trace points must then use flag variables with static storage. Without
+ * asm goto, or on other architectures than x86-64, the ordinary inline
+ * flag check is used. These are not part of the API either.
+ */
+
+typedef struct {
+    const void *id;                          /* flag id variable */
+    int         size;                        /* sizeof(flag id) */
+} trace_jump_key_t;
+
+typedef struct {
+    unsigned long           code;            /* address of jump/NOP */
+    unsigned long           target;          /* jump target */
+    const trace_jump_key_t *key;             /* flag of the site */
+    unsigned long           enabled;         /* jump currently in place */
+} trace_jump_t;
+
+void __trace_jump_register(trace_jump_t *start, trace_jump_t *stop);
+void __trace_jump_unregister(trace_jump_t *start, trace_jump_t *stop);
+
+#if defined(TRACE_JUMP_LABEL) && defined(__x86_64__) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 5))
+#  define TRACE_HAVE_JUMP_LABEL 1
+#endif
+
+#ifdef TRACE_HAVE_JUMP_LABEL
+
+/* a 5-byte jmp (or nopl 0x0(%rax,%rax,1)) padded to an aligned quadword */
+#define __trace_site(id) ({                                               \
+            __label__ __trace_site_on;                                    \
+            static const trace_jump_key_t __trace_key = {                 \
+                &(id), sizeof(id)                                         \
+            };                                                            \
+            int __on = 0;                                                 \
+            __asm__ goto (".balign 8\n"                                   \
+                          "1: .byte 0xe9\n"                               \
+                          ".long %l[__trace_site_on] - (1b + 5)\n"        \
+                          ".byte 0x0f, 0x1f, 0x00\n"                      \
+                          ".pushsection __trace_jump, \"aw\"\n"           \
+                          ".balign 8\n"                                   \
+                          ".quad 1b, %l[__trace_site_on], %c0, 1\n"       \
+                          ".popsection\n"                                 \
+                          : : "i" (&__trace_key) : : __trace_site_on);    \
+            if (0) {                                                      \
+            __trace_site_on:                                              \
+                __on = 1;                                                 \
+            }                                                             \
+            __on; })
+
+extern trace_jump_t __start___trace_jump[]
+    __attribute__((weak, visibility("hidden")));
+extern trace_jump_t __stop___trace_jump[]
+    __attribute__((weak, visibility("hidden")));
+
+static void __attribute__((constructor, used))
+__trace_jump_load(void)
+{
+    __trace_jump_register(__start___trace_jump, __stop___trace_jump);
+}
+
+static void __attribute__((destructor, used))
+__trace_jump_unload(void)
+{
+    __trace_jump_unregister(__start___trace_jump, __stop___trace_jump);
+}
+
+#else
+
+#define __trace_site(id) 1
+
+#endif
+
+
+
+/*
+ * macros to generate trace messages
+ *
+ * They return the number of bytes written, 0 if the message was not
+ * written, or a negative error code. Binary mode does not format messages
+ * when they are traced, so there it is the size of the binary record, not
+ * the length of the formatted message.
+ */
+
+#define trace_write(id, format, args...) ({                               \
+            int __id = (id);                                              \
+            unlikely(__trace_site(id) && __trace_enabled(__id)) ?         \
+                __trace_printf(__id, __FILE__, __LINE__, __FUNCTION__,    \
+                               format"\n", ## args) : 0; })
+#define trace_printf(id, format, args...)                                 \
+    trace_write(id, format, ## args)
+
+#define trace_write64(id, format, args...) ({                             \
+            trace_flag64_t __id = (id);                                   \
+            unlikely(__trace_site(id) && __trace_enabled64(__id)) ?       \
+                __trace_printf64(__id, __FILE__, __LINE__, __FUNCTION__,  \
+                                 format"\n", ## args) : 0; })
+#define trace_printf64(id, format, args...)                               \
+    trace_write64(id, format, ## args)
+
+#define trace_write_tags(id, tags, format, args...) ({                    \
+            int __id = (id);                                              \
+            unlikely(__trace_site(id) && __trace_enabled(__id)) ?         \
+                __trace_printf_tags(__id, (tags), __FILE__, __LINE__,     \
+                                    __FUNCTION__, format"\n", ## args) :  \
+                0; })
+
+#define trace_write_tags64(id, tags, format, args...) ({                  \
+            trace_flag64_t __id = (id);                                   \
+            unlikely(__trace_site(id) && __trace_enabled64(__id)) ?       \
+                __trace_printf_tags64(__id, (tags), __FILE__, __LINE__,   \
+                                      __FUNCTION__, format"\n", ## args) : \
+                0; })
 
 
 
@@ -129,21 +505,61 @@ int  trace_context_open(const char *name);
 int  trace_context_close(int cid);
 int  trace_context_format(int cid, const char *format);
 int  trace_context_target(int cid, const char *target);
+int  trace_context_mode(int cid, const char *mode);
+int  trace_context_clock(int cid, const char *clock);
+int  trace_context_flush(int cid, const char *policy);
+int  trace_context_dump(int cid, const char *target);
+int  trace_context_stats(int cid, const char *state);
+int  trace_context_overflow(int cid, const char *policy);
+int  trace_context_dropped(int cid, uint64_t *dropped);
 int  trace_context_enable(int cid);
 int  trace_context_disable(int cid);
 
 int  trace_add_module(int cid, trace_moduledef_t *module);
+int  trace_add_module64(int cid, trace_moduledef64_t *module);
 int  trace_del_module(int cid, const char *name);
 
 int  trace_flag_set(int id);
 int  trace_flag_clr(int id);
+int  trace_flag_record(int id);
 int  trace_flag_tst(int id);
+int  trace_flag_lookup(const char *name);
+int  trace_flag_limit(int id, int rate);
+int  trace_flag_sample(int id, int n, int random);
+
+int  trace_flag_set64(trace_flag64_t id);
+int  trace_flag_clr64(trace_flag64_t id);
+int  trace_flag_record64(trace_flag64_t id);
+int  trace_flag_tst64(trace_flag64_t id);
+int  trace_flag_lookup64(const char *name, trace_flag64_t *id);
+int  trace_flag_limit64(trace_flag64_t id, int rate);
+int  trace_flag_sample64(trace_flag64_t id, int n, int random);
+
+int  trace_stats(int id, trace_stats_t *stats);
+int  trace_stats64(trace_flag64_t id, trace_stats_t *stats);
+
+int  trace_tag_add(trace_tags_t *tags, const char *key, const char *value);
+int  trace_tag_addf(trace_tags_t *tags, const char *key,
+                    const char *format, ...);
+
+int  trace_add_simple_filter(int cid, trace_tags_t *filter);
+int  trace_del_simple_filter(int cid, trace_tags_t *filter);
+int  trace_add_regexp_filter(int cid, trace_tags_t *filter);
+int  trace_del_regexp_filter(int cid, trace_tags_t *filter);
+int  trace_reset_filters(int cid);
 
 int  trace_configure(const char *config);
 int  trace_show(char *context, char *buf, size_t bufsize, const char *format);
 
 int  __trace_printf(int id, const char *file, int line, const char *func,
                     const char *format, ...);
+int  __trace_printf64(trace_flag64_t id, const char *file, int line,
+                      const char *func, const char *format, ...);
+int  __trace_printf_tags(int id, trace_tags_t *tags, const char *file,
+                         int line, const char *func, const char *format, ...);
+int  __trace_printf_tags64(trace_flag64_t id, trace_tags_t *tags,
+                           const char *file, int line, const char *func,
+                           const char *format, ...);
 
 
 #endif /* __SIMPLE_TRACE_H__ */
@@ -51,6 +51,7 @@ mv %{buildroot}%{_docdir}/libsimple-trace-doc/libsimple-trace.html \
 
 %files
 %{_libdir}/libsimple-trace*.so.*
+%{_bindir}/trace-extract
 %license COPYING
 
 %files devel
@@ -20,6 +20,10 @@ USA.
 *************************************************************************/
 
 
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,14 +32,29 @@ USA.
 #include <errno.h>
 #include <time.h>
 #include <limits.h>
-#include <locale.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <regex.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__)
+#  include <x86intrin.h>
+#  include <cpuid.h>
+#  define HAVE_TSC 1
+#endif
 
 #include <simple-trace/simple-trace.h>
 #include "mm.h"
+#include "trace-mmap.h"
 
 
-#define STAMP_FORMAT    "%Y-%b-%d %H:%M:%S"
 #define STAMP_STRFLEN   (4+1+3+1+2+1+2+1+2+1+2)  /* YYYY-MMM-DD hh:mm:ss */
 #define STAMP_MSECLEN   (1+3)                    /*                     .mmm */
 #define STAMP_SIZE      (STAMP_STRFLEN + STAMP_MSECLEN + 1)
@@ -47,32 +66,148 @@ USA.
 
 #define BIT_MASK_GEN(len) ((unsigned long) ((1UL << (len))) - 1)
 
-#define MAX_CONTEXTS  127
-#define CTX_SHIFT      24
-#define CTX_MASK     0xff
+/*
+ * Flag ids are 64-bit internally. The int ids of the original API use
+ * the same layout with narrower fields, which limits them to the first
+ * MAX_CONTEXTS32 contexts, MAX_MODULES modules, MAX_FLAGS32 flag bits of
+ * a context and 256 flags per module.
+ */
+
+#define MAX_CONTEXTS  TRACE_ID64_CONTEXTS
+#define CTX_SHIFT      48
+#define CTX_MASK     0xffffULL
 #define MAX_MODULES   256
-#define MOD_SHIFT      16
-#define MOD_MASK     0xff
-#define MAX_FLAGS     256
-#define IDX_SHIFT       8
-#define IDX_MASK     0xff
-#define BIT_MASK     0xff
+#define MOD_SHIFT      32
+#define MOD_MASK     0xffffULL
+#define MAX_FLAGS     TRACE_ID64_FLAGS
+#define IDX_SHIFT      16
+#define IDX_MASK     0xffffULL
+#define BIT_MASK     0xffffULL
+
+#define FLAG_ID(c, m, i, b)                           \
+    ((((uint64_t)(c) & CTX_MASK) << CTX_SHIFT) |      \
+     (((uint64_t)(m) & MOD_MASK) << MOD_SHIFT) |      \
+     (((uint64_t)(i) & IDX_MASK) << IDX_SHIFT) |      \
+      ((uint64_t)(b) & BIT_MASK))
+
+#define FLAG_CTX(id) ((int)(((id) >> CTX_SHIFT) & CTX_MASK))
+#define FLAG_MOD(id) ((int)(((id) >> MOD_SHIFT) & MOD_MASK))
+#define FLAG_IDX(id) ((int)(((id) >> IDX_SHIFT) & IDX_MASK))
+#define FLAG_BIT(id) ((int)( (id)               & BIT_MASK))
+
+#define MAX_CONTEXTS32 127
+#define MAX_FLAGS32    256
+#define MAX_FLAGIDX32  256
+#define FLAG_NONE      (~0ULL)               /* not a valid flag id */
+
+#define FLAG_ID32(c, m, i, b)                         \
+    (((c) << 24) | ((m) << 16) | ((i) << 8) | (b))
+
+#define FLAG_ID64(id)                                 \
+    ((id) < 0 ? FLAG_NONE :                           \
+     FLAG_ID(((id) >> 24) & 0xff, ((id) >> 16) & 0xff, \
+             ((id) >>  8) & 0xff,  (id)        & 0xff))
+
+
+#define MAX_NAME    128
+#define MAX_MESSAGE 4096
+#define MAX_STACKMSG 512                     /* longer messages use msgbuf */
+
+#define MODE_DIRECT   0                      /* write from caller thread */
+#define MODE_RING     1                      /* per-thread rings, drainer */
+#define MODE_BINARY   2                      /* rings, deferred formatting */
+#define MODE_ASYNC    3                      /* queue, writer thread */
+
+#define CLK_REALTIME      0                  /* CLOCK_REALTIME */
+#define CLK_MONOTONIC     1                  /* CLOCK_MONOTONIC */
+#define CLK_MONOTONIC_RAW 2                  /* CLOCK_MONOTONIC_RAW */
+#define CLK_TSC           3                  /* calibrated rdtsc */
+
+#define FLUSH_LINE        0                  /* write every message */
+#define FLUSH_SIZE        1                  /* write when buffer is full */
+#define FLUSH_INTERVAL    2                  /* write periodically */
+#define FLUSH_NEVER       3                  /* write only when forced to */
+
+#define OVERFLOW_BLOCK    0                  /* wait for the writer */
+#define OVERFLOW_NEWEST   1                  /* drop the new message */
+#define OVERFLOW_OLDEST   2                  /* drop the oldest messages */
+#define OVERFLOW_SPILL    3                  /* drop new, count in output */
+
+
+
+
+/*
+ * a hash index of names, see the name lookup notes below
+ */
+
+typedef struct {
+    const char *name;                        /* indexed name, NULL if free */
+    uint32_t    hash;                        /* hash of name */
+    int         idx;                         /* index of entry, -1 if gone */
+} hashent_t;
+
+typedef struct {
+    hashent_t *entries;                      /* hash table */
+    int        size;                         /* table size, a power of 2 */
+    int        used;                         /* entries in use or gone */
+} hashidx_t;
+
+
+/*
+ * registry memory of a context, see the registry memory notes below
+ */
+
+#define ARENA_CHUNK    (64 * 1024)           /* default chunk size */
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+#define ARENA_SPLIT    64                    /* smallest block worth keeping */
+#define ARENA_LARGE    (ARENA_CHUNK / 8)     /* gets a chunk of its own */
+
+typedef struct arena_chunk_s arena_chunk_t;
+struct arena_chunk_s {
+    arena_chunk_t *next;                     /* next chunk */
+    size_t         size;                     /* size of data */
+    size_t         used;                     /* data handed out */
+    char           data[0] __attribute__((aligned(16)));
+};
+
+typedef struct arena_block_s arena_block_t;
+struct arena_block_s {
+    arena_block_t *next;                     /* next free block */
+    size_t         size;                     /* size of this block */
+};
+
+typedef struct {
+    arena_chunk_t *chunks;                   /* chunks, current one first */
+    arena_block_t *free;                     /* released blocks */
+    size_t         size;                     /* bytes allocated in chunks */
+    size_t         used;                     /* bytes in use */
+} arena_t;
 
-#define FLAG_ID(c, m, i, b)                 \
-    ((((c) & CTX_MASK) << CTX_SHIFT) |      \
-     (((m) & MOD_MASK) << MOD_SHIFT) |      \
-     (((i) & IDX_MASK) << IDX_SHIFT) |      \
-      ((b) & BIT_MASK))
 
-#define FLAG_CTX(id) (((id) >> CTX_SHIFT))
-#define FLAG_MOD(id) (((id) >> MOD_SHIFT) & MOD_MASK)
-#define FLAG_IDX(id) (((id) >> IDX_SHIFT) & IDX_MASK)
-#define FLAG_BIT(id) ( (id)               & BIT_MASK)
+/*
+ * a bitmap of flag bits, see the bitmap notes below
+ */
+
+#define BITMAP_WORDS (MAX_FLAGS / BITS_PER_LONG)
+
+typedef struct {
+    unsigned long *w;                        /* BITMAP_WORDS words */
+    int            nword;                    /* words in use, a power of 2 */
+} bitmap_t;
 
 
-#define MAX_NAME 128
+/*
+ * a shard of the message statistics of a flag, see the statistics notes
+ */
 
+#define STATS_SHARDS 8                       /* shards per flag */
 
+typedef struct {
+    uint64_t emitted;                        /* messages written */
+    uint64_t suppressed;                     /* messages not written */
+    uint64_t bytes;                          /* bytes written */
+    uint64_t format_ns;                      /* time spent formatting */
+} __attribute__((aligned(64))) stats_t;
 
 
 /*
@@ -80,10 +215,19 @@ USA.
  */
 
 typedef struct {
-    char *name;                              /* symbolic flag name */
-    char *descr;                             /* description of flag */
-    int   bit;                               /* allocated bit in module */
-    int  *flagptr;                           /* 'client' pointer to update */
+    char    *name;                           /* symbolic flag name */
+    char    *descr;                          /* description of flag */
+    int      bit;                            /* allocated bit in module */
+    int     *flagptr;                        /* 'client' pointer to update */
+    stats_t *stats;                          /* STATS_SHARDS shards or NULL */
+    int      rate;                           /* rate limit (1/s), 0 if none */
+    uint64_t interval;                       /* ns per message at the limit */
+    uint64_t tat;                            /* next message is due at */
+    uint64_t dropped;                        /* messages over the limit */
+    uint64_t reported;                       /* last suppression summary */
+    int      sample;                         /* sample 1 in N, 0 if all */
+    int      random;                         /* sample randomly, not Nth */
+    int      slot;                           /* countdown slot of sampling */
 } flag_t;
 
 
@@ -96,55 +240,248 @@ typedef struct {
     flag_t *flags;                           /* trace flags of this module */
     int     nflag;                           /* number of flags */
     int     id;                              /* module id within context */
+    hashidx_t flagidx;                       /* flags indexed by name */
+    bitmap_t  bits;                          /* bits of all flags */
+    int       borrowed;                      /* names owned by the caller */
+    size_t    memsize;                       /* arena block of flags, names */
 } module_t;
 
 
 /*
- * a trace context is a named set of trace modules
+ * a compiled trace format
+ *
+ * Context formats are compiled once when they are set into a list of
+ * ops. Literal text is emitted with a precomputed length, directives
+ * are emitted by their opcode, so messages never need to reparse the
+ * format string itself.
  */
 
+enum {
+    FMT_END = 0,                             /* end of format */
+    FMT_LITERAL,                             /* literal text */
+    FMT_CONTEXT,                             /* %c: context name */
+    FMT_MODULE,                              /* %m: module name */
+    FMT_FLAG,                                /* %f: flag name */
+    FMT_WHERE,                               /* %W: func@file:line */
+    FMT_FUNCTION,                            /* %C: __FUNCTION__ */
+    FMT_FILE,                                /* %F: __FILE__ */
+    FMT_LINE,                                /* %L: __LINE__ */
+    FMT_STAMP,                               /* %U: absolute time stamp */
+    FMT_DELTA,                               /* %u: delta time stamp */
+    FMT_CLOCK,                               /* %N: context clock in ns */
+    FMT_MESSAGE,                             /* %M: user message */
+    FMT_TAGS,                                /* %T: message tags */
+};
+
 typedef struct {
-    union {
-        unsigned long  word;                 /* 32 or less dense bits */
-        unsigned long *wptr;                 /* > 32 or sparse bits */
-    } bits;
-    int                nbit;
-} bitmap_t;
+    int         op;                          /* FMT_* opcode */
+    int         len;                         /* length of literal */
+    const char *lit;                         /* literal, points to source */
+} fmtop_t;
+
+#define STAMP_WALL  0x1                      /* needs wall-clock time */
+#define STAMP_CLOCK 0x2                      /* needs context clock time */
+
+typedef struct {
+    char    *source;                         /* format as it was given */
+    int      stamps;                         /* time stamps used, STAMP_* */
+    int      tagged;                         /* shows message tags */
+    int      pieces;                         /* max. pieces when gathering */
+    fmtop_t  ops[0];                         /* ops, terminated by FMT_END */
+} format_t;
+
+
+/*
+ * time stamps of a message
+ */
+
+typedef struct {
+    struct timeval wall;                     /* wall-clock time, for %U */
+    uint64_t       clock;                    /* context clock (ns), %u, %N */
+} tstamp_t;
+
+
+/*
+ * a message being formatted, either copied into buf or gathered into iov
+ *
+ * When gathering, stable strings (literals, names, function, file) of at
+ * least FMT_MINREF bytes are pointed to directly and everything else goes
+ * into buf. Adjacent pieces in buf are merged into a single iovec.
+ */
+
+#define FMT_MAXIOV 32                        /* max. pieces for a writev */
+#define FMT_MINREF 32                        /* min. length to not copy */
+
+typedef struct {
+    char         *buf;                       /* message or scratch buffer */
+    int           size;                      /* size of buf */
+    int           used;                      /* bytes of buf used */
+    int           len;                       /* total message length */
+    struct iovec *iov;                       /* pieces, NULL if copying */
+    int           niov;                      /* number of pieces */
+    int           grow;                      /* may move buf to msgbuf */
+} fmtout_t;
+
+
+/*
+ * output buffer for coalescing direct mode messages
+ */
+
+typedef struct {
+    pthread_mutex_t  lock;                   /* serializes buffer access */
+    char            *data;                   /* buffered messages */
+    int              size;                   /* buffer size */
+    int              used;                   /* bytes buffered */
+    int              fd;                     /* destination of buffered data */
+    uint64_t         flushed;                /* time of last flush */
+} outbuf_t;
+
+
+/*
+ * flight recorder of a context
+ */
+
+typedef struct {
+    pthread_mutex_t  lock;                   /* serializes recording */
+    char            *data;                   /* recorded messages */
+    int              size;                   /* size of data */
+    uint64_t         head;                   /* next record goes here */
+    uint64_t         tail;                   /* oldest record */
+} recorder_t;
+
+
+/*
+ * asynchronous output queue of a context
+ */
+
+typedef struct {
+    pthread_mutex_t  lock;                   /* serializes queue access */
+    pthread_cond_t   more;                   /* records queued, or stop */
+    pthread_cond_t   room;                   /* records taken off queue */
+    char            *data;                   /* queued records */
+    unsigned long    size;                   /* size of data */
+    unsigned long    head;                   /* next record goes here */
+    unsigned long    tail;                   /* oldest record */
+    int              policy;                 /* overflow policy, OVERFLOW_* */
+    uint64_t         dropped;                /* messages dropped */
+    uint64_t         spilled;                /* drops to report in output */
+    int              spillfd;                /* where to report them */
+    int              idle;                   /* writer waiting for records */
+    int              busy;                   /* writer writing a batch */
+    int              running;                /* writer thread is running */
+    int              stopping;               /* writer thread should exit */
+    pthread_t        thread;                 /* writer thread */
+} asyncq_t;
+
+
+/*
+ * tag filters of a context, see the tag filter notes below
+ */
+
+typedef struct {
+    char    *key;                            /* tag key */
+    char    *value;                          /* tag value, NULL for any */
+    regex_t *re;                             /* compiled value, or NULL */
+} filtexpr_t;
+
+typedef struct {
+    int         regexp;                      /* values are regexps */
+    int         nexpr;                       /* number of expressions */
+    filtexpr_t  exprs[0];                    /* expressions, all must match */
+} filter_t;
+
+typedef struct {
+    char  *name;                             /* indexed key=value or key */
+    int   *filters;                          /* filters anchored here */
+    int    nfilter;                          /* number of filters */
+} filtterm_t;
+
+typedef struct {
+    filter_t  **filters;                     /* filters indexed */
+    int         nfilter;                     /* number of filters */
+    int         all;                         /* some filter matches all */
+    hashidx_t   values;                      /* terms by key=value */
+    hashidx_t   keys;                        /* terms by key */
+    filtterm_t *terms;                       /* anchor terms */
+    int         nterm;                       /* number of terms */
+} filtidx_t;
+
+
+/*
+ * a memory-mapped circular trace file, see trace-mmap.h
+ */
 
+typedef struct {
+    trace_mmap_hdr_t *hdr;                   /* mapped file header */
+    char             *data;                  /* mapped data area */
+    uint64_t          size;                  /* size of data area */
+    size_t            len;                   /* size of mapping */
+} tmap_t;
+
+
+/*
+ * a trace context is a named set of trace modules
+ */
 
 typedef struct {
     char           *name;                    /* symbolic context name */
-    char           *format;                  /* trace format */
+    format_t       *format;                  /* compiled trace format */
     FILE           *destination;             /* destination for messages */
+    char           *target;                  /* target as it was given */
+    tmap_t         *map;                     /* mmap target, overrides above */
     int             disabled;                /* global state of this context */
     bitmap_t        bits;                    /* allocated bits */
     bitmap_t        mask;                    /* current state of flags */
-    module_t       *modules;                 /* actual modules */
-    int             nmodule;                 /* number of modules */
+    bitmap_t        record;                  /* flags being recorded */
+    module_t       *modules;                 /* MAX_MODULES module slots */
+    int             nmodule;                 /* number of used slots */
+    hashidx_t       modidx;                  /* modules indexed by name */
     int             id;                      /* context id */
-    struct timeval  prev;                    /* timestamp of last message */
+    int             mode;                    /* output mode, MODE_* */
+    int             clock;                   /* clock source, CLK_* */
+    uint64_t        prev;                    /* clock of last message */
+    int             flush;                   /* flush policy, FLUSH_* */
+    uint64_t        interval;                /* FLUSH_INTERVAL period (ns) */
+    outbuf_t        out;                     /* coalesced output */
+    recorder_t      recorder;                /* flight recorder */
+    asyncq_t        async;                   /* async mode output queue */
+    filter_t      **filters;                 /* tag filters */
+    int             nfilter;                 /* number of tag filters */
+    filtidx_t      *filtidx;                 /* compiled tag filters */
+    int             stats;                   /* collect flag statistics */
+    arena_t         arena;                   /* registry memory */
 } context_t;
 
 
+/*
+ * Contexts and the module slots of a context live in arrays of fixed size
+ * that are never reallocated. A context or module is valid while its name
+ * is set, which is always published last, so lookups are safe to use from
+ * the lock-free trace path (see the registry locking notes below).
+ */
+
 #define CONTEXT_LOOKUP(cid) ({                                          \
             context_t *_ctx;                                            \
-            if (unlikely(cid < 0 || cid >= ncontext))                   \
+            if (unlikely(cid < 0 || cid >= MAX_CONTEXTS))               \
                 _ctx = NULL;                                            \
             else                                                        \
-                _ctx = contexts[cid].name ? contexts + (cid) : NULL;    \
+                _ctx = __atomic_load_n(&contexts[cid].name,             \
+                                       __ATOMIC_ACQUIRE) ?              \
+                    contexts + (cid) : NULL;                            \
             _ctx;})
 
-#define MODULE_LOOKUP(ctx, id) ({                       \
-            module_t *_m;                               \
-            if ((ctx) != NULL) {                        \
-                if (0 <= (id) && (id) < (ctx)->nmodule) \
-                    _m = (ctx)->modules[id].name ?      \
-                        (ctx)->modules + (id) : NULL;   \
-                else                                    \
-                    _m = NULL;                          \
-            }                                           \
-            else                                        \
-                _m = NULL;                              \
+#define MODULE_LOOKUP(ctx, id) ({                                       \
+            module_t *_m;                                               \
+            if ((ctx) != NULL) {                                        \
+                if (0 <= (id) && (id) < MAX_MODULES)                    \
+                    _m = __atomic_load_n(&(ctx)->modules[id].name,      \
+                                         __ATOMIC_ACQUIRE) ?            \
+                        (ctx)->modules + (id) : NULL;                   \
+                else                                                    \
+                    _m = NULL;                                          \
+            }                                                           \
+            else                                                        \
+                _m = NULL;                                              \
             _m;})
 
 #define FLAG_LOOKUP(mod, idx) ({                        \
@@ -176,37 +513,154 @@ typedef struct {
     } while (0)
 
 
+static pthread_mutex_t registry_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+#define REGISTRY_LOCK()   pthread_mutex_lock(&registry_lock)
+#define REGISTRY_UNLOCK() pthread_mutex_unlock(&registry_lock)
+
+
 
-static context_t *contexts;
+static context_t  contexts[MAX_CONTEXTS];
 static int        ncontext;
+static hashidx_t  context_index;
 static int        initialized    = FALSE;
-static char      *default_format = TRACE_DEFAULT_FORMAT;
+
+unsigned long     __trace_mask[TRACE_ID_CONTEXTS][TRACE_MASK_WORDS];
+unsigned long     __trace_mask64[TRACE_ID64_CONTEXTS][TRACE_MASK64_WORDS];
+static unsigned long print_mask[MAX_CONTEXTS][TRACE_MASK64_WORDS];
 
 static int        context_init(context_t *ctx, const char *name);
 static context_t *context_find(const char *name, context_t **deleted);
 static void       context_del (context_t *ctx);
+static void       context_publish(context_t *ctx);
 
 static module_t *module_find(context_t *ctx, const char *name,
                              module_t **deleted);
+static char     *module_unlink(context_t *ctx, module_t *module);
 static void      module_free(context_t *ctx, module_t *module);
+static void      modtab_load_all(void);
 
 static flag_t *flag_find(module_t *module, const char *name, flag_t **deleted);
 
+static void  arena_init   (arena_t *a);
+static void  arena_free   (arena_t *a);
+static void *arena_alloc  (arena_t *a, size_t size);
+static void  arena_release(arena_t *a, void *ptr, size_t size);
+static char *arena_strdup (arena_t *a, const char *str);
+
+static void hash_init(hashidx_t *idx);
+static void hash_free(hashidx_t *idx);
+static int  hash_add (hashidx_t *idx, const char *name, int index);
+static void hash_del (hashidx_t *idx, const char *name);
+static int  hash_find(hashidx_t *idx, const char *name, int len);
 
-static inline int alloc_flag(context_t *ctx);
-static void       init_bits (bitmap_t *bits);
+
+static inline int alloc_bit(bitmap_t *bits, int limit);
+static int        alloc_run(bitmap_t *bits, int n, int limit);
+static inline void set_run (bitmap_t *bits, int start, int n);
+static int        init_bits (bitmap_t *bits);
 static void       free_bits (bitmap_t *bits);
 
+static inline unsigned long bits_word  (bitmap_t *bits, int i);
+static inline void          bits_or    (bitmap_t *dst, bitmap_t *src);
+static inline void          bits_andnot(bitmap_t *dst, bitmap_t *src);
+static inline int           mask_tst   (unsigned long *mask,
+                                        trace_flag64_t id);
 static inline int clr_bit(bitmap_t *tb, int n);
 static inline int set_bit(bitmap_t *tb, int n);
 static inline int tst_bit(bitmap_t *tb, int n);
 
 
-static int check_format(const char *format);
-static int format_message(context_t *ctx, int id,
+static int  ring_start(void);
+static void ring_stop (void);
+static void ring_flush(void);
+static int  ring_write(int fd, const char *msg, int len);
+static int  ring_write_binary(int fd, trace_flag64_t id, const char *file,
+                              int line, const char *func, tstamp_t *stamp,
+                              const char *format, va_list args)
+    __attribute__((noinline));               /* keep its buffer off our stack */
+
+static inline int  read_enter(void);
+static inline void read_exit (void);
+static inline void msgbuf_trim(void);
+static void        registry_sync(void);
+static void        jump_update(void);
+static void        jump_reset(void);
+static inline void jump_mark(int cid, int word);
+
+static format_t *format_compile(const char *format);
+static void      format_free(format_t *fmt);
+static int format_message(context_t *ctx, trace_flag64_t id,
+                          trace_tags_t *tags,
                           const char *file, int line, const char *func,
-                          char *buf, int bufsize,
+                          tstamp_t *stamp, char *buf, int bufsize,
                           const char *fmt, va_list args);
+static int format_alloc(context_t *ctx, trace_flag64_t id,
+                        trace_tags_t *tags,
+                        const char *file, int line, const char *func,
+                        tstamp_t *stamp, char **buf, int bufsize,
+                        const char *fmt, va_list args);
+static int format_iov(context_t *ctx, trace_flag64_t id, trace_tags_t *tags,
+                      const char *file, int line, const char *func,
+                      tstamp_t *stamp, char *scratch, int size,
+                      struct iovec *iov, int *niov,
+                      const char *fmt, va_list args);
+static int  clock_select(const char *name);
+static inline uint64_t clock_ns(int clk);
+static void stamp_take(context_t *ctx, tstamp_t *stamp);
+
+static int  buffer_init  (context_t *ctx);
+static void buffer_free  (context_t *ctx);
+static int  buffer_policy(context_t *ctx, const char *policy);
+static int  buffer_write (context_t *ctx, int fd, const char *msg, int len);
+static void buffer_flush (context_t *ctx);
+static void buffer_flush_due(void);
+static void fatal_restore(void);
+
+static void async_init  (context_t *ctx);
+static void async_free  (context_t *ctx);
+static int  async_start (context_t *ctx);
+static void async_stop  (context_t *ctx);
+static void async_flush (context_t *ctx);
+static int  async_policy(context_t *ctx, const char *policy);
+static int  async_write (context_t *ctx, int fd, const char *msg, int len);
+
+static int  filter_add   (context_t *ctx, trace_tags_t *tags, int regexp);
+static int  filter_del   (context_t *ctx, trace_tags_t *tags, int regexp);
+static void filter_reset (context_t *ctx);
+static int  filter_check (context_t *ctx, trace_tags_t *tags);
+static int  parse_filter (char *args, trace_tags_t *tags);
+
+static int  recorder_init (context_t *ctx);
+static void recorder_free (context_t *ctx);
+static int  recorder_alloc(context_t *ctx);
+static int  recorder_write(context_t *ctx, trace_flag64_t id,
+                           trace_tags_t *tags, const char *file, int line,
+                           const char *func, const char *format,
+                           va_list args);
+static int  recorder_dump (context_t *ctx, const char *target);
+
+static int             stats_alloc (module_t *mod);
+static int             stats_policy(context_t *ctx, const char *state);
+static inline stats_t *stats_get   (context_t *ctx, flag_t *flg);
+static inline void     stats_count (stats_t *st, int n, uint64_t format_ns);
+static void            stats_sum   (flag_t *flg, trace_stats_t *stats);
+
+static void       limit_set   (flag_t *flg, int rate);
+static inline int limit_check (flag_t *flg, uint64_t *now);
+static void       limit_report(context_t *ctx, trace_flag64_t id, flag_t *flg,
+                               uint64_t now, const char *file, int line,
+                               const char *func, char *buf, int size);
+static int        parse_rate  (const char *spec);
+
+static void       sample_set   (flag_t *flg, int n, int random);
+static inline int sample_check (flag_t *flg, int n);
+static void       sample_release(flag_t *flg);
+static int        parse_sample (const char *spec, int *random);
+
+static tmap_t *mmap_open (const char *target);
+static void    mmap_close(tmap_t *map);
+static int     mmap_write(tmap_t *map, const char *msg, int len);
 
 
 /********************
@@ -217,18 +671,25 @@ trace_init(void)
 {
     int err;
     
-    if (initialized)
-        return 0;
+    REGISTRY_LOCK();
 
-    if ((contexts = ALLOC_ARR(context_t, 1)) == NULL)
-        return -ENOMEM;
+    if (initialized) {
+        REGISTRY_UNLOCK();
+        return 0;
+    }
 
-    if ((err = context_init(contexts, TRACE_DEFAULT_NAME)) < 0)
+    if ((err = context_init(contexts, TRACE_DEFAULT_NAME)) < 0) {
+        REGISTRY_UNLOCK();
         return err;
+    }
     
     ncontext    = 1;
     initialized = TRUE;
+
+    modtab_load_all();
     
+    REGISTRY_UNLOCK();
+
     return 0;
 }
 
@@ -242,14 +703,29 @@ trace_exit(void)
     context_t *c;
     int              i;
     
+    ring_stop();
+
+    REGISTRY_LOCK();
+
     for (i = 0; i < ncontext; i++) {
         c = contexts + i;
-        context_del(c);
+        if (c->name != NULL)
+            context_del(c);
     }
     
-    FREE(contexts);
-    contexts = NULL;
-    ncontext = 0;
+    ncontext    = 0;
+    initialized = FALSE;
+
+    hash_free(&context_index);
+
+    memset(__trace_mask, 0, sizeof(__trace_mask));
+    memset(__trace_mask64, 0, sizeof(__trace_mask64));
+    jump_reset();
+    jump_update();
+
+    fatal_restore();
+
+    REGISTRY_UNLOCK();
 }
 
 
@@ -260,24 +736,29 @@ int
 trace_context_open(const char *name)
 {
     context_t *ctx, *deleted;
+    int        cid;
 
     if (!initialized)
         trace_init();
 
-    if ((ctx = context_find(name, &deleted)) != NULL)
-        return ctx->id;
+    REGISTRY_LOCK();
 
-    if (deleted == NULL) {
-        if (ncontext >= MAX_CONTEXTS)
-            return -ENOSPC;
-        if (REALLOC_ARR(contexts, ncontext, ncontext + 1) == NULL)
-            return -ENOMEM;
-        ctx = contexts + ncontext++;
+    if ((ctx = context_find(name, &deleted)) != NULL)
+        cid = ctx->id;
+    else {
+        if (deleted == NULL) {
+            if (ncontext >= MAX_CONTEXTS)
+                cid = -ENOSPC;
+            else
+                cid = context_init(contexts + ncontext++, name);
+        }
+        else
+            cid = context_init(deleted, name);
     }
-    else
-        ctx = deleted;
     
-    return context_init(ctx, name);
+    REGISTRY_UNLOCK();
+
+    return cid;
 }
 
 
@@ -287,25 +768,28 @@ trace_context_open(const char *name)
 int
 trace_context_close(int cid)
 {
-    context_t *ctx = CONTEXT_LOOKUP(cid);
+    context_t *ctx;
     
-    if (ctx == contexts)
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(cid);
+
+    if (ctx == contexts || !initialized) {
+        REGISTRY_UNLOCK();
         return 0;
+    }
 
-    if (ctx == NULL)
+    if (ctx == NULL) {
+        REGISTRY_UNLOCK();
         return -ENOENT;
+    }
     
     context_del(ctx);
-    if (cid == ncontext - 1) {
-        if (ncontext > 1)
-            REALLOC_ARR(contexts, ncontext, ncontext - 1);
-        else {
-            FREE(contexts);
-            contexts = NULL;
-        }
+    if (cid == ncontext - 1)
         ncontext--;
-    }
     
+    REGISTRY_UNLOCK();
+
     return 0;
 }
 
@@ -316,13 +800,18 @@ trace_context_close(int cid)
 int
 trace_context_enable(int cid)
 {
-    context_t *ctx = CONTEXT_LOOKUP(cid);
+    context_t *ctx;
 
-    if (ctx == NULL)
-        return -ENOENT;
-    
-    ctx->disabled = FALSE;
-    return 0;
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL) {
+        ctx->disabled = FALSE;
+        context_publish(ctx);
+    }
+
+    REGISTRY_UNLOCK();
+
+    return ctx != NULL ? 0 : -ENOENT;
 }
 
 
@@ -332,13 +821,18 @@ trace_context_enable(int cid)
 int
 trace_context_disable(int cid)
 {
-    context_t *ctx = CONTEXT_LOOKUP(cid);
+    context_t *ctx;
 
-    if (ctx == NULL)
-        return -ENOENT;
+    REGISTRY_LOCK();
 
-    ctx->disabled = TRUE;
-    return 0;
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL) {
+        ctx->disabled = TRUE;
+        context_publish(ctx);
+    }
+
+    REGISTRY_UNLOCK();
+
+    return ctx != NULL ? 0 : -ENOENT;
 }
 
 
@@ -348,23 +842,60 @@ trace_context_disable(int cid)
 static int
 context_target(context_t *ctx, const char *target)
 {
-    FILE *nfp, *ofp;
+    FILE   *nfp, *ofp;
+    tmap_t *nmap, *omap;
+    char   *name;
+    int     err;
+
+    ofp  = ctx->destination;
+    omap = ctx->map;
+    nmap = NULL;
+
+    if      (target == TRACE_TO_STDERR) name = STRDUP("stderr");
+    else if (target == TRACE_TO_STDOUT) name = STRDUP("stdout");
+    else                                name = STRDUP(target);
 
-    ofp = ctx->destination;
+    if (name == NULL)
+        return -ENOMEM;
 
     if      (target == TRACE_TO_STDERR) nfp = stderr;
     else if (target == TRACE_TO_STDOUT) nfp = stdout;
     else if (!strcmp(target, "stderr")) nfp = stderr;
     else if (!strcmp(target, "stdout")) nfp = stdout;
+    else if (!strncmp(target, TRACE_TO_MMAP_PREFIX,
+                      sizeof(TRACE_TO_MMAP_PREFIX) - 1)) {
+        if ((nmap = mmap_open(target)) == NULL) {
+            err = -errno;
+            FREE(name);
+            return err;
+        }
+        nfp = stderr;                   /* keep a valid fallback stream */
+    }
     else                                nfp = fopen(target, "a");
     
-    if (nfp == NULL)
-        return -errno;
+    if (nfp == NULL) {
+        err = -errno;
+        FREE(name);
+        return err;
+    }
     
-    if (ofp != NULL && ofp != stderr && ofp != stdout)
-        fclose(ofp);
+    __atomic_store_n(&ctx->destination, nfp, __ATOMIC_RELEASE);
+    __atomic_store_n(&ctx->map, nmap, __ATOMIC_RELEASE);
+
+    FREE(ctx->target);
+    ctx->target = name;
+
+    if (omap != NULL || (ofp != NULL && ofp != stderr && ofp != stdout)) {
+        registry_sync();                /* no more writers to the old fd */
+        ring_flush();                   /* ... nor queued records to it */
+        async_flush(ctx);               /* ... nor records in our queue */
+        buffer_flush(ctx);              /* ... nor buffered messages */
+        if (ofp != stderr && ofp != stdout)
+            fclose(ofp);
+        if (omap != NULL)
+            mmap_close(omap);
+    }
     
-    ctx->destination = nfp;
     return 0;
 }
 
@@ -375,930 +906,6955 @@ context_target(context_t *ctx, const char *target)
 int
 trace_context_target(int cid, const char *target)
 {
-    context_t *ctx = CONTEXT_LOOKUP(cid);
+    context_t *ctx;
+    int        err;
+
+    REGISTRY_LOCK();
 
-    if (ctx != NULL)
-        return context_target(ctx, target);
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = context_target(ctx, target);
     else
-        return -ENOENT;
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * context_format
+ * context_mode
  ********************/
-int
-context_format(context_t *ctx, const char *format)
+static int
+context_mode(context_t *ctx, const char *mode)
 {
-    int err;
-    
-    if ((err = check_format(format)) < 0)
-        return err;
-    else {
-        if (ctx->format != default_format)
-            FREE(ctx->format);
-        if ((ctx->format = STRDUP(format)) == NULL) {
-            ctx->format = default_format;
-            return -ENOMEM;
+    int old, err;
+
+    if (mode == NULL)
+        return -EINVAL;
+
+    old = ctx->mode;
+
+    if (!strcmp(mode, TRACE_MODE_DIRECT)) {
+        if (ctx->mode != MODE_DIRECT) {
+            __atomic_store_n(&ctx->mode, MODE_DIRECT, __ATOMIC_RELEASE);
+            registry_sync();
+            ring_flush();
         }
     }
-    
+    else if (!strcmp(mode, TRACE_MODE_RING)) {
+        if ((err = ring_start()) < 0)
+            return err;
+        __atomic_store_n(&ctx->mode, MODE_RING, __ATOMIC_RELEASE);
+    }
+    else if (!strcmp(mode, TRACE_MODE_BINARY)) {
+        if ((err = ring_start()) < 0)
+            return err;
+        __atomic_store_n(&ctx->mode, MODE_BINARY, __ATOMIC_RELEASE);
+    }
+    else if (!strcmp(mode, TRACE_MODE_ASYNC)) {
+        if ((err = async_start(ctx)) < 0)
+            return err;
+        __atomic_store_n(&ctx->mode, MODE_ASYNC, __ATOMIC_RELEASE);
+    }
+    else
+        return -EINVAL;
+
+    if (old == MODE_ASYNC && ctx->mode != MODE_ASYNC) {
+        registry_sync();                /* no more writers to the queue */
+        async_stop(ctx);
+    }
+
     return 0;
 }
 
 
 /********************
- * trace_context_format
+ * trace_context_mode
  ********************/
 int
-trace_context_format(int cid, const char *format)
+trace_context_mode(int cid, const char *mode)
 {
-    context_t *ctx = CONTEXT_LOOKUP(cid);
-    
-    if (ctx != NULL)
-        return context_format(ctx, format);
+    context_t *ctx;
+    int        err;
+
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = context_mode(ctx, mode);
     else
-        return -ENOENT;
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * trace_flag_set
+ * context_clock
  ********************/
-int
-trace_flag_set(int id)
+static int
+context_clock(context_t *ctx, const char *name)
 {
-    context_t *ctx;
-    module_t  *mod;
-    flag_t    *flg;
-    int        c, m, i, b;
-    
-    c = FLAG_CTX(id);
-    m = FLAG_MOD(id);
-    i = FLAG_IDX(id);
-    b = FLAG_BIT(id);
-    
-    ctx = CONTEXT_LOOKUP(c);
-    mod = MODULE_LOOKUP(ctx, m);
-    flg = FLAG_LOOKUP(mod, i);
+    int clk;
 
-    if (unlikely(flg == NULL))
-        return -ENOENT;
+    if ((clk = clock_select(name)) < 0)
+        return clk;
 
-    if (unlikely(flg->bit != b))
-        return -EINVAL;
-    
-    return set_bit(&ctx->mask, flg->bit);
+    __atomic_store_n(&ctx->clock, clk, __ATOMIC_RELEASE);
+    ctx->prev = 0;                        /* restart deltas on new clock */
+
+    return 0;
 }
 
 
 /********************
- * trace_flag_clr
+ * trace_context_clock
  ********************/
 int
-trace_flag_clr(int id)
+trace_context_clock(int cid, const char *clock)
 {
     context_t *ctx;
-    module_t  *mod;
-    flag_t    *flg;
-    int        c, m, i, b;
-    
-    c = FLAG_CTX(id);
-    m = FLAG_MOD(id);
-    i = FLAG_IDX(id);
-    b = FLAG_BIT(id);
+    int        err;
 
-    ctx = CONTEXT_LOOKUP(c);
-    mod = MODULE_LOOKUP(ctx, m);
-    flg = FLAG_LOOKUP(mod, i);
+    REGISTRY_LOCK();
 
-    if (unlikely(flg == NULL))
-        return -ENOENT;
-    
-    if (unlikely(flg->bit != b))
-        return -EINVAL;
-    
-    return clr_bit(&ctx->mask, flg->bit);
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = context_clock(ctx, clock);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * trace_flag_tst
+ * trace_context_flush
  ********************/
 int
-trace_flag_tst(int id)
+trace_context_flush(int cid, const char *policy)
 {
     context_t *ctx;
-    module_t  *mod;
-    flag_t    *flg;
-    int        c, m, i, b;
-    
-    c = FLAG_CTX(id);
-    m = FLAG_MOD(id);
-    i = FLAG_IDX(id);
-    b = FLAG_BIT(id);
+    int        err;
 
-    ctx = CONTEXT_LOOKUP(c);
-    mod = MODULE_LOOKUP(ctx, m);
-    flg = FLAG_LOOKUP(mod, i);
+    REGISTRY_LOCK();
 
-    if (unlikely(flg == NULL))
-        return -ENOENT;
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL) {
+        if (policy != NULL)
+            err = buffer_policy(ctx, policy);
+        else {
+            async_flush(ctx);
+            buffer_flush(ctx);
+            err = 0;
+        }
+    }
+    else
+        err = -ENOENT;
 
-    if (unlikely(flg->bit != b))
-        return - EINVAL;
-    
-    return tst_bit(&ctx->mask, flg->bit);
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * __trace_printf
+ * trace_context_dump
  ********************/
 int
-__trace_printf(int id, const char *file, int line, const char *func,
-               const char *format, ...)
+trace_context_dump(int cid, const char *target)
 {
-    int        cid = FLAG_CTX(id);
-    context_t *ctx = CONTEXT_LOOKUP(cid);
-    va_list    ap;
-    char       buf[4096];
-    int        n;
-    
-    if (ctx == NULL)
-        return -ENOENT;
-    
-    if (ctx->disabled || !trace_flag_tst(id))
-        return 0;
-    
-    va_start(ap, format);
-    n = format_message(ctx, id, file, line, func, buf, sizeof(buf), format, ap);
-    va_end(ap);
-    if (n < 0)
-        return n;
-    fflush(ctx->destination);
-    n = write(fileno(ctx->destination), buf, n - 1);
+    context_t *ctx;
+    int        err;
 
-    return n;
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = recorder_dump(ctx, target);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * context_init
+ * trace_context_stats
  ********************/
-static int
-context_init(context_t *ctx, const char *name)
+int
+trace_context_stats(int cid, const char *state)
 {
-    if ((ctx->name = STRDUP(name)) == NULL)
-        return -ENOMEM;
-    
-    ctx->format      = default_format;
-    ctx->destination = stderr;
+    context_t *ctx;
+    int        err;
 
-    init_bits(&ctx->bits);
-    init_bits(&ctx->mask);
+    REGISTRY_LOCK();
 
-    ctx->id = ((int)((void *)ctx - (void *)contexts)) / sizeof(*ctx);
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = stats_policy(ctx, state);
+    else
+        err = -ENOENT;
 
-    return ctx->id;
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * context_del
+ * trace_context_overflow
  ********************/
-static void
-context_del(context_t *ctx)
+int
+trace_context_overflow(int cid, const char *policy)
 {
-    int i;
+    context_t *ctx;
+    int        err;
 
-    FREE(ctx->name);
-    ctx->name = NULL;
+    REGISTRY_LOCK();
 
-    if (ctx->format != default_format)
-        FREE(ctx->format);
-    ctx->format = NULL;
-    
-    if (ctx->destination != stderr && ctx->destination != stdout) {
-        fflush(ctx->destination);
-        fclose(ctx->destination);
-        ctx->destination = NULL;
-    }
-    
-    for (i = 0; i < ctx->nmodule; i++)
-        module_free(ctx, ctx->modules + i);
-    
-    FREE(ctx->modules);
-    ctx->modules = NULL;
-    ctx->nmodule = 0;
-    
-    free_bits(&ctx->bits);
-    free_bits(&ctx->mask);
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = async_policy(ctx, policy);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * context_find
+ * trace_context_dropped
  ********************/
-static context_t *
-context_find(const char *name, context_t **deleted)
+int
+trace_context_dropped(int cid, uint64_t *dropped)
 {
     context_t *ctx;
-    int              i;
 
-    if (deleted != NULL)
-        *deleted = NULL;
-    
-    for (i = 0; i < ncontext; i++) {
-        ctx = contexts + i;
-        if (ctx->name == NULL) {
-            if (deleted != NULL && *deleted == NULL)
-                *deleted = ctx;
-            continue;
-        }
-        if (!strcmp(ctx->name, name))
-            return ctx;
-    }
+    REGISTRY_LOCK();
 
-    return NULL;
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        *dropped = __atomic_load_n(&ctx->async.dropped, __ATOMIC_RELAXED);
+
+    REGISTRY_UNLOCK();
+
+    return ctx != NULL ? 0 : -ENOENT;
 }
 
 
 /********************
- * trace_add_module
+ * trace_add_simple_filter
  ********************/
 int
-trace_add_module(int cid, trace_moduledef_t *moddef)
+trace_add_simple_filter(int cid, trace_tags_t *filter)
 {
-    context_t       *ctx = CONTEXT_LOOKUP(cid);
-    trace_flagdef_t *flagdef;
-    module_t        *mod, *deleted;
-    flag_t          *flag;
-    int              i, nflag, n;
-
-    
-    if (ctx == NULL)
-        return -ENOENT;
-
-    if (moddef->name == NULL) {
-        WARNING("Module with NULL name for context %s.", ctx->name);
-        return -EINVAL;
-    }
-    
-    if (module_find(ctx, moddef->name, &deleted) != NULL) {
-        WARNING("Context %s already has a module %s.", ctx->name,
-                      moddef->name);
-        return -EEXIST;
-    }
+    context_t *ctx;
+    int        err;
 
-    nflag = 0;
-    for (i = 0, flagdef = moddef->flags; i < moddef->nflag; i++, flagdef++) {
-        if (flagdef->name == NULL || flagdef->flagptr == NULL) {
-            if (i == moddef->nflag - 1)  /* it's okay to NULL-terminate */
-                continue;
-            WARNING("#%d flag of %s.%s is invalid.", i + 1, ctx->name,
-                          moddef->name);
-            return -EINVAL;
-        }
-        nflag++;
-    }
+    REGISTRY_LOCK();
 
-    if (deleted == NULL) {
-        n = ctx->nmodule;
-        if (REALLOC_ARR(ctx->modules, n, n + 1) == NULL)
-            return -ENOMEM;
-        
-        mod = ctx->modules + ctx->nmodule;
-        mod->id = ctx->nmodule++;
-    }
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = filter_add(ctx, filter, FALSE);
     else
-        mod = deleted;
-    
-    if ((mod->name = STRDUP(moddef->name)) == NULL)
-        return - ENOMEM;
-    
-    if ((mod->flags = ALLOC_ARR(typeof(*mod->flags), nflag)) == NULL)
-        return -ENOMEM;
-    
-    mod->nflag = nflag;
+        err = -ENOENT;
 
-    /* save module and allocate flag bits */
-    for (i = 0; i < nflag; i++) {
-        flag    = mod->flags + i;
-        flagdef = moddef->flags + i;
-        if ((flag->name  = STRDUP(flagdef->name))  == NULL ||
-            (flag->descr = STRDUP(flagdef->descr)) == NULL ||
-            (flag->bit   = alloc_flag(ctx)) < 0) {
-            module_free(ctx, mod);
-            return -ENOMEM;
-        }
-        
-        if (flag->bit >= MAX_FLAGS) {
-            module_free(ctx, mod);
-            return -EOVERFLOW;
-        }
-        
-        *flagdef->flagptr = FLAG_ID(ctx->id, mod->id, i, flag->bit);
-        flag->flagptr     = flagdef->flagptr;
-    }
-    
-    return 0;
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * trace_del_module
+ * trace_del_simple_filter
  ********************/
 int
-trace_del_module(int cid, const char *name)
+trace_del_simple_filter(int cid, trace_tags_t *filter)
 {
     context_t *ctx;
-    module_t  *module;
+    int        err;
 
-    if (name == NULL)
-        return -EINVAL;
-    
-    if ((ctx = CONTEXT_LOOKUP(cid)) == NULL)
-        return -ENOENT;
-    
-    if ((module = module_find(ctx, name, NULL)) == NULL)
-        return -ENOENT;
-    
-    module_free(ctx, module);
-    if (module->id == ctx->nmodule - 1) {
-        if (ctx->nmodule > 1)
-            REALLOC_ARR(ctx->modules, ctx->nmodule, ctx->nmodule - 1);
-        else {
-            FREE(ctx->modules);
-            ctx->modules = NULL;
-        }
-        ctx->nmodule--;
-    }
-    
-    return 0;
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = filter_del(ctx, filter, FALSE);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
 }
 
 
 /********************
- * module_find
+ * trace_add_regexp_filter
  ********************/
-static module_t *
-module_find(context_t *ctx, const char *name, module_t **deleted)
+int
+trace_add_regexp_filter(int cid, trace_tags_t *filter)
 {
-    module_t *m;
-    int       i;
+    context_t *ctx;
+    int        err;
 
-    if (deleted != NULL)
-        *deleted = NULL;
-    
-    for (i = 0, m = ctx->modules; i < ctx->nmodule; i++, m++) {
-        if (m->name == NULL) {
-            if (deleted != NULL && *deleted == NULL)
-                *deleted = m;
-            continue;
-        }
-        if (!strcmp(m->name, name))
-            return m;
-    }
-    
-    return NULL;
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = filter_add(ctx, filter, TRUE);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
 }
- 
- 
+
+
 /********************
- * module_free
+ * trace_del_regexp_filter
  ********************/
-static void
-module_free(context_t *ctx, module_t *module)
+int
+trace_del_regexp_filter(int cid, trace_tags_t *filter)
 {
-    flag_t *flag;
-    int     i;
+    context_t *ctx;
+    int        err;
 
-    FREE(module->name);
-    module->name = NULL;
+    REGISTRY_LOCK();
 
-    for (i = 0, flag = module->flags; i < module->nflag; i++, flag++) {
-        FREE(flag->name);
-        FREE(flag->descr);
-        flag->name  = NULL;
-        flag->descr = NULL;
-        if (ctx != NULL) {
-            clr_bit(&ctx->bits, flag->bit);
-            clr_bit(&ctx->mask, flag->bit);
-        }
-    }
-    FREE(module->flags);
-    module->flags = NULL;
-    module->nflag = 0;
-}
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = filter_del(ctx, filter, TRUE);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
 
+    return err;
+}
 
 
 /********************
- * flag_find
+ * trace_reset_filters
  ********************/
-static flag_t *
-flag_find(module_t *module, const char *name, flag_t **deleted)
+int
+trace_reset_filters(int cid)
 {
-    flag_t *f;
-    int     i;
+    context_t *ctx;
 
-    if (deleted != NULL)
-        *deleted = NULL;
-    
-    for (i = 0, f = module->flags; i < module->nflag; i++, f++) {
-        if (f->name == NULL) {
-            if (deleted != NULL && *deleted == NULL)
-                *deleted = f;
-            continue;
-        }
-        if (!strcmp(f->name, name))
-            return f;
-    }
-    
-    return NULL;
-}
+    REGISTRY_LOCK();
 
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        filter_reset(ctx);
+
+    REGISTRY_UNLOCK();
+
+    return ctx != NULL ? 0 : -ENOENT;
+}
 
-/*****************************************************************************
- *                           *** message formatting ***                      *
- *****************************************************************************/
 
 /********************
- * get_timestamp
+ * context_format
  ********************/
-static char *
-get_timestamp(char *buf, struct timeval *tv)
+int
+context_format(context_t *ctx, const char *format)
 {
-    struct tm  tm;
-    time_t     now;
-    int        ms;
-    char      *d, *lc_time;
-
-    /* must have buffer of TIMESTAMP_SIZE or more bytes */
+    format_t *old, *new;
     
-    if (unlikely(gettimeofday(tv, NULL) < 0)) {
-        strcpy(buf, STAMP_UNKNOWN);
-        return buf;
-    }
-    now = tv->tv_sec;
-    ms  = tv->tv_usec / 1000;
+    if ((new = format_compile(format)) == NULL)
+        return -errno;
 
-    if (unlikely(gmtime_r(&now, &tm) == NULL)) {
-        strcpy(buf, STAMP_UNKNOWN);
-        return buf;
-    }
-    
-    lc_time = setlocale(LC_TIME, NULL);
-    setlocale(LC_TIME, "C");
+    old = ctx->format;
+    __atomic_store_n(&ctx->format, new, __ATOMIC_RELEASE);
 
-    d = buf;
-    strftime(d, STAMP_SIZE, STAMP_FORMAT, &tm);
-    d += STAMP_STRFLEN;
+    if (old != NULL) {
+        registry_sync();
+        format_free(old);
+    }
     
-    d[0] = '.';
-    d[1] = '0' + ms / 100; ms %= 100;
-    d[2] = '0' + ms /  10; ms %=  10;
-    d[3] = '0' + ms;
-    d[4] = '\0';
-
-    setlocale(LC_TIME, lc_time);
-        
-    return buf;
-
+    return 0;
 }
 
 
 /********************
- * format_message
+ * trace_context_format
  ********************/
-static int
-format_message(context_t *ctx, int id,
-               const char *file, int line, const char *func,
-               char *buf, int bufsize, const char *format, va_list args)
+int
+trace_context_format(int cid, const char *format)
 {
-#define CHECK_SPACE(need, got) do {                     \
-        if ((got) < (need))                             \
-            goto nospace;                               \
-    } while (0)
+    context_t *ctx;
+    int        err;
+
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = context_format(ctx, format);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_flag_set64
+ ********************/
+int
+trace_flag_set64(trace_flag64_t id)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    int        c, m, i, b, err;
     
-#define TIMEVAL_DIFF(diff, now, prev) do {                        \
-        diff.tv_sec = now.tv_sec - prev.tv_sec;                   \
-        if (now.tv_usec >= prev.tv_usec)                          \
-            diff.tv_usec = now.tv_usec - prev.tv_usec;            \
-        else {                                                    \
-            diff.tv_sec--;                                        \
-            diff.tv_usec = 1000000 - prev.tv_usec + now.tv_usec;  \
-        }                                                         \
-    } while (0)
+    c = FLAG_CTX(id);
+    m = FLAG_MOD(id);
+    i = FLAG_IDX(id);
+    b = FLAG_BIT(id);
+    
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(c);
+    mod = MODULE_LOOKUP(ctx, m);
+    flg = FLAG_LOOKUP(mod, i);
+
+    if (unlikely(flg == NULL))
+        err = -ENOENT;
+    else if (unlikely(flg->bit != b))
+        err = -EINVAL;
+    else if ((err = set_bit(&ctx->mask, flg->bit)) == 0) {
+        clr_bit(&ctx->record, flg->bit);
+        context_publish(ctx);
+    }
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
 
+/********************
+ * trace_flag_clr64
+ ********************/
+int
+trace_flag_clr64(trace_flag64_t id)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    int        c, m, i, b, err;
     
-    module_t *mod;
-    flag_t   *flg;
-    int       m, f;
+    c = FLAG_CTX(id);
+    m = FLAG_MOD(id);
+    i = FLAG_IDX(id);
+    b = FLAG_BIT(id);
+    
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(c);
+    mod = MODULE_LOOKUP(ctx, m);
+    flg = FLAG_LOOKUP(mod, i);
+
+    if (unlikely(flg == NULL))
+        err = -ENOENT;
+    else if (unlikely(flg->bit != b))
+        err = -EINVAL;
+    else if ((err = clr_bit(&ctx->mask, flg->bit)) == 0) {
+        clr_bit(&ctx->record, flg->bit);
+        context_publish(ctx);
+    }
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_flag_record64
+ ********************/
+int
+trace_flag_record64(trace_flag64_t id)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    int        c, m, i, b, err;
+    
+    c = FLAG_CTX(id);
+    m = FLAG_MOD(id);
+    i = FLAG_IDX(id);
+    b = FLAG_BIT(id);
+    
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(c);
+    mod = MODULE_LOOKUP(ctx, m);
+    flg = FLAG_LOOKUP(mod, i);
+
+    if (unlikely(flg == NULL))
+        err = -ENOENT;
+    else if (unlikely(flg->bit != b))
+        err = -EINVAL;
+    else if ((err = recorder_alloc(ctx)) == 0 &&
+             (err = set_bit(&ctx->record, flg->bit)) == 0) {
+        clr_bit(&ctx->mask, flg->bit);
+        context_publish(ctx);
+    }
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_flag_tst64
+ ********************/
+int
+trace_flag_tst64(trace_flag64_t id)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    int        c, m, i, b, err;
+    
+    c = FLAG_CTX(id);
+    m = FLAG_MOD(id);
+    i = FLAG_IDX(id);
+    b = FLAG_BIT(id);
+    
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(c);
+    mod = MODULE_LOOKUP(ctx, m);
+    flg = FLAG_LOOKUP(mod, i);
+
+    if (unlikely(flg == NULL))
+        err = -ENOENT;
+    else if (unlikely(flg->bit != b))
+        err = -EINVAL;
+    else
+        err = tst_bit(&ctx->mask, flg->bit);
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_flag_set
+ ********************/
+int
+trace_flag_set(int id)
+{
+    return trace_flag_set64(FLAG_ID64(id));
+}
+
+
+/********************
+ * trace_flag_clr
+ ********************/
+int
+trace_flag_clr(int id)
+{
+    return trace_flag_clr64(FLAG_ID64(id));
+}
+
+
+/********************
+ * trace_flag_record
+ ********************/
+int
+trace_flag_record(int id)
+{
+    return trace_flag_record64(FLAG_ID64(id));
+}
+
+
+/********************
+ * trace_flag_tst
+ ********************/
+int
+trace_flag_tst(int id)
+{
+    return trace_flag_tst64(FLAG_ID64(id));
+}
+
+
+/********************
+ * trace_flag_limit64
+ ********************/
+int
+trace_flag_limit64(trace_flag64_t id, int rate)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    int        c, m, i, b, err;
+
+    if (rate < 0)
+        return -EINVAL;
+
+    c = FLAG_CTX(id);
+    m = FLAG_MOD(id);
+    i = FLAG_IDX(id);
+    b = FLAG_BIT(id);
+    
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(c);
+    mod = MODULE_LOOKUP(ctx, m);
+    flg = FLAG_LOOKUP(mod, i);
+
+    if (unlikely(flg == NULL))
+        err = -ENOENT;
+    else if (unlikely(flg->bit != b))
+        err = -EINVAL;
+    else {
+        limit_set(flg, rate);
+        err = 0;
+    }
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_flag_limit
+ ********************/
+int
+trace_flag_limit(int id, int rate)
+{
+    return trace_flag_limit64(FLAG_ID64(id), rate);
+}
+
+
+/********************
+ * trace_flag_sample64
+ ********************/
+int
+trace_flag_sample64(trace_flag64_t id, int n, int random)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    int        c, m, i, b, err;
+
+    if (n < 0)
+        return -EINVAL;
+
+    c = FLAG_CTX(id);
+    m = FLAG_MOD(id);
+    i = FLAG_IDX(id);
+    b = FLAG_BIT(id);
+    
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(c);
+    mod = MODULE_LOOKUP(ctx, m);
+    flg = FLAG_LOOKUP(mod, i);
+
+    if (unlikely(flg == NULL))
+        err = -ENOENT;
+    else if (unlikely(flg->bit != b))
+        err = -EINVAL;
+    else {
+        sample_set(flg, n, random);
+        err = 0;
+    }
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_flag_sample
+ ********************/
+int
+trace_flag_sample(int id, int n, int random)
+{
+    return trace_flag_sample64(FLAG_ID64(id), n, random);
+}
+
+
+/********************
+ * trace_flag_lookup64
+ ********************/
+int
+trace_flag_lookup64(const char *name, trace_flag64_t *id)
+{
+    context_t  *ctx;
+    module_t   *mod;
+    flag_t     *flg;
+    const char *m, *f;
+    int         c, i, err;
+
+    /* resolve a qualified context.module.flag name to a flag id */
+
+    if (name == NULL || id == NULL ||
+        (m = strchr(name, '.')) == NULL || (f = strrchr(name, '.')) == m)
+        return -EINVAL;
+    m++;
+    f++;
+
+    REGISTRY_LOCK();
+
+    ctx = NULL;
+    mod = NULL;
+    flg = NULL;
+
+    if ((c = hash_find(&context_index, name, m - 1 - name)) >= 0) {
+        ctx = contexts + c;
+        if ((i = hash_find(&ctx->modidx, m, f - 1 - m)) >= 0) {
+            mod = ctx->modules + i;
+            if ((i = hash_find(&mod->flagidx, f, strlen(f))) >= 0)
+                flg = mod->flags + i;
+        }
+    }
+
+    if (flg != NULL) {
+        *id = FLAG_ID(ctx->id, mod->id, flg - mod->flags, flg->bit);
+        err = 0;
+    }
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_flag_lookup
+ ********************/
+int
+trace_flag_lookup(const char *name)
+{
+    trace_flag64_t id;
+    int            err;
+
+    if ((err = trace_flag_lookup64(name, &id)) != 0)
+        return err;
+
+    if (FLAG_CTX(id) >= MAX_CONTEXTS32 || FLAG_BIT(id) >= MAX_FLAGS32 ||
+        FLAG_IDX(id) >= MAX_FLAGIDX32)
+        return -EOVERFLOW;              /* not representable as an int id */
+
+    return FLAG_ID32(FLAG_CTX(id), FLAG_MOD(id), FLAG_IDX(id), FLAG_BIT(id));
+}
+
+
+/********************
+ * trace_stats64
+ ********************/
+int
+trace_stats64(trace_flag64_t id, trace_stats_t *stats)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    int        err;
+
+    if (stats == NULL)
+        return -EINVAL;
+
+    REGISTRY_LOCK();
+
+    ctx = CONTEXT_LOOKUP(FLAG_CTX(id));
+    mod = MODULE_LOOKUP(ctx, FLAG_MOD(id));
+    flg = FLAG_LOOKUP(mod, FLAG_IDX(id));
+
+    if (unlikely(flg == NULL))
+        err = -ENOENT;
+    else if (unlikely(flg->bit != FLAG_BIT(id)))
+        err = -EINVAL;
+    else {
+        stats_sum(flg, stats);
+        err = 0;
+    }
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_stats
+ ********************/
+int
+trace_stats(int id, trace_stats_t *stats)
+{
+    return trace_stats64(FLAG_ID64(id), stats);
+}
+
+
+/********************
+ * trace_output
+ ********************/
+static int
+trace_output(context_t *ctx, FILE *fp, tmap_t *map, int mode,
+             const char *msg, int len)
+{
+    if (map != NULL)                         /* no syscalls, in any mode */
+        return mmap_write(map, msg, len);
+    else if (mode == MODE_ASYNC)
+        return async_write(ctx, fileno(fp), msg, len);
+    else if (mode != MODE_DIRECT)
+        return ring_write(fileno(fp), msg, len);
+    else if (__atomic_load_n(&ctx->flush, __ATOMIC_ACQUIRE) != FLUSH_LINE)
+        return buffer_write(ctx, fileno(fp), msg, len);
+    else {
+        fflush(fp);
+        return write(fileno(fp), msg, len);
+    }
+}
+
+
+/********************
+ * trace_gather
+ ********************/
+static int
+trace_gather(context_t *ctx, tmap_t *map, int mode)
+{
+    /* whether we can writev a gathered message instead of copying it */
+
+    if (map != NULL || mode != MODE_DIRECT)
+        return FALSE;
+    if (__atomic_load_n(&ctx->flush, __ATOMIC_ACQUIRE) != FLUSH_LINE)
+        return FALSE;
+
+    return __atomic_load_n(&ctx->format, __ATOMIC_ACQUIRE)->pieces
+        <= FMT_MAXIOV;
+}
+
+
+/********************
+ * trace_vprintf
+ ********************/
+static int
+trace_vprintf(trace_flag64_t id, trace_tags_t *tags, const char *file,
+              int line, const char *func, const char *format, va_list args)
+{
+    context_t *ctx;
+    module_t  *mod;
+    flag_t    *flg;
+    stats_t   *st;
+    FILE      *fp;
+    tmap_t    *map;
+    va_list    ap;
+    tstamp_t   stamp;
+    char       buf[MAX_STACKMSG], *msg;
+    struct iovec iov[FMT_MAXIOV];
+    uint64_t   start, now;
+    int        n, mode, sample, niov;
+    
+    if (unlikely(read_enter() < 0))
+        return -ENOMEM;
+
+    if ((ctx = CONTEXT_LOOKUP(FLAG_CTX(id))) == NULL) {
+        n = -ENOENT;
+        goto out;
+    }
+    
+    if (!__trace_enabled64(id)) {            /* context or flag disabled */
+        n = 0;
+        goto out;
+    }
+    
+    mod = MODULE_LOOKUP(ctx, FLAG_MOD(id));
+    flg = FLAG_LOOKUP(mod, FLAG_IDX(id));
+
+    if (unlikely(flg == NULL || flg->bit != FLAG_BIT(id))) {
+        n = -ENOENT;
+        goto out;
+    }
+
+    st = stats_get(ctx, flg);
+
+    if (tags != NULL && !filter_check(ctx, tags)) {
+        stats_count(st, 0, 0);               /* filtered out by tags */
+        n = 0;
+        goto out;
+    }
+
+    if (!mask_tst(print_mask[ctx->id], id)) { /* only recorded, not printed */
+        n = recorder_write(ctx, id, tags, file, line, func, format, args);
+        stats_count(st, 0, 0);
+        goto out;
+    }
+
+    sample = __atomic_load_n(&flg->sample, __ATOMIC_ACQUIRE);
+    if (unlikely(sample > 1) && !sample_check(flg, sample)) {
+        stats_count(st, 0, 0);               /* not sampled */
+        n = 0;
+        goto out;
+    }
+
+    if (unlikely(__atomic_load_n(&flg->interval, __ATOMIC_RELAXED) != 0)) {
+        if (!limit_check(flg, &now)) {       /* over the rate limit */
+            stats_count(st, 0, 0);
+            n = 0;
+            goto out;
+        }
+        if (unlikely(__atomic_load_n(&flg->dropped, __ATOMIC_RELAXED) != 0))
+            limit_report(ctx, id, flg, now, file, line, func,
+                         buf, sizeof(buf));
+    }
+
+    fp   = __atomic_load_n(&ctx->destination, __ATOMIC_ACQUIRE);
+    map  = __atomic_load_n(&ctx->map, __ATOMIC_ACQUIRE);
+    mode = __atomic_load_n(&ctx->mode, __ATOMIC_ACQUIRE);
+
+    if (mode == MODE_BINARY && map == NULL &&
+        (tags == NULL || !__atomic_load_n(&ctx->format,
+                                          __ATOMIC_ACQUIRE)->tagged)) {
+        stamp_take(ctx, &stamp);
+        va_copy(ap, args);
+        n = ring_write_binary(fileno(fp), id, file, line, func, &stamp,
+                              format, ap);
+        va_end(ap);
+        if (n != -ENOTSUP && n != -EOVERFLOW) {    /* format it ourselves */
+            stats_count(st, n, 0);
+            goto out;
+        }
+    }
+
+    start = st != NULL ? clock_ns(CLK_MONOTONIC) : 0;
+    niov  = 0;
+    n     = -ENOBUFS;
+    if (trace_gather(ctx, map, mode))        /* buf is only scratch space */
+        n = format_iov(ctx, id, tags, file, line, func, NULL, buf,
+                       sizeof(buf), iov, &niov, format, args);
+    msg = buf;
+    if (n == -ENOBUFS)
+        n = format_alloc(ctx, id, tags, file, line, func, NULL, &msg,
+                         sizeof(buf), format, args);
+    if (st != NULL)
+        start = clock_ns(CLK_MONOTONIC) - start;
+    if (n < 0) {
+        stats_count(st, n, start);
+        goto out;
+    }
+
+    if (niov > 1) {
+        fflush(fp);
+        n = writev(fileno(fp), iov, niov);
+    }
+    else if (niov == 1) {
+        fflush(fp);
+        n = write(fileno(fp), iov[0].iov_base, iov[0].iov_len);
+    }
+    else
+        n = trace_output(ctx, fp, map, mode, msg, n - 1);
+
+    stats_count(st, n, start);
+
+ out:
+    msgbuf_trim();
+    read_exit();
+    return n;
+}
+
+
+/********************
+ * __trace_printf64
+ ********************/
+int
+__trace_printf64(trace_flag64_t id, const char *file, int line,
+                 const char *func, const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, format);
+    n = trace_vprintf(id, NULL, file, line, func, format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+
+/********************
+ * __trace_printf
+ ********************/
+int
+__trace_printf(int id, const char *file, int line, const char *func,
+               const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, format);
+    n = trace_vprintf(FLAG_ID64(id), NULL, file, line, func, format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+
+/********************
+ * __trace_printf_tags64
+ ********************/
+int
+__trace_printf_tags64(trace_flag64_t id, trace_tags_t *tags,
+                      const char *file, int line, const char *func,
+                      const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, format);
+    n = trace_vprintf(id, tags, file, line, func, format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+
+/********************
+ * __trace_printf_tags
+ ********************/
+int
+__trace_printf_tags(int id, trace_tags_t *tags, const char *file, int line,
+                    const char *func, const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, format);
+    n = trace_vprintf(FLAG_ID64(id), tags, file, line, func, format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+
+/********************
+ * trace_tag_add
+ ********************/
+int
+trace_tag_add(trace_tags_t *tags, const char *key, const char *value)
+{
+    trace_tag_t *t;
+
+    if (tags == NULL || key == NULL || value == NULL)
+        return -EINVAL;
+
+    if (tags->ntag >= tags->size)
+        return -ENOSPC;
+
+    t        = tags->tags + tags->ntag++;
+    t->key   = key;
+    t->value = value;
+
+    return 0;
+}
+
+
+/********************
+ * trace_tag_addf
+ ********************/
+int
+trace_tag_addf(trace_tags_t *tags, const char *key, const char *format, ...)
+{
+    va_list  ap;
+    char    *value;
+    int      left, n;
+
+    if (tags == NULL || key == NULL || format == NULL)
+        return -EINVAL;
+
+    if (tags->ntag >= tags->size)
+        return -ENOSPC;
+
+    value = tags->buf + tags->used;
+    left  = tags->bufsize - tags->used;
+
+    va_start(ap, format);
+    n = vsnprintf(value, left, format, ap);
+    va_end(ap);
+
+    if (n < 0 || n >= left)
+        return -ENOSPC;
+
+    tags->used += n + 1;
+
+    return trace_tag_add(tags, key, value);
+}
+
+
+/********************
+ * context_init
+ ********************/
+static int
+context_init(context_t *ctx, const char *name)
+{
+    char *cname;
+
+    arena_init(&ctx->arena);
+
+    if ((cname = arena_strdup(&ctx->arena, name)) == NULL)
+        return -ENOMEM;
+
+    if ((ctx->format = format_compile(TRACE_DEFAULT_FORMAT)) == NULL) {
+        arena_free(&ctx->arena);
+        return -ENOMEM;
+    }
+
+    ctx->modules = arena_alloc(&ctx->arena, MAX_MODULES * sizeof(module_t));
+
+    if (ctx->modules == NULL) {
+        format_free(ctx->format);
+        ctx->format = NULL;
+        arena_free(&ctx->arena);
+        return -ENOMEM;
+    }
+
+    buffer_init(ctx);
+    async_init(ctx);
+    
+    ctx->nmodule     = 0;
+    ctx->destination = stderr;
+    ctx->target      = NULL;
+    ctx->map         = NULL;
+    ctx->mode        = MODE_DIRECT;
+    ctx->disabled    = FALSE;
+    ctx->clock       = CLK_MONOTONIC;
+    ctx->prev        = 0;
+    ctx->flush       = FLUSH_LINE;
+    ctx->interval    = 0;
+    ctx->stats       = FALSE;
+    ctx->filters     = NULL;
+    ctx->nfilter     = 0;
+    ctx->filtidx     = NULL;
+
+    recorder_init(ctx);
+
+    ctx->id = ((int)((void *)ctx - (void *)contexts)) / sizeof(*ctx);
+
+    hash_init(&ctx->modidx);
+
+    ctx->bits.w = ctx->mask.w = ctx->record.w = NULL;
+
+    if (init_bits(&ctx->bits) != 0 || init_bits(&ctx->mask) != 0 ||
+        init_bits(&ctx->record) != 0 ||
+        hash_add(&context_index, cname, ctx->id) != 0) {
+        free_bits(&ctx->bits);
+        free_bits(&ctx->mask);
+        free_bits(&ctx->record);
+        recorder_free(ctx);
+        async_free(ctx);
+        buffer_free(ctx);
+        ctx->modules = NULL;
+        format_free(ctx->format);
+        ctx->format = NULL;
+        arena_free(&ctx->arena);
+        return -ENOMEM;
+    }
+
+    __atomic_store_n(&ctx->name, cname, __ATOMIC_RELEASE);
+    context_publish(ctx);
+
+    return ctx->id;
+}
+
+
+/********************
+ * context_del
+ ********************/
+static void
+context_del(context_t *ctx)
+{
+    module_t *m;
+    char     *name;
+    int       i;
+
+    if (ctx->mode != MODE_DIRECT)            /* flush with context intact */
+        ring_flush();
+
+    name = ctx->name;
+    hash_del(&context_index, name);
+    __atomic_store_n(&ctx->name, NULL, __ATOMIC_RELEASE);
+    context_publish(ctx);
+
+    registry_sync();
+
+    async_stop(ctx);
+    async_free(ctx);
+    buffer_flush(ctx);
+    buffer_free(ctx);
+    filter_reset(ctx);
+
+    format_free(ctx->format);
+    ctx->format = NULL;
+    
+    if (ctx->destination != stderr && ctx->destination != stdout) {
+        fflush(ctx->destination);
+        fclose(ctx->destination);
+    }
+    ctx->destination = NULL;
+    FREE(ctx->target);
+    ctx->target = NULL;
+
+    if (ctx->map != NULL) {
+        mmap_close(ctx->map);
+        ctx->map = NULL;
+    }
+    
+    for (i = 0, m = ctx->modules; i < ctx->nmodule; i++, m++)
+        module_free(ctx, m);
+    
+    ctx->modules = NULL;
+    ctx->nmodule = 0;
+    hash_free(&ctx->modidx);
+    
+    free_bits(&ctx->bits);
+    free_bits(&ctx->mask);
+    free_bits(&ctx->record);
+    recorder_free(ctx);
+
+    arena_free(&ctx->arena);                 /* name, modules, flags */
+}
+
+
+/********************
+ * context_find
+ ********************/
+static context_t *
+context_find(const char *name, context_t **deleted)
+{
+    int i;
+
+    if (deleted != NULL) {
+        *deleted = NULL;
+        for (i = 0; i < ncontext; i++) {
+            if (contexts[i].name == NULL) {
+                *deleted = contexts + i;
+                break;
+            }
+        }
+    }
+
+    if ((i = hash_find(&context_index, name, strlen(name))) < 0)
+        return NULL;
+    else
+        return contexts + i;
+}
+
+
+/********************
+ * context_publish
+ ********************/
+static void
+context_publish(context_t *ctx)
+{
+    unsigned long *words = __trace_mask64[ctx->id];
+    unsigned long *print = print_mask[ctx->id];
+    unsigned long  on, rec;
+    int            active, nword, i;
+
+    /*
+     * Update the exported copy of the flag mask used by the inline
+     * fast-path check in trace_write. It has the bits of both printed
+     * and recorded flags set, print_mask tells the two apart. Deleted
+     * contexts are exported with all their flags off, disabled ones
+     * with only their recorded flags on. Contexts and flags that int
+     * flag ids can address are also exported to the narrower table.
+     * Words past the ones in use are always clear.
+     */
+
+    active = ctx->name != NULL;
+    nword  = ctx->mask.nword > ctx->record.nword ?
+        ctx->mask.nword : ctx->record.nword;
+
+    for (i = 0; i < nword; i++) {
+        if (active) {
+            on  = ctx->disabled ? 0 : bits_word(&ctx->mask, i);
+            rec = bits_word(&ctx->record, i);
+        }
+        else
+            on = rec = 0;
+
+        if (words[i] != (on | rec))
+            jump_mark(ctx->id, i);
+
+        __atomic_store_n(print + i, on, __ATOMIC_RELAXED);
+        __atomic_store_n(words + i, on | rec, __ATOMIC_RELAXED);
+
+        if (ctx->id < MAX_CONTEXTS32 && i < TRACE_MASK_WORDS)
+            __atomic_store_n(&__trace_mask[ctx->id][i], on | rec,
+                             __ATOMIC_RELAXED);
+    }
+
+    jump_update();
+}
+
+
+/********************
+ * module_strput
+ ********************/
+static char *
+module_strput(char **buf, const char *str)
+{
+    char   *s   = *buf;
+    size_t  len = str != NULL ? strlen(str) : 0;
+
+    memcpy(s, str != NULL ? str : "", len + 1);
+    *buf += len + 1;
+
+    return s;
+}
+
+
+/********************
+ * module_add
+ ********************/
+static int
+module_add(context_t *ctx, trace_moduledef_t *moddef, int wide, int base,
+           int borrowed)
+{
+    trace_flagdef_t *flagdef;
+    module_t        *mod, *deleted;
+    flag_t          *flag;
+    char            *name, *str;
+    size_t           size;
+    int              i, nflag, maxbit, err;
+
+    /*
+     * A wide module is really a trace_moduledef64_t, which only differs
+     * in the type of the flag pointers. Its flags get 64-bit ids, others
+     * need to fit the narrower fields of int flag ids. Statically defined
+     * modules come with their flag bits already allocated at base, and
+     * their names are borrowed rather than copied.
+     */
+    
+    if (!wide && ctx->id >= MAX_CONTEXTS32) {
+        WARNING("Context %s needs 64-bit flags.", ctx->name);
+        return -EOVERFLOW;
+    }
+
+
+    if (moddef->name == NULL) {
+        WARNING("Module with NULL name for context %s.", ctx->name);
+        return -EINVAL;
+    }
+    
+    if (module_find(ctx, moddef->name, &deleted) != NULL) {
+        WARNING("Context %s already has a module %s.", ctx->name,
+                      moddef->name);
+        return -EEXIST;
+    }
+
+    nflag = 0;
+    for (i = 0, flagdef = moddef->flags; i < moddef->nflag; i++, flagdef++) {
+        if (flagdef->name == NULL || flagdef->flagptr == NULL) {
+            if (i == moddef->nflag - 1)  /* it's okay to NULL-terminate */
+                continue;
+            WARNING("#%d flag of %s.%s is invalid.", i + 1, ctx->name,
+                          moddef->name);
+            return -EINVAL;
+        }
+        nflag++;
+    }
+
+    if (!wide && nflag > MAX_FLAGIDX32)
+        return -EOVERFLOW;
+
+    maxbit = wide ? MAX_FLAGS : MAX_FLAGS32;
+
+    if (deleted == NULL) {
+        if (ctx->nmodule >= MAX_MODULES)
+            return -ENOSPC;
+        
+        mod = ctx->modules + ctx->nmodule;
+        mod->id = ctx->nmodule++;
+    }
+    else
+        mod = deleted;
+    
+    /* flag table and names (unless borrowed) go in a single arena block */
+    size = ARENA_ALIGN(nflag * sizeof(*mod->flags));
+    if (!borrowed) {
+        size += strlen(moddef->name) + 1;
+        for (i = 0, flagdef = moddef->flags; i < nflag; i++, flagdef++)
+            size += strlen(flagdef->name) + 1 +
+                (flagdef->descr ? strlen(flagdef->descr) : 0) + 1;
+    }
+
+    if ((mod->flags = arena_alloc(&ctx->arena, size)) == NULL)
+        return -ENOMEM;
+
+    mod->memsize  = size;
+    mod->borrowed = borrowed;
+    str = (char *)mod->flags + ARENA_ALIGN(nflag * sizeof(*mod->flags));
+
+    if (init_bits(&mod->bits) != 0) {
+        arena_release(&ctx->arena, mod->flags, mod->memsize);
+        mod->flags = NULL;
+        return -ENOMEM;
+    }
+
+    name = borrowed ? moddef->name : module_strput(&str, moddef->name);
+    
+    mod->nflag = nflag;
+    for (i = 0; i < nflag; i++)
+        mod->flags[i].bit = -1;
+    hash_init(&mod->flagidx);
+
+    /* allocate the flag bits as a single run, one by one if fragmented */
+    if (base >= 0 || (base = alloc_run(&ctx->bits, nflag, maxbit)) >= 0)
+        set_run(&mod->bits, base, nflag);
+
+    /* save module and allocate flag bits */
+    for (i = 0; i < nflag; i++) {
+        flag    = mod->flags + i;
+        flagdef = moddef->flags + i;
+        if (base >= 0)
+            flag->bit = base + i;
+        else if ((flag->bit = alloc_bit(&ctx->bits, maxbit)) >= 0)
+            set_bit(&mod->bits, flag->bit);
+
+        if (borrowed) {
+            flag->name  = flagdef->name;
+            flag->descr = flagdef->descr != NULL ? flagdef->descr : "";
+        }
+        else {
+            flag->name  = module_strput(&str, flagdef->name);
+            flag->descr = module_strput(&str, flagdef->descr);
+        }
+
+        if (hash_add(&mod->flagidx, flag->name, i) != 0)
+            err = -ENOMEM;
+        else if (flag->bit < 0)
+            err = -EOVERFLOW;
+        else
+            err = 0;
+
+        if (err) {
+            module_unlink(ctx, mod);
+            module_free(ctx, mod);
+            return err;
+        }
+        
+        if (wide)
+            __atomic_store_n((trace_flag64_t *)flagdef->flagptr,
+                             FLAG_ID(ctx->id, mod->id, i, flag->bit),
+                             __ATOMIC_RELAXED);
+        else
+            __atomic_store_n(flagdef->flagptr,
+                             FLAG_ID32(ctx->id, mod->id, i, flag->bit),
+                             __ATOMIC_RELAXED);
+        flag->flagptr     = flagdef->flagptr;
+    }
+
+    jump_reset();                            /* sites have new flag ids */
+    
+    if ((ctx->stats && stats_alloc(mod) != 0) ||
+        hash_add(&ctx->modidx, name, mod->id) != 0) {
+        module_unlink(ctx, mod);
+        module_free(ctx, mod);
+        return -ENOMEM;
+    }
+
+    /* make the module visible to the trace path */
+    __atomic_store_n(&mod->name, name, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+
+/********************
+ * trace_add_module
+ ********************/
+int
+trace_add_module(int cid, trace_moduledef_t *moddef)
+{
+    context_t *ctx;
+    int        err;
+
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = module_add(ctx, moddef, FALSE, -1, FALSE);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * trace_add_module64
+ ********************/
+int
+trace_add_module64(int cid, trace_moduledef64_t *moddef)
+{
+    context_t *ctx;
+    int        err;
+
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = module_add(ctx, (trace_moduledef_t *)moddef, TRUE, -1, FALSE);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * module_del
+ ********************/
+static int
+module_del(context_t *ctx, const char *name)
+{
+    module_t *module;
+
+    if ((module = module_find(ctx, name, NULL)) == NULL)
+        return -ENOENT;
+    
+    module_unlink(ctx, module);
+    registry_sync();
+    module_free(ctx, module);
+
+    if (module->id == ctx->nmodule - 1)
+        ctx->nmodule--;
+    
+    return 0;
+}
+
+
+/********************
+ * trace_del_module
+ ********************/
+int
+trace_del_module(int cid, const char *name)
+{
+    context_t *ctx;
+    int        err;
+
+    if (name == NULL)
+        return -EINVAL;
+    
+    REGISTRY_LOCK();
+
+    if ((ctx = CONTEXT_LOOKUP(cid)) != NULL)
+        err = module_del(ctx, name);
+    else
+        err = -ENOENT;
+
+    REGISTRY_UNLOCK();
+
+    return err;
+}
+
+
+/********************
+ * module_find
+ ********************/
+static module_t *
+module_find(context_t *ctx, const char *name, module_t **deleted)
+{
+    int i;
+
+    if (deleted != NULL) {
+        *deleted = NULL;
+        for (i = 0; i < ctx->nmodule; i++) {
+            if (ctx->modules[i].name == NULL) {
+                *deleted = ctx->modules + i;
+                break;
+            }
+        }
+    }
+
+    if ((i = hash_find(&ctx->modidx, name, strlen(name))) < 0)
+        return NULL;
+    else
+        return ctx->modules + i;
+}
+ 
+ 
+/********************
+ * module_unlink
+ ********************/
+static char *
+module_unlink(context_t *ctx, module_t *module)
+{
+    char *name;
+
+    /*
+     * Hide the module from lookups and turn off its flags. The module
+     * must not be freed before readers are known to be done with it.
+     */
+
+    name = module->name;
+    if (name != NULL)
+        hash_del(&ctx->modidx, name);
+    __atomic_store_n(&module->name, NULL, __ATOMIC_RELEASE);
+
+    bits_andnot(&ctx->bits, &module->bits);
+    bits_andnot(&ctx->mask, &module->bits);
+    bits_andnot(&ctx->record, &module->bits);
+
+    context_publish(ctx);
+
+    return name;
+}
+ 
+ 
+/********************
+ * module_free
+ ********************/
+static void
+module_free(context_t *ctx, module_t *module)
+{
+    flag_t *flag;
+    int     i;
+
+    /* names are in the arena block of the module, or borrowed */
+    module->name = NULL;
+
+    for (i = 0, flag = module->flags; i < module->nflag; i++, flag++) {
+        free(flag->stats);
+        sample_release(flag);
+    }
+
+    arena_release(&ctx->arena, module->flags, module->memsize);
+    module->flags    = NULL;
+    module->nflag    = 0;
+    module->memsize  = 0;
+    module->borrowed = FALSE;
+    hash_free(&module->flagidx);
+    free_bits(&module->bits);
+}
+
+
+
+/********************
+ * flag_find
+ ********************/
+static flag_t *
+flag_find(module_t *module, const char *name, flag_t **deleted)
+{
+    int i;
+
+    /* flags are never deleted one by one, only with their module */
+    if (deleted != NULL)
+        *deleted = NULL;
+
+    if ((i = hash_find(&module->flagidx, name, strlen(name))) < 0)
+        return NULL;
+    else
+        return module->flags + i;
+}
+
+
+/*****************************************************************************
+ *                            *** registry memory ***                        *
+ *****************************************************************************/
+
+/*
+ * The name of a context, its module slots, and the flag table and names
+ * of each of its modules are allocated from an arena of the context. The
+ * arena hands out memory from large chunks by bumping a pointer, so each
+ * module takes a single contiguous block instead of two strings per flag.
+ * Blocks too large to share a chunk get one of their own.
+ * Deleting a module puts its block on a free list, and new modules take
+ * the first block that is big enough, splitting off what they don't need.
+ * Blocks are not coalesced. Deleting a context frees its chunks at once.
+ * Readers are always done with a module by the time it is released (see
+ * registry_sync), so its block can be reused right away.
+ */
+
+/********************
+ * arena_init
+ ********************/
+static void
+arena_init(arena_t *a)
+{
+    a->chunks = NULL;
+    a->free   = NULL;
+    a->size   = 0;
+    a->used   = 0;
+}
+
+
+/********************
+ * arena_free
+ ********************/
+static void
+arena_free(arena_t *a)
+{
+    arena_chunk_t *c, *next;
+
+    for (c = a->chunks; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+
+    arena_init(a);
+}
+
+
+/********************
+ * arena_alloc
+ ********************/
+static void *
+arena_alloc(arena_t *a, size_t size)
+{
+    arena_chunk_t  *c;
+    arena_block_t **prev, *b;
+    size_t          csize, left;
+    char           *ptr;
+
+    size = ARENA_ALIGN(size > 0 ? size : 1);
+
+    /* take the first released block that is big enough */
+    for (prev = &a->free; (b = *prev) != NULL; prev = &b->next) {
+        if (b->size < size)
+            continue;
+        if (b->size - size >= ARENA_SPLIT) {
+            b->size -= size;
+            ptr      = (char *)b + b->size;
+        }
+        else {
+            *prev = b->next;
+            ptr   = (char *)b;
+        }
+        goto found;
+    }
+
+    /* large blocks get a chunk of their own, behind the current one */
+    if (size >= ARENA_LARGE) {
+        if ((c = malloc(sizeof(*c) + size)) == NULL)
+            return NULL;
+
+        c->size  = size;
+        c->used  = size;
+        a->size += size;
+
+        if (a->chunks != NULL) {
+            c->next         = a->chunks->next;
+            a->chunks->next = c;
+        }
+        else {
+            c->next   = NULL;
+            a->chunks = c;
+        }
+
+        ptr = c->data;
+        goto found;
+    }
+
+    /* otherwise bump the pointer of the current chunk, or start a new one */
+    c = a->chunks;
+    if (c == NULL || c->size - c->used < size) {
+        csize = ARENA_CHUNK;
+
+        if ((c = malloc(sizeof(*c) + csize)) == NULL)
+            return NULL;
+
+        /* keep the rest of the previous chunk if it's of any use */
+        if (a->chunks != NULL &&
+            (left = a->chunks->size - a->chunks->used) >= ARENA_SPLIT) {
+            a->used += left;
+            arena_release(a, a->chunks->data + a->chunks->used, left);
+            a->chunks->used = a->chunks->size;
+        }
+
+        c->next   = a->chunks;
+        c->size   = csize;
+        c->used   = 0;
+        a->chunks = c;
+        a->size  += csize;
+    }
+
+    ptr      = c->data + c->used;
+    c->used += size;
+
+ found:
+    a->used += size;
+    memset(ptr, 0, size);
+
+    return ptr;
+}
+
+
+/********************
+ * arena_release
+ ********************/
+static void
+arena_release(arena_t *a, void *ptr, size_t size)
+{
+    arena_block_t *b = ptr;
+
+    if (ptr == NULL)
+        return;
+
+    size = ARENA_ALIGN(size > 0 ? size : 1);
+
+    b->size  = size;
+    b->next  = a->free;
+    a->free  = b;
+    a->used -= size;
+}
+
+
+/********************
+ * arena_strdup
+ ********************/
+static char *
+arena_strdup(arena_t *a, const char *str)
+{
+    size_t  len = strlen(str) + 1;
+    char   *dup;
+
+    if ((dup = arena_alloc(a, len)) != NULL)
+        memcpy(dup, str, len);
+
+    return dup;
+}
+
+
+
+
+/*****************************************************************************
+ *                       *** statically defined modules ***                  *
+ *****************************************************************************/
+
+/*
+ * Every object with modules defined by TRACE_DEFINE_MODULE_STATIC has a
+ * table of them, registered by the constructor of every such module. The
+ * same table is thus usually registered several times and is reference
+ * counted. Tables registered before trace_init are loaded by it, later
+ * ones right away. Loading a table allocates the flag bits of all of its
+ * modules as one run for int and one for 64-bit flag ids, then adds the
+ * modules one by one with their share of the run.
+ */
+
+typedef struct {
+    trace_modstatic_t *start;                /* first module */
+    trace_modstatic_t *stop;                 /* past the last module */
+    int                refcnt;               /* number of registrations */
+} modtab_t;
+
+static modtab_t *modtabs;                    /* registered module tables */
+static int       nmodtab;                    /* number of tables */
+
+
+/********************
+ * modtab_nflag
+ ********************/
+static int
+modtab_nflag(trace_moduledef_t *moddef)
+{
+    int n = moddef->nflag;
+
+    /* a NULL-terminated flag table only has NULL as its last entry */
+    if (n > 0 && moddef->flags[n - 1].name == NULL)
+        n--;
+
+    return n;
+}
+
+
+/********************
+ * modtab_load
+ ********************/
+static void
+modtab_load(context_t *ctx, modtab_t *tab)
+{
+    trace_modstatic_t *m;
+    trace_moduledef_t *moddef;
+    int                nflag[2], base[2], next[2], w, b, n, i, err;
+
+    /* must be called with registry_lock held */
+
+    nflag[0] = nflag[1] = 0;
+
+    for (m = tab->start; m < tab->stop; m++)
+        nflag[m->wide ? 1 : 0] += modtab_nflag(m->module);
+
+    base[0] = alloc_run(&ctx->bits, nflag[0], MAX_FLAGS32);
+    base[1] = alloc_run(&ctx->bits, nflag[1], MAX_FLAGS);
+    next[0] = base[0];
+    next[1] = base[1];
+
+    for (m = tab->start; m < tab->stop; m++) {
+        moddef = m->module;
+        w      = m->wide ? 1 : 0;
+        n      = modtab_nflag(moddef);
+
+        if (base[w] >= 0) {
+            b        = next[w];
+            next[w] += n;
+        }
+        else
+            b = -1;                          /* fragmented, one by one */
+
+        if ((err = module_add(ctx, moddef, w, b, TRUE)) != 0) {
+            WARNING("Failed to add static module %s (%d: %s).", moddef->name,
+                    -err, strerror(-err));
+            for (i = 0; b >= 0 && i < n; i++)
+                clr_bit(&ctx->bits, b + i);  /* give back its share */
+        }
+    }
+}
+
+
+/********************
+ * modtab_unload
+ ********************/
+static void
+modtab_unload(context_t *ctx, modtab_t *tab)
+{
+    trace_modstatic_t *m;
+    trace_moduledef_t *moddef;
+    module_t          *mod;
+
+    /* must be called with registry_lock held */
+
+    for (m = tab->start; m < tab->stop; m++) {
+        moddef = m->module;
+        if ((mod = module_find(ctx, moddef->name, NULL)) != NULL &&
+            mod->borrowed && mod->name == moddef->name)
+            module_del(ctx, moddef->name);
+    }
+}
+
+
+/********************
+ * modtab_load_all
+ ********************/
+static void
+modtab_load_all(void)
+{
+    int i;
+
+    /* must be called with registry_lock held */
+
+    for (i = 0; i < nmodtab; i++)
+        modtab_load(contexts, modtabs + i);
+}
+
+
+/********************
+ * __trace_modules_register
+ ********************/
+void
+__trace_modules_register(trace_modstatic_t *start, trace_modstatic_t *stop)
+{
+    modtab_t *tab;
+    int       i;
+
+    if (start == NULL || start >= stop)
+        return;
+
+    REGISTRY_LOCK();
+
+    for (i = 0, tab = modtabs; i < nmodtab; i++, tab++) {
+        if (tab->start == start) {
+            tab->refcnt++;
+            REGISTRY_UNLOCK();
+            return;
+        }
+    }
+
+    tab = modtabs;
+    if (REALLOC_ARR(tab, nmodtab, nmodtab + 1) != NULL) {
+        modtabs = tab;
+        tab = modtabs + nmodtab++;
+        tab->start  = start;
+        tab->stop   = stop;
+        tab->refcnt = 1;
+
+        if (initialized && contexts->name != NULL)
+            modtab_load(contexts, tab);
+    }
+
+    REGISTRY_UNLOCK();
+}
+
+
+/********************
+ * __trace_modules_unregister
+ ********************/
+void
+__trace_modules_unregister(trace_modstatic_t *start, trace_modstatic_t *stop)
+{
+    modtab_t *tab;
+    int       i;
+
+    (void)stop;
+
+    if (start == NULL)
+        return;
+
+    REGISTRY_LOCK();
+
+    for (i = 0, tab = modtabs; i < nmodtab; i++, tab++) {
+        if (tab->start == start) {
+            if (--tab->refcnt == 0) {
+                if (initialized && contexts->name != NULL)
+                    modtab_unload(contexts, tab);
+                memmove(tab, tab + 1, (nmodtab - i - 1) * sizeof(*tab));
+                nmodtab--;
+            }
+            break;
+        }
+    }
+
+    REGISTRY_UNLOCK();
+}
+
+
+
+
+/*****************************************************************************
+ *                           *** registry locking ***                        *
+ *****************************************************************************/
+
+/*
+ * All changes to the registry (contexts, modules and flags, and the format,
+ * target and mode of contexts) are serialized by registry_lock. The trace
+ * path never takes it. Instead a tracing thread announces itself as a
+ * reader by publishing the current registry epoch in a slot of its own
+ * for the duration of the lookups and formatting. A writer that unlinks
+ * something readers might still be using bumps the epoch, then waits in
+ * registry_sync until every reader that entered before that has left and
+ * only then frees it.
+ */
+
+typedef struct reader_s reader_t;
+struct reader_s {
+    reader_t      *next;                     /* next reader slot */
+    unsigned long  epoch;                    /* epoch at entry, 0 if idle */
+    int            nesting;                  /* read-side nesting level */
+    int            busy;                     /* slot owned by a thread */
+};
+
+static reader_t          *readers;           /* reader slots */
+static unsigned long      registry_epoch = 1;
+static pthread_mutex_t    reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t     reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t      reader_key;
+static __thread reader_t *reader_self;
+
+
+/********************
+ * reader_release
+ ********************/
+static void
+reader_release(void *ptr)
+{
+    reader_t *rd = (reader_t *)ptr;
+
+    /* thread is exiting, make its slot available for reuse */
+    rd->nesting = 0;
+    __atomic_store_n(&rd->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rd->busy, FALSE, __ATOMIC_RELEASE);
+}
+
+
+/********************
+ * reader_key_init
+ ********************/
+static void
+reader_key_init(void)
+{
+    pthread_key_create(&reader_key, reader_release);
+}
+
+
+/********************
+ * reader_get
+ ********************/
+static reader_t *
+reader_get(void)
+{
+    reader_t *rd;
+
+    pthread_once(&reader_once, reader_key_init);
+
+    pthread_mutex_lock(&reader_lock);
+
+    for (rd = readers; rd != NULL; rd = rd->next)
+        if (!__atomic_load_n(&rd->busy, __ATOMIC_ACQUIRE))
+            break;
+
+    if (rd == NULL && (rd = ALLOC(reader_t)) != NULL) {
+        rd->next = readers;
+        __atomic_store_n(&readers, rd, __ATOMIC_RELEASE);
+    }
+
+    if (rd != NULL)
+        rd->busy = TRUE;
+
+    pthread_mutex_unlock(&reader_lock);
+
+    if (rd != NULL) {
+        pthread_setspecific(reader_key, rd);
+        reader_self = rd;
+    }
+
+    return rd;
+}
+
+
+/********************
+ * read_enter
+ ********************/
+static inline int
+read_enter(void)
+{
+    reader_t *rd = reader_self;
+
+    if (unlikely(rd == NULL) && (rd = reader_get()) == NULL)
+        return -ENOMEM;
+
+    if (rd->nesting++ == 0) {
+        __atomic_store_n(&rd->epoch,
+                         __atomic_load_n(&registry_epoch, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
+
+/********************
+ * read_exit
+ ********************/
+static inline void
+read_exit(void)
+{
+    reader_t *rd = reader_self;
+
+    if (--rd->nesting == 0)
+        __atomic_store_n(&rd->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/********************
+ * registry_sync
+ ********************/
+static void
+registry_sync(void)
+{
+    reader_t      *rd;
+    unsigned long  epoch, e;
+
+    /* must be called with registry_lock held, after unlinking */
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    epoch = __atomic_add_fetch(&registry_epoch, 1, __ATOMIC_SEQ_CST);
+
+    for (rd = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+         rd != NULL;
+         rd = rd->next) {
+        if (rd == reader_self)
+            continue;
+        while ((e = __atomic_load_n(&rd->epoch, __ATOMIC_SEQ_CST)) != 0 &&
+               e < epoch)
+            sched_yield();
+    }
+}
+
+
+
+
+/*****************************************************************************
+ *                              *** jump labels ***                          *
+ *****************************************************************************/
+
+/*
+ * Objects compiled with TRACE_JUMP_LABEL register the table of their trace
+ * point sites from a constructor in every one of their compilation units,
+ * so the same table is usually registered several times and is reference
+ * counted. Sites are patched to a jump if their flag is on, or to a NOP
+ * if it is off. A site in a jump state still checks the mask, so it only
+ * matters that a site is a jump whenever its flag might be on.
+ *
+ * All sites are kept in an index sorted by the mask bit of their flag.
+ * context_publish marks the exported mask words it changes dirty, and only
+ * the sites of dirty words are checked. The index is rebuilt, and every
+ * site checked, when tables come or go or modules get flag ids assigned.
+ * trace_configure holds patching back until it is done, so a configuration
+ * changing thousands of flags patches every site at most once. Sites to
+ * patch are sorted by address, so every text page is made writable (without
+ * ever losing execute permission) and protected again once per update.
+ * Patched pages become private copies of the mapped object.
+ *
+ * Sites are aligned 8-byte instructions (5 bytes of jmp or nopl, plus a
+ * 3-byte nopl), so they are patched with a single atomic store, and other
+ * threads are serialized with a membarrier sync-core afterwards. Without
+ * kernel support for that sites are never patched (the int3 sequence the
+ * kernel itself uses would need a SIGTRAP handler of ours), and all of them
+ * stay jumps. If a page can't be made writable patching is given up, and
+ * sites left as jumps just keep checking the mask.
+ */
+
+typedef struct {
+    trace_jump_t *start;                     /* first site */
+    trace_jump_t *stop;                      /* past the last site */
+    int           refcnt;                    /* number of registrations */
+} jumptab_t;
+
+typedef struct {
+    unsigned int  pos;                       /* mask bit of flag, see below */
+    trace_jump_t *site;                      /* the site */
+} jumpidx_t;
+
+#define JUMP_WORDS  (MAX_CONTEXTS * TRACE_MASK64_WORDS)
+#define JUMP_LONGS  (JUMP_WORDS / TRACE_BITS_PER_LONG)
+
+static jumptab_t     *jumptabs;              /* registered site tables */
+static int            njumptab;              /* number of tables */
+static jumpidx_t     *jumpidx;               /* sites sorted by pos */
+static int            njumpidx;              /* number of sites */
+static trace_jump_t **jumptodo;              /* sites to patch */
+static int            jump_stale = TRUE;     /* jumpidx needs a rebuild */
+static int            jump_hold;             /* patching held back */
+static int            jump_ndirty;           /* number of dirty words */
+static unsigned long  jump_dirty[JUMP_LONGS]; /* changed exported words */
+static int            jump_broken;           /* failed to patch sites */
+static int            jump_sync = -1;        /* membarrier sync-core usable */
+
+#define JUMP_SIZE   8                        /* size of a site */
+#define JUMP_SYNC_CORE          (1 << 5)     /* membarrier commands */
+#define JUMP_REGISTER_SYNC_CORE (1 << 6)
+#define JUMP_OPCODE 0xe9                     /* jmp rel32 */
+static const unsigned char jump_nop[5] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+
+/********************
+ * jump_enabled
+ ********************/
+static int
+jump_enabled(trace_jump_t *j)
+{
+    const trace_jump_key_t *key = j->key;
+
+    if (key->size == sizeof(trace_flag64_t))
+        return __trace_enabled64(*(const trace_flag64_t *)key->id);
+    else
+        return __trace_enabled(*(const int *)key->id);
+}
+
+
+/********************
+ * jump_pos
+ ********************/
+static unsigned int
+jump_pos(trace_jump_t *j)
+{
+    const trace_jump_key_t *key = j->key;
+    trace_flag64_t          id;
+    unsigned int            c, b;
+
+    /*
+     * The position of the mask bit of the flag of a site, as context *
+     * TRACE_ID64_FLAGS + bit, the same way __trace_enabled(64) finds it.
+     * The narrow mask of a context mirrors the wide one, so the position
+     * divided by TRACE_BITS_PER_LONG is the exported word of both.
+     */
+
+    if (key->size == sizeof(trace_flag64_t)) {
+        id = *(const trace_flag64_t *)key->id;
+        c  = (unsigned int)(id >> 48) & (TRACE_ID64_CONTEXTS - 1);
+        b  = (unsigned int) id        & (TRACE_ID64_FLAGS    - 1);
+    }
+    else {
+        id = (unsigned int)*(const int *)key->id;
+        c  = (unsigned int)(id >> 24) & (TRACE_ID_CONTEXTS - 1);
+        b  = (unsigned int) id        & (TRACE_ID_FLAGS    - 1);
+    }
+
+    return c * TRACE_ID64_FLAGS + b;
+}
+
+
+/********************
+ * jump_mark
+ ********************/
+static inline void
+jump_mark(int cid, int word)
+{
+    int            w   = cid * TRACE_MASK64_WORDS + word;
+    unsigned long *d   = jump_dirty + w / TRACE_BITS_PER_LONG;
+    unsigned long  bit = 1UL << (w % TRACE_BITS_PER_LONG);
+
+    /* must be called with registry_lock held */
+
+    if (!(*d & bit)) {
+        *d |= bit;
+        jump_ndirty++;
+    }
+}
+
+
+/********************
+ * jump_poscmp
+ ********************/
+static int
+jump_poscmp(const void *a, const void *b)
+{
+    unsigned int pa = ((const jumpidx_t *)a)->pos;
+    unsigned int pb = ((const jumpidx_t *)b)->pos;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+
+/********************
+ * jump_codecmp
+ ********************/
+static int
+jump_codecmp(const void *a, const void *b)
+{
+    unsigned long ca = (*(trace_jump_t * const *)a)->code;
+    unsigned long cb = (*(trace_jump_t * const *)b)->code;
+
+    return ca < cb ? -1 : ca > cb;
+}
+
+
+/********************
+ * jump_reindex
+ ********************/
+static int
+jump_reindex(void)
+{
+    jumpidx_t     *idx;
+    trace_jump_t **todo, *j;
+    int            n, i;
+
+    /* must be called with registry_lock held */
+
+    for (i = n = 0; i < njumptab; i++)
+        n += jumptabs[i].stop - jumptabs[i].start;
+
+    FREE(jumpidx);
+    FREE(jumptodo);
+    jumpidx  = NULL;
+    jumptodo = NULL;
+    njumpidx = 0;
+
+    if (n == 0)
+        return 0;
+
+    idx  = ALLOC_ARR(jumpidx_t, n);
+    todo = ALLOC_ARR(trace_jump_t *, n);
+
+    if (idx == NULL || todo == NULL) {
+        FREE(idx);
+        FREE(todo);
+        return -ENOMEM;
+    }
+
+    for (i = n = 0; i < njumptab; i++) {
+        for (j = jumptabs[i].start; j < jumptabs[i].stop; j++, n++) {
+            idx[n].pos  = jump_pos(j);
+            idx[n].site = j;
+        }
+    }
+
+    qsort(idx, n, sizeof(idx[0]), jump_poscmp);
+
+    jumpidx  = idx;
+    jumptodo = todo;
+    njumpidx = n;
+
+    return 0;
+}
+
+
+/********************
+ * jump_lookup
+ ********************/
+static int
+jump_lookup(unsigned int pos)
+{
+    int lo, hi, mid;
+
+    /* the first site at or past pos */
+
+    for (lo = 0, hi = njumpidx; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        if (jumpidx[mid].pos < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+
+/********************
+ * jump_unprotect
+ ********************/
+static int
+jump_unprotect(unsigned long code, unsigned long *page)
+{
+    unsigned long pgsize = (unsigned long)sysconf(_SC_PAGESIZE);
+    unsigned long addr   = code & ~(pgsize - 1);
+
+    /* keep the last page writable while patching sites in address order */
+
+    if (*page == addr)
+        return 0;
+
+    if (*page != 0)
+        mprotect((void *)*page, pgsize, PROT_READ | PROT_EXEC);
+
+    *page = 0;
+
+    if (mprotect((void *)addr, pgsize,
+                 PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+        return -errno;
+
+    *page = addr;
+
+    return 0;
+}
+
+
+/********************
+ * jump_patch
+ ********************/
+static int
+jump_patch(trace_jump_t **sites, int nsite)
+{
+    trace_jump_t  *j;
+    unsigned long  page;
+    uint64_t       insn;
+    unsigned char *b = (unsigned char *)&insn;
+    int32_t        rel;
+    int            on, i, npatch, err;
+
+    /* must be called with registry_lock held, sites sorted by address */
+
+    page   = 0;
+    npatch = 0;
+    err    = 0;
+
+    for (i = 0; i < nsite; i++) {
+        j  = sites[i];
+        on = jump_enabled(j);
+
+        if (on == (int)j->enabled)
+            continue;
+
+        if ((j->code & (JUMP_SIZE - 1)) != 0) {
+            err = -EINVAL;
+            break;
+        }
+
+        if ((err = jump_unprotect(j->code, &page)) != 0)
+            break;
+
+        insn = __atomic_load_n((uint64_t *)j->code, __ATOMIC_RELAXED);
+
+        if (on) {
+            rel  = (int32_t)(j->target - (j->code + 5));
+            b[0] = JUMP_OPCODE;
+            memcpy(b + 1, &rel, sizeof(rel));
+        }
+        else
+            memcpy(b, jump_nop, sizeof(jump_nop));
+
+        __atomic_store_n((uint64_t *)j->code, insn, __ATOMIC_SEQ_CST);
+        j->enabled = on;
+        npatch++;
+    }
+
+    if (page != 0)
+        mprotect((void *)page, (size_t)sysconf(_SC_PAGESIZE),
+                 PROT_READ | PROT_EXEC);
+
+    if (err != 0) {
+        ERROR("Failed to patch trace points (%d: %s), leaving them as is.",
+              -err, strerror(-err));
+        jump_broken = TRUE;
+    }
+
+#ifdef __NR_membarrier
+    if (npatch > 0)
+        syscall(__NR_membarrier, JUMP_SYNC_CORE, 0);
+#endif
+
+    return err;
+}
+
+
+/********************
+ * jump_update
+ ********************/
+static void
+jump_update(void)
+{
+    trace_jump_t *j;
+    unsigned long dirty;
+    unsigned int  pos;
+    int           ntodo, i, w, k;
+
+    /* must be called with registry_lock held */
+
+    if (jump_hold > 0 || (!jump_stale && jump_ndirty == 0))
+        return;
+
+    if (jump_broken || jump_sync <= 0 || njumptab == 0) {
+        memset(jump_dirty, 0, sizeof(jump_dirty));
+        jump_ndirty = 0;
+        return;
+    }
+
+    if (jump_stale) {
+        if (jump_reindex() != 0) {
+            ERROR("Failed to index trace points, leaving them as is.");
+            jump_broken = TRUE;
+            return;
+        }
+        for (i = ntodo = 0; i < njumpidx; i++) {
+            j = jumpidx[i].site;
+            if (jump_enabled(j) != (int)j->enabled)
+                jumptodo[ntodo++] = j;
+        }
+        memset(jump_dirty, 0, sizeof(jump_dirty));
+    }
+    else {
+        for (i = ntodo = 0; i < JUMP_LONGS; i++) {
+            if ((dirty = jump_dirty[i]) == 0)
+                continue;
+            jump_dirty[i] = 0;
+            for ( ; dirty != 0; dirty &= dirty - 1) {
+                w   = i * TRACE_BITS_PER_LONG + __builtin_ctzl(dirty);
+                pos = (unsigned int)w * TRACE_BITS_PER_LONG;
+                for (k = jump_lookup(pos);
+                     k < njumpidx && jumpidx[k].pos < pos + TRACE_BITS_PER_LONG;
+                     k++) {
+                    j = jumpidx[k].site;
+                    if (jump_enabled(j) != (int)j->enabled)
+                        jumptodo[ntodo++] = j;
+                }
+            }
+        }
+    }
+
+    jump_stale  = FALSE;
+    jump_ndirty = 0;
+
+    if (ntodo > 0) {
+        qsort(jumptodo, ntodo, sizeof(jumptodo[0]), jump_codecmp);
+        jump_patch(jumptodo, ntodo);
+    }
+}
+
+
+/********************
+ * jump_reset
+ ********************/
+static void
+jump_reset(void)
+{
+    /* must be called with registry_lock held, sites need a full check */
+    jump_stale = TRUE;
+}
+
+
+/********************
+ * __trace_jump_register
+ ********************/
+void
+__trace_jump_register(trace_jump_t *start, trace_jump_t *stop)
+{
+    jumptab_t *t;
+    int        i;
+
+    if (start == NULL || start >= stop)
+        return;
+
+    REGISTRY_LOCK();
+
+#ifdef __NR_membarrier
+    if (jump_sync < 0)
+        jump_sync = syscall(__NR_membarrier, JUMP_REGISTER_SYNC_CORE, 0) == 0;
+#endif
+
+    for (i = 0, t = jumptabs; i < njumptab; i++, t++) {
+        if (t->start == start) {
+            t->refcnt++;
+            REGISTRY_UNLOCK();
+            return;
+        }
+    }
+
+    t = jumptabs;
+    if (REALLOC_ARR(t, njumptab, njumptab + 1) != NULL) {
+        jumptabs = t;
+        t = jumptabs + njumptab++;
+        t->start  = start;
+        t->stop   = stop;
+        t->refcnt = 1;
+        jump_reset();
+        jump_update();
+    }
+
+    REGISTRY_UNLOCK();
+}
+
+
+/********************
+ * __trace_jump_unregister
+ ********************/
+void
+__trace_jump_unregister(trace_jump_t *start, trace_jump_t *stop)
+{
+    jumptab_t *t;
+    int        i;
+
+    (void)stop;
+
+    if (start == NULL)
+        return;
+
+    REGISTRY_LOCK();
+
+    for (i = 0, t = jumptabs; i < njumptab; i++, t++) {
+        if (t->start == start) {
+            if (--t->refcnt == 0) {
+                memmove(t, t + 1, (njumptab - i - 1) * sizeof(*t));
+                njumptab--;
+                jump_reset();
+            }
+            break;
+        }
+    }
+
+    REGISTRY_UNLOCK();
+}
+
+
+
+/*****************************************************************************
+ *                           *** message formatting ***                      *
+ *****************************************************************************/
+
+/*
+ * Time stamps are formatted without strftime and hence without having to
+ * switch LC_TIME back and forth to get the C locale month names. Every
+ * thread caches the YYYY-MMM-DD hh:mm:ss prefix of its last time stamp,
+ * so it only needs to be regenerated when the second changes. Otherwise
+ * only the milliseconds get patched in.
+ */
+
+typedef struct {
+    time_t sec;                              /* second of cached stamp */
+    char   buf[STAMP_SIZE];                  /* cached stamp */
+} stamp_cache_t;
+
+static __thread stamp_cache_t stamp_cache = { .sec = (time_t)-1 };
+
+static const char months[12][3] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+#define PUT_DIGITS2(d, v) do {                  \
+        (d)[0] = '0' + (v) / 10;                \
+        (d)[1] = '0' + (v) % 10;                \
+    } while (0)
+
+
+/********************
+ * stamp_prefix
+ ********************/
+static int
+stamp_prefix(char *buf, time_t sec)
+{
+    struct tm  tm;
+    char      *d;
+    int        year;
+
+    if (unlikely(gmtime_r(&sec, &tm) == NULL))
+        return -EINVAL;
+
+    year = tm.tm_year + 1900;
+    if (unlikely(year < 0 || year > 9999 || tm.tm_mon < 0 || tm.tm_mon > 11))
+        return -EINVAL;
+
+    d = buf;
+    d[0] = '0' + year / 1000;
+    d[1] = '0' + year / 100 % 10;
+    d[2] = '0' + year / 10 % 10;
+    d[3] = '0' + year % 10;
+    d[4] = '-';
+    memcpy(d + 5, months[tm.tm_mon], 3);
+    d[8] = '-';
+    PUT_DIGITS2(d +  9, tm.tm_mday);
+    d[11] = ' ';
+    PUT_DIGITS2(d + 12, tm.tm_hour);
+    d[14] = ':';
+    PUT_DIGITS2(d + 15, tm.tm_min);
+    d[17] = ':';
+    PUT_DIGITS2(d + 18, tm.tm_sec);
+
+    return 0;
+}
+
+
+/********************
+ * get_timestamp
+ ********************/
+static char *
+get_timestamp(char *buf, struct timeval *tv)
+{
+    stamp_cache_t *c = &stamp_cache;
+    char          *d;
+    int            ms;
+
+    /* must have buffer of STAMP_SIZE or more bytes */
+    
+    if (!tv->tv_sec && unlikely(gettimeofday(tv, NULL) < 0)) {
+        strcpy(buf, STAMP_UNKNOWN);
+        return buf;
+    }
+
+    if (unlikely(c->sec != tv->tv_sec)) {
+        if (stamp_prefix(c->buf, tv->tv_sec) < 0) {
+            strcpy(buf, STAMP_UNKNOWN);
+            return buf;
+        }
+        c->sec = tv->tv_sec;
+    }
+    
+    memcpy(buf, c->buf, STAMP_STRFLEN);
+    ms = tv->tv_usec / 1000;
+
+    d = buf + STAMP_STRFLEN;
+    d[0] = '.';
+    d[1] = '0' + ms / 100; ms %= 100;
+    d[2] = '0' + ms /  10; ms %=  10;
+    d[3] = '0' + ms;
+    d[4] = '\0';
+
+    return buf;
+}
+
+
+/*
+ * Besides the wall-clock time used for %U, every context has a clock
+ * source used for %u and %N. The default is CLOCK_MONOTONIC so deltas
+ * are not disturbed by wall-clock adjustments. On x86-64 CPUs with an
+ * invariant TSC the time stamp counter can be used, too. It is scaled
+ * to nanoseconds using a conversion factor calibrated against
+ * CLOCK_MONOTONIC when the clock is first selected.
+ */
+
+#ifndef CLOCK_MONOTONIC_RAW
+#  define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
+#endif
+
+#define TSC_CALIBRATE 10                     /* calibration period (ms) */
+#define TSC_SHIFT     32                     /* fixed point scaling shift */
+
+static struct {
+    const char *name;                        /* TRACE_CLOCK_* */
+    clockid_t   id;                          /* POSIX clock id */
+} clocks[] = {
+    [CLK_REALTIME]      = { TRACE_CLOCK_REALTIME     , CLOCK_REALTIME      },
+    [CLK_MONOTONIC]     = { TRACE_CLOCK_MONOTONIC    , CLOCK_MONOTONIC     },
+    [CLK_MONOTONIC_RAW] = { TRACE_CLOCK_MONOTONIC_RAW, CLOCK_MONOTONIC_RAW },
+    [CLK_TSC]           = { TRACE_CLOCK_TSC          , CLOCK_MONOTONIC     },
+};
+
+#ifdef HAVE_TSC
+static struct {
+    uint64_t tsc;                            /* TSC at calibration */
+    uint64_t ns;                             /* CLOCK_MONOTONIC at the same */
+    uint64_t mult;                           /* ns per tick << TSC_SHIFT */
+    int      ready;                          /* calibrated */
+} tsc;
+#endif
+
+
+/********************
+ * timespec_ns
+ ********************/
+static inline uint64_t
+timespec_ns(struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+
+#ifdef HAVE_TSC
+/********************
+ * tsc_calibrate
+ ********************/
+static int
+tsc_calibrate(void)
+{
+    struct timespec  t0, t1, period;
+    uint64_t         c0, c1;
+    unsigned int     eax, ebx, ecx, edx;
+
+    if (tsc.ready)
+        return 0;
+
+    /* only an invariant TSC ticks at a constant rate */
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return -ENOTSUP;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+        return -ENOTSUP;
+
+    period.tv_sec  = 0;
+    period.tv_nsec = TSC_CALIBRATE * 1000000;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = __rdtsc();
+    nanosleep(&period, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c1 = __rdtsc();
+
+    if (c1 <= c0)
+        return -ENOTSUP;
+
+    tsc.tsc  = c0;
+    tsc.ns   = timespec_ns(&t0);
+    tsc.mult = ((timespec_ns(&t1) - tsc.ns) << TSC_SHIFT) / (c1 - c0);
+    __atomic_store_n(&tsc.ready, TRUE, __ATOMIC_RELEASE);
+
+    return 0;
+}
+#endif
+
+
+/********************
+ * clock_ns
+ ********************/
+static inline uint64_t
+clock_ns(int clk)
+{
+    struct timespec ts;
+
+#ifdef HAVE_TSC
+    if (clk == CLK_TSC)
+        return tsc.ns + (uint64_t)
+            (((unsigned __int128)(__rdtsc() - tsc.tsc) * tsc.mult)
+             >> TSC_SHIFT);
+#endif
+
+    clock_gettime(clocks[clk].id, &ts);
+    return timespec_ns(&ts);
+}
+
+
+/********************
+ * clock_select
+ ********************/
+static int
+clock_select(const char *name)
+{
+    int clk;
+
+    if (name == NULL)
+        return -EINVAL;
+
+    for (clk = 0; clk < (int)(sizeof(clocks) / sizeof(clocks[0])); clk++) {
+        if (strcmp(name, clocks[clk].name))
+            continue;
+
+        if (clk == CLK_TSC) {
+#ifdef HAVE_TSC
+            int err;
+
+            if ((err = tsc_calibrate()) < 0)
+                return err;
+#else
+            return -ENOTSUP;
+#endif
+        }
+
+        return clk;
+    }
+
+    return -EINVAL;
+}
+
+
+/********************
+ * stamp_take
+ ********************/
+static void
+stamp_take(context_t *ctx, tstamp_t *stamp)
+{
+    format_t *fmt = __atomic_load_n(&ctx->format, __ATOMIC_ACQUIRE);
+
+    /* take the time stamps the current format needs, see format_message */
+
+    if (fmt->stamps & STAMP_WALL)
+        gettimeofday(&stamp->wall, NULL);
+    else
+        stamp->wall.tv_sec = stamp->wall.tv_usec = 0;
+
+    if (fmt->stamps & STAMP_CLOCK)
+        stamp->clock = clock_ns(__atomic_load_n(&ctx->clock,
+                                                __ATOMIC_ACQUIRE));
+    else
+        stamp->clock = 0;
+}
+
+
+/*
+ * Messages are formatted into a small buffer on the stack. Ones that do
+ * not fit are moved to a per-thread buffer which grows as necessary, so
+ * long messages are not truncated and short ones cost no allocation. A
+ * buffer that grew beyond MSGBUF_KEEP is released once the message is out.
+ */
+
+#define MSGBUF_KEEP (64 * 1024)              /* max. buffer kept by a thread */
+
+static pthread_once_t  msgbuf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t   msgbuf_key;
+static __thread char  *msgbuf;
+static __thread int    msgbuf_size;
+
+
+/********************
+ * msgbuf_release
+ ********************/
+static void
+msgbuf_release(void *ptr)
+{
+    /* thread is exiting, free its buffer, later destructors may trace */
+    FREE(ptr);
+    msgbuf      = NULL;
+    msgbuf_size = 0;
+}
+
+
+/********************
+ * msgbuf_key_init
+ ********************/
+static void
+msgbuf_key_init(void)
+{
+    pthread_key_create(&msgbuf_key, msgbuf_release);
+}
+
+
+/********************
+ * msgbuf_set
+ ********************/
+static void
+msgbuf_set(char *buf, int size)
+{
+    pthread_once(&msgbuf_once, msgbuf_key_init);
+    pthread_setspecific(msgbuf_key, buf);
+
+    msgbuf      = buf;
+    msgbuf_size = size;
+}
+
+
+/********************
+ * msgbuf_trim
+ ********************/
+static inline void
+msgbuf_trim(void)
+{
+    if (unlikely(msgbuf_size > MSGBUF_KEEP)) {
+        FREE(msgbuf);
+        msgbuf_set(NULL, 0);
+    }
+}
+
+
+/********************
+ * emit_grow
+ ********************/
+static int
+emit_grow(fmtout_t *o, int need)
+{
+    char *buf, *base;
+    int   size, i;
+
+    /* move the message to msgbuf, growing it to have room for need more */
+
+    if (!o->grow || need > INT_MAX - 1 - o->used)
+        return -EOVERFLOW;
+
+    need += o->used + 1;
+
+    if (o->buf != msgbuf && need <= msgbuf_size) {
+        buf  = msgbuf;
+        size = msgbuf_size;
+    }
+    else {
+        for (size = msgbuf_size ? msgbuf_size : MAX_MESSAGE; size < need; )
+            size = size > INT_MAX / 2 ? INT_MAX : size * 2;
+        if ((buf = ALLOC_ARR(char, size)) == NULL)
+            return -ENOMEM;
+    }
+
+    memcpy(buf, o->buf, o->used);
+
+    for (i = 0; i < o->niov; i++) {          /* rebase pieces in the buffer */
+        base = o->iov[i].iov_base;
+        if (base >= o->buf && base < o->buf + o->size)
+            o->iov[i].iov_base = buf + (base - o->buf);
+    }
+
+    if (buf != msgbuf) {
+        FREE(msgbuf);
+        msgbuf_set(buf, size);
+    }
+
+    o->buf  = buf;
+    o->size = size;
+
+    return 0;
+}
+
+
+/********************
+ * emit_scratch
+ ********************/
+static inline int
+emit_scratch(fmtout_t *o, int len)
+{
+    char         *d = o->buf + o->used;
+    struct iovec *v;
+
+    /* account for len bytes just rendered at the end of the scratch buffer */
+
+    o->used += len;
+    o->len  += len;
+
+    if (o->iov == NULL || len == 0)
+        return 0;
+
+    v = o->iov + o->niov - 1;
+    if (o->niov > 0 && (char *)v->iov_base + v->iov_len == d) {
+        v->iov_len += len;                   /* extends the previous piece */
+        return 0;
+    }
+
+    if (o->niov >= FMT_MAXIOV)
+        return -ENOBUFS;
+
+    v++;
+    v->iov_base = d;
+    v->iov_len  = len;
+    o->niov++;
+
+    return 0;
+}
+
+
+/********************
+ * emit_copy
+ ********************/
+static inline int
+emit_copy(fmtout_t *o, const char *s, int len)
+{
+    int n = o->size - 1 - o->used;
+    int err;
+
+    if (len > n && (err = emit_grow(o, len)) < 0) {
+        memcpy(o->buf + o->used, s, n);
+        o->used += n;
+        return err;
+    }
+
+    memcpy(o->buf + o->used, s, len);
+
+    return emit_scratch(o, len);
+}
+
+
+/********************
+ * emit_ref
+ ********************/
+static inline int
+emit_ref(fmtout_t *o, const char *s, int len)
+{
+    struct iovec *v;
+
+    /*
+     * s stays valid until the message is written, so we can point to it.
+     * Short strings are cheaper to copy than to pass as an extra iovec.
+     */
+
+    if (o->iov == NULL || len < FMT_MINREF)
+        return emit_copy(o, s, len);
+
+    if (o->niov >= FMT_MAXIOV)
+        return -ENOBUFS;
+
+    v = o->iov + o->niov++;
+    v->iov_base = (char *)s;
+    v->iov_len  = len;
+    o->len     += len;
+
+    return 0;
+}
+
+
+/********************
+ * emit_str
+ ********************/
+static inline int
+emit_str(fmtout_t *o, const char *s)
+{
+    return emit_ref(o, s, strlen(s));
+}
+
+
+/********************
+ * emit_vprintf
+ ********************/
+static int
+emit_vprintf(fmtout_t *o, int chop, const char *format, va_list args)
+{
+    int     left, n, err;
+    va_list ap;
+
+    /*
+     * An overflowing vsnprintf is expensive. If this thread already has
+     * a bigger buffer, it has printed long messages before, so use it.
+     */
+
+    if (unlikely(msgbuf_size > o->size) && o->grow)
+        emit_grow(o, 0);
+
+    left = o->size - 1 - o->used;
+
+    va_copy(ap, args);
+    n = vsnprintf(o->buf + o->used, left + 1, format, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return -errno;
+
+    if (n > left) {
+        if ((err = emit_grow(o, n)) < 0) {
+            o->used += left;
+            return err;
+        }
+        vsnprintf(o->buf + o->used, n + 1, format, args);
+    }
+
+    return emit_scratch(o, n - chop);
+}
+
+
+/********************
+ * emit_printf
+ ********************/
+static int
+emit_printf(fmtout_t *o, const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, format);
+    n = emit_vprintf(o, 0, format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+
+/********************
+ * format_emit
+ ********************/
+static int
+format_emit(context_t *ctx, format_t *fmt, trace_flag64_t id,
+            trace_tags_t *tags, const char *file, int line, const char *func,
+            tstamp_t *stamp, fmtout_t *o, const char *format, va_list args)
+{
+#define CLOCK_NOW(now) do {                                       \
+        if (!(now).clock)                                         \
+            (now).clock = clock_ns(clk);                          \
+    } while (0)
+
+    
+    module_t *mod;
+    flag_t   *flg;
+    int       m, f;
+
+    fmtop_t    *op;
+    char        ts[STAMP_SIZE];
+    int         err, msg_printed, i;
+
+    tstamp_t  now;
+    uint64_t  diff;
+    int       clk;
+    
+
+    /*
+     * Produce the message pieces in the order given by the format. Names,
+     * literals, the function and the file are passed to emit_ref which
+     * either copies them or, when gathering, just points to them. Anything
+     * else is rendered into the buffer (the scratch area when gathering).
+     */
+    
+    mod = NULL;
+    flg = NULL;
+    if (stamp != NULL)
+        now = *stamp;
+    else {
+        now.wall.tv_sec = now.wall.tv_usec = 0;
+        now.clock       = 0;
+    }
+    msg_printed = FALSE;
+    ts[0] = '\0';
+    err   = 0;
+    clk   = __atomic_load_n(&ctx->clock, __ATOMIC_ACQUIRE);
+
+    for (op = fmt->ops; op->op != FMT_END && err == 0; op++) {
+        switch (op->op) {
+        case FMT_LITERAL:
+            err = emit_ref(o, op->lit, op->len);
+            break;
+
+        case FMT_CONTEXT:
+            err = emit_str(o, ctx->name);
+            break;
+
+        case FMT_MODULE:
+            m   = FLAG_MOD(id);
+            mod = MODULE_LOOKUP(ctx, m);
+            err = emit_str(o, mod ? mod->name : "<unknown>");
+            break;
+
+        case FMT_FLAG:
+            if (mod == NULL) {
+                m   = FLAG_MOD(id);
+                mod = MODULE_LOOKUP(ctx, m);
+            }
+            f   = FLAG_IDX(id);
+            flg = FLAG_LOOKUP(mod, f);
+            err = emit_str(o, flg ? flg->name : "<unknown>");
+            break;
+
+        case FMT_WHERE:
+            if ((err = emit_str(o, func)) == 0 &&
+                (err = emit_ref(o, "@", 1)) == 0 &&
+                (err = emit_str(o, file)) == 0)
+                err = emit_printf(o, ":%d", line);
+            break;
+
+        case FMT_FUNCTION:
+            err = emit_str(o, func);
+            break;
+
+        case FMT_FILE:
+            err = emit_str(o, file);
+            break;
+
+        case FMT_LINE:
+            err = emit_printf(o, "%d", line);
+            break;
+            
+        case FMT_STAMP:
+            err = emit_printf(o, "%s", get_timestamp(ts, &now.wall));
+            break;
+
+        case FMT_DELTA:
+            CLOCK_NOW(now);
+            if (!ctx->prev || now.clock < ctx->prev) {
+                err = emit_printf(o, "%s",
+                                  ts[0] ? ts : get_timestamp(ts, &now.wall));
+            }
+            else {
+                diff = now.clock - ctx->prev;
+                err = emit_printf(o, "+%4.4d.%3.3d",
+                                  (int)(diff / 1000000000ULL),
+                                  (int)(diff / 1000000ULL % 1000));
+            }
+            ctx->prev = now.clock;
+            break;
+        
+        case FMT_CLOCK:
+            CLOCK_NOW(now);
+            err = emit_printf(o, "%llu.%9.9llu",
+                    (unsigned long long)(now.clock / 1000000000ULL),
+                    (unsigned long long)(now.clock % 1000000000ULL));
+            break;
+
+        case FMT_MESSAGE:
+            err = emit_vprintf(o, 1, format, args); /* chop trailing '\n' */
+            msg_printed = TRUE;
+            break;
+
+        case FMT_TAGS:
+            for (i = 0; err == 0 && tags != NULL && i < tags->ntag; i++) {
+                err = emit_printf(o, "%s%s=%s", i ? " " : "",
+                                  tags->tags[i].key, tags->tags[i].value);
+            }
+            break;
+        }
+    }
+    
+    if (err == 0 && !msg_printed)
+        err = emit_vprintf(o, 1, format, args);  /* chop trailing '\n' */
+
+    if (err == 0)
+        err = emit_ref(o, "\n", 1);
+
+    return err;
+
+#undef CLOCK_NOW
+}
+
+
+/********************
+ * format_buffer
+ ********************/
+static int
+format_buffer(context_t *ctx, trace_flag64_t id, trace_tags_t *tags,
+              const char *file, int line, const char *func,
+              tstamp_t *stamp, fmtout_t *o, const char *format, va_list args)
+{
+    format_t *fmt = __atomic_load_n(&ctx->format, __ATOMIC_ACQUIRE);
+    char     *d;
+    int       err;
+
+    err = format_emit(ctx, fmt, id, tags, file, line, func, stamp, o,
+                      format, args);
+
+    if (err == 0) {
+        o->buf[o->used] = '\0';
+        return o->used + 1;
+    }
+
+    /* in the case of overflow try to end the message with '...\0' */
+    if (o->size >= 4) {
+        d = o->buf + o->size - 1 - 3;
+        d[0] = d[1] = d[2] = '.';
+        d[3] = '\0';
+    }
+    else if (o->size > 0) {
+        o->buf[o->used < o->size ? o->used : o->size - 1] = '\0';
+    }
+
+    return err;
+}
+
+
+/********************
+ * format_message
+ ********************/
+static int
+format_message(context_t *ctx, trace_flag64_t id, trace_tags_t *tags,
+               const char *file, int line, const char *func,
+               tstamp_t *stamp, char *buf, int bufsize,
+               const char *format, va_list args)
+{
+    fmtout_t o = { .buf = buf, .size = bufsize };
+
+    return format_buffer(ctx, id, tags, file, line, func, stamp, &o,
+                         format, args);
+}
+
+
+/********************
+ * format_alloc
+ ********************/
+static int
+format_alloc(context_t *ctx, trace_flag64_t id, trace_tags_t *tags,
+             const char *file, int line, const char *func,
+             tstamp_t *stamp, char **buf, int bufsize,
+             const char *format, va_list args)
+{
+    fmtout_t o = { .buf = *buf, .size = bufsize, .grow = TRUE };
+    int      n;
+
+    /* like format_message, but move to msgbuf instead of truncating */
+
+    n = format_buffer(ctx, id, tags, file, line, func, stamp, &o,
+                      format, args);
+    *buf = o.buf;
+
+    return n;
+}
+
+
+/********************
+ * format_iov
+ ********************/
+static int
+format_iov(context_t *ctx, trace_flag64_t id, trace_tags_t *tags,
+           const char *file, int line, const char *func,
+           tstamp_t *stamp, char *scratch, int size, struct iovec *iov,
+           int *niov, const char *format, va_list args)
+{
+    format_t *fmt = __atomic_load_n(&ctx->format, __ATOMIC_ACQUIRE);
+    fmtout_t  o   = { .buf = scratch, .size = size, .iov = iov,
+                      .grow = TRUE };
+    int       err;
+
+    /*
+     * Gather the message into iov[] for a single writev. Only the dynamic
+     * parts (line numbers, time stamps, tags, user message) get rendered
+     * into scratch, everything else is written straight from its source.
+     * Scratch is moved to msgbuf if it turns out to be too small. Return
+     * the total length, or -ENOBUFS if the format could need more than
+     * FMT_MAXIOV pieces (the caller should use format_alloc then).
+     */
+
+    if (fmt->pieces > FMT_MAXIOV)
+        return -ENOBUFS;
+
+    err = format_emit(ctx, fmt, id, tags, file, line, func, stamp, &o,
+                      format, args);
+
+    if (err < 0)
+        return err;
+
+    *niov = o.niov;
+    return o.len;
+}
+
+
+
+/********************
+ * format_text
+ ********************/
+static int
+format_text(context_t *ctx, trace_flag64_t id,
+            const char *file, int line, const char *func,
+            tstamp_t *stamp, char *buf, int bufsize,
+            const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, format);
+    n = format_message(ctx, id, NULL, file, line, func, stamp, buf, bufsize,
+                       format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+
+/********************
+ * format_compile
+ ********************/
+static format_t *
+format_compile(const char *format)
+{
+    format_t   *fmt;
+    fmtop_t    *op;
+    const char *s, *lit;
+    char       *src;
+    int         nop, size;
+
+    if (format == NULL || !*format) {
+        errno = EILSEQ;
+        return NULL;
+    }
+
+    /* check the format and count the ops we need */
+    for (s = format, nop = 1, lit = NULL; *s; s++) {
+        if (*s != '%') {
+            if (lit == NULL) {
+                lit = s;
+                nop++;
+            }
+            continue;
+        }
+
+        lit = NULL;
+        s++;
+
+        switch (*s) {
+        case 'c':                                           /* context name */
+        case 'm':                                            /* module name */
+        case 'f':                                              /* flag name */
+        case 'W':                         /* __FUNCTION__@__FILE__:__LINE__ */
+        case 'C':                                           /* __FUNCTION__ */
+        case 'F':                                               /* __FILE__ */
+        case 'L':                                               /* __LINE__ */
+        case 'U':                                /* absolute UTC time stamp */
+        case 'u':                                   /* delta UTC time stamp */
+        case 'N':                                /* context clock in nsecs */
+        case 'M':                                  /* user supplied message */
+        case 'T':                                           /* message tags */
+            nop++;
+            break;
+        default:
+            ERROR("Invalid format format string \"%s\".", format);
+            ERROR("Illegal part detected at \"%s\".", s);
+            errno = EILSEQ;
+            return NULL;
+        }
+    }
+
+    /* allocate the ops and a copy of the format in a single chunk */
+    size = sizeof(*fmt) + nop * sizeof(fmt->ops[0]);
+    if ((fmt = (format_t *)ALLOC_ARR(char, size + strlen(format) + 1)) == NULL)
+        return NULL;
+
+    src = (char *)fmt + size;
+    strcpy(src, format);
+    fmt->source = src;
+
+    for (s = src, op = fmt->ops; *s; s++) {
+        if (*s != '%') {
+            if (op == fmt->ops || op[-1].op != FMT_LITERAL) {
+                op->op  = FMT_LITERAL;
+                op->lit = s;
+                op->len = 0;
+                op++;
+                fmt->pieces++;
+            }
+            op[-1].len++;
+            continue;
+        }
+
+        switch (*++s) {
+        case 'c': op->op = FMT_CONTEXT;  break;
+        case 'm': op->op = FMT_MODULE;   break;
+        case 'f': op->op = FMT_FLAG;     break;
+        case 'W': op->op = FMT_WHERE;    break;
+        case 'C': op->op = FMT_FUNCTION; break;
+        case 'F': op->op = FMT_FILE;     break;
+        case 'L': op->op = FMT_LINE;     break;
+        case 'U': op->op = FMT_STAMP;    break;
+        case 'u': op->op = FMT_DELTA;    break;
+        case 'N': op->op = FMT_CLOCK;    break;
+        case 'M': op->op = FMT_MESSAGE;  break;
+        case 'T': op->op = FMT_TAGS;     break;
+        }
+
+        if (op->op == FMT_STAMP || op->op == FMT_DELTA)
+            fmt->stamps |= STAMP_WALL;
+        if (op->op == FMT_DELTA || op->op == FMT_CLOCK)
+            fmt->stamps |= STAMP_CLOCK;
+        if (op->op == FMT_TAGS)
+            fmt->tagged = TRUE;
+
+        fmt->pieces += op->op == FMT_WHERE ? 4 : 1;
+        op++;
+    }
+
+    op->op = FMT_END;
+    fmt->pieces += 2;                        /* message, final newline */
+    
+    return fmt;
+}
+
+
+/********************
+ * format_free
+ ********************/
+static void
+format_free(format_t *fmt)
+{
+    FREE(fmt);
+}
+
+
+/*****************************************************************************
+ *                             *** name lookup ***                           *
+ *****************************************************************************/
+
+/*
+ * Contexts, the modules of a context and the flags of a module are each
+ * indexed by name with a small open-addressing hash table. Entries point
+ * to the name owned by the indexed object and carry the hash of the name
+ * computed once when it is added, so a lookup is a hash comparison and a
+ * single strcmp in the common case. Removed entries are left as
+ * tombstones until the table is rehashed. The tables are only used with
+ * the registry locked.
+ */
+
+#define HASH_MIN  8                          /* initial table size */
+
+
+/********************
+ * name_hash
+ ********************/
+static uint32_t
+name_hash(const char *name, int len)
+{
+    uint32_t h = 2166136261U;                /* FNV-1a */
+
+    while (len-- > 0) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+
+/********************
+ * hash_init
+ ********************/
+static void
+hash_init(hashidx_t *idx)
+{
+    idx->entries = NULL;
+    idx->size    = 0;
+    idx->used    = 0;
+}
+
+
+/********************
+ * hash_free
+ ********************/
+static void
+hash_free(hashidx_t *idx)
+{
+    FREE(idx->entries);
+    hash_init(idx);
+}
+
+
+/********************
+ * hash_resize
+ ********************/
+static int
+hash_resize(hashidx_t *idx, int size)
+{
+    hashent_t *old, *e, *n;
+    int        osize, i, j;
+
+    old   = idx->entries;
+    osize = idx->size;
+
+    if ((idx->entries = ALLOC_ARR(hashent_t, size)) == NULL) {
+        idx->entries = old;
+        return -ENOMEM;
+    }
+
+    idx->size = size;
+    idx->used = 0;
+
+    for (i = 0, e = old; i < osize; i++, e++) {
+        if (e->name == NULL || e->idx < 0)
+            continue;
+        for (j = e->hash & (size - 1); idx->entries[j].name != NULL;
+             j = (j + 1) & (size - 1))
+            ;
+        n  = idx->entries + j;
+        *n = *e;
+        idx->used++;
+    }
+
+    FREE(old);
+
+    return 0;
+}
+
+
+/********************
+ * hash_slot
+ ********************/
+static hashent_t *
+hash_slot(hashidx_t *idx, const char *name, int len, uint32_t hash)
+{
+    hashent_t *e;
+    int        i, mask;
+
+    if (idx->size == 0)
+        return NULL;
+
+    mask = idx->size - 1;
+
+    for (i = hash & mask; (e = idx->entries + i)->name != NULL;
+         i = (i + 1) & mask) {
+        if (e->hash == hash && e->idx >= 0 &&
+            !strncmp(e->name, name, len) && e->name[len] == '\0')
+            return e;
+    }
+
+    return NULL;
+}
+
+
+/********************
+ * hash_add
+ ********************/
+static int
+hash_add(hashidx_t *idx, const char *name, int index)
+{
+    hashent_t *e;
+    uint32_t   hash;
+    int        i, mask, live, size, err;
+
+    if (4 * (idx->used + 1) > 3 * idx->size) {    /* rehash or grow */
+        for (i = live = 0; i < idx->size; i++)
+            if (idx->entries[i].name != NULL && idx->entries[i].idx >= 0)
+                live++;
+        if (idx->size == 0)
+            size = HASH_MIN;
+        else if (2 * (live + 1) > idx->size)
+            size = 2 * idx->size;
+        else
+            size = idx->size;
+        if ((err = hash_resize(idx, size)) != 0)
+            return err;
+    }
+
+    hash = name_hash(name, strlen(name));
+    mask = idx->size - 1;
+
+    for (i = hash & mask; (e = idx->entries + i)->name != NULL;
+         i = (i + 1) & mask)
+        ;
+
+    e->name = name;
+    e->hash = hash;
+    e->idx  = index;
+    idx->used++;
+
+    return 0;
+}
+
+
+/********************
+ * hash_del
+ ********************/
+static void
+hash_del(hashidx_t *idx, const char *name)
+{
+    hashent_t *e;
+    int        len = strlen(name);
+
+    if ((e = hash_slot(idx, name, len, name_hash(name, len))) != NULL)
+        e->idx = -1;                         /* leave a tombstone */
+}
+
+
+/********************
+ * hash_find
+ ********************/
+static int
+hash_find(hashidx_t *idx, const char *name, int len)
+{
+    hashent_t *e;
+
+    if ((e = hash_slot(idx, name, len, name_hash(name, len))) != NULL)
+        return e->idx;
+    else
+        return -1;
+}
+
+
+
+
+/*****************************************************************************
+ *                     *** bitmap manipulation routines ***                  *
+ *****************************************************************************/
+
+/*
+ * A bitmap is a cache-line aligned array of BITMAP_WORDS words, enough
+ * for every flag bit a context can have, allocated once. Single bits are
+ * manipulated without any representation checks, and whole modules are
+ * turned on or off by combining the bitmap of the module with the masks
+ * of the context a word at a time. Words past nword are known to be
+ * clear, so bulk operations and publishing only look at the words in
+ * use. nword doubles whenever a bit past it is set.
+ *
+ * Free bits are found a word at a time with ctz. The flags of a module
+ * are allocated as a single run of bits whenever there is one, so they
+ * end up in as few words as possible.
+ */
+
+
+/********************
+ * init_bits
+ ********************/
+static int
+init_bits(bitmap_t *bits)
+{
+    if (posix_memalign((void **)&bits->w, 64, BITMAP_WORDS * BYTES_PER_LONG))
+        return -ENOMEM;
+
+    memset(bits->w, 0, BITMAP_WORDS * BYTES_PER_LONG);
+    bits->nword = 1;
+
+    return 0;
+}
+
+
+/********************
+ * free_bits
+ ********************/
+static void
+free_bits(bitmap_t *bits)
+{
+    free(bits->w);
+    bits->w     = NULL;
+    bits->nword = 0;
+}
+
+
+/********************
+ * bits_span
+ ********************/
+static inline void
+bits_span(bitmap_t *bits, int i)
+{
+    while (bits->nword <= i / BITS_PER_LONG)
+        bits->nword *= 2;
+}
+
+
+/********************
+ * bits_word
+ ********************/
+static inline unsigned long
+bits_word(bitmap_t *bits, int i)
+{
+    return bits->w[i];
+}
+
+
+/********************
+ * bits_or
+ ********************/
+static inline void
+bits_or(bitmap_t *dst, bitmap_t *src)
+{
+    int i;
+
+    if (dst->nword < src->nword)
+        dst->nword = src->nword;
+
+    for (i = 0; i < src->nword; i++)
+        dst->w[i] |= src->w[i];
+}
+
+
+/********************
+ * bits_andnot
+ ********************/
+static inline void
+bits_andnot(bitmap_t *dst, bitmap_t *src)
+{
+    int i, n;
+
+    n = dst->nword < src->nword ? dst->nword : src->nword;
+
+    for (i = 0; i < n; i++)
+        dst->w[i] &= ~src->w[i];
+}
+
+
+/********************
+ * mask_tst
+ ********************/
+static inline int
+mask_tst(unsigned long *mask, trace_flag64_t id)
+{
+    unsigned int b = FLAG_BIT(id);
+
+    return (__atomic_load_n(mask + b / BITS_PER_LONG, __ATOMIC_RELAXED) &
+            (1UL << (b & (BITS_PER_LONG - 1)))) != 0;
+}
+
+
+/********************
+ * find_bit
+ ********************/
+static inline int
+find_bit(bitmap_t *bits, int set, int from, int limit)
+{
+    unsigned long word, flip;
+    int           i;
+
+    /* find the first bit in [from, limit) that is set (or clear) */
+
+    if (from >= limit)
+        return limit;
+
+    flip = set ? 0 : -1UL;
+    i    = from / BITS_PER_LONG;
+    word = (bits->w[i] ^ flip) & (-1UL << (from & (BITS_PER_LONG - 1)));
+
+    while (!word) {
+        if (++i >= (limit + BITS_PER_LONG - 1) / BITS_PER_LONG)
+            return limit;
+        word = bits->w[i] ^ flip;
+    }
+
+    i = i * BITS_PER_LONG + __builtin_ctzl(word);
+
+    return i < limit ? i : limit;
+}
+
+
+/********************
+ * set_run
+ ********************/
+static inline void
+set_run(bitmap_t *bits, int start, int n)
+{
+    unsigned long mask;
+    int           i, b, cnt;
+
+    bits_span(bits, start + n - 1);
+
+    for (i = start; n > 0; i += cnt, n -= cnt) {
+        b    = i & (BITS_PER_LONG - 1);
+        cnt  = BITS_PER_LONG - b < n ? BITS_PER_LONG - b : n;
+        mask = cnt == BITS_PER_LONG ? -1UL : BIT_MASK_GEN(cnt) << b;
+        bits->w[i / BITS_PER_LONG] |= mask;
+    }
+}
+
+
+/********************
+ * alloc_bit
+ ********************/
+static inline int
+alloc_bit(bitmap_t *bits, int limit)
+{
+    int i;
+
+    if ((i = find_bit(bits, FALSE, 0, limit)) >= limit)
+        return -1;
+
+    set_run(bits, i, 1);
+
+    return i;
+}
+
+
+/********************
+ * alloc_run
+ ********************/
+static int
+alloc_run(bitmap_t *bits, int n, int limit)
+{
+    int start, end;
+
+    /* allocate the first run of n free bits below limit */
+
+    if (n <= 0)
+        return -1;
+
+    for (start = 0; start + n <= limit; start = end) {
+        start = find_bit(bits, FALSE, start, limit);
+        if (start + n > limit)
+            break;
+        end = find_bit(bits, TRUE, start, start + n);
+
+        if (end - start == n) {
+            set_run(bits, start, n);
+            return start;
+        }
+    }
+
+    return -1;
+}
+
+
+/********************
+ * set_bit
+ ********************/
+static inline int
+set_bit(bitmap_t *bits, int i)
+{
+    if (likely((unsigned int)i < MAX_FLAGS)) {
+        bits_span(bits, i);
+        bits->w[i / BITS_PER_LONG] |= 1UL << (i & (BITS_PER_LONG - 1));
+        return 0;
+    }
+    else
+        return -EOVERFLOW;
+}
+
+
+/********************
+ * clr_bit
+ ********************/
+static inline int
+clr_bit(bitmap_t *bits, int i)
+{
+    if (likely((unsigned int)i < MAX_FLAGS)) {
+        bits->w[i / BITS_PER_LONG] &= ~(1UL << (i & (BITS_PER_LONG - 1)));
+        return 0;
+    }
+    else
+        return -EOVERFLOW;
+}
+
+
+/********************
+ * tst_bit
+ ********************/
+static inline int
+tst_bit(bitmap_t *bits, int i)
+{
+    if (likely((unsigned int)i < MAX_FLAGS))
+        return (bits->w[i / BITS_PER_LONG] >>
+                (i & (BITS_PER_LONG - 1))) & 0x1;
+    else
+        return 0;
+}
+
+
+
+
+/*****************************************************************************
+ *                    *** binary (deferred format) records ***               *
+ *****************************************************************************/
+
+/*
+ * In binary mode the caller does not format the message. It only parses
+ * the printf format to find out the types of the arguments and copies the
+ * raw argument values to a record. Strings are copied by value, anything
+ * else in 8 (or for long doubles 16) bytes. The consumer later walks the
+ * format again and formats the message from the saved arguments. Formats
+ * with conversions we cannot save (%n, %m, wide characters and strings,
+ * positional arguments) are formatted by the caller as usual. Since the
+ * length of the text is not known until then, trace_printf returns and
+ * the statistics count the size of the record instead.
+ *
+ * Note that the record saves the format, file and function as pointers,
+ * so they can only be decoded by the process that produced them.
+ */
+
+typedef struct {
+    trace_flag64_t  id;                      /* trace flag id */
+    int             line;                    /* __LINE__ */
+    const char     *file;                    /* __FILE__ */
+    const char     *func;                    /* __FUNCTION__ */
+    const char     *format;                  /* message format */
+    tstamp_t        stamp;                   /* time of tracing */
+    char            args[0];                 /* saved arguments */
+} binrec_t;
+
+enum {
+    LEN_NONE = 0,                            /* int, double */
+    LEN_HH,                                  /* char */
+    LEN_H,                                   /* short */
+    LEN_L,                                   /* long */
+    LEN_LL,                                  /* long long */
+    LEN_LD,                                  /* long double */
+    LEN_J,                                   /* intmax_t */
+    LEN_Z,                                   /* size_t */
+    LEN_T,                                   /* ptrdiff_t */
+};
+
+typedef struct {
+    const char *start;                       /* beginning of spec ('%') */
+    const char *end;                         /* end of spec */
+    int         wstar;                       /* '*' width */
+    int         pstar;                       /* '*' precision */
+    int         prec;                        /* precision, -1 if none */
+    int         len;                         /* LEN_* length modifier */
+    char        conv;                        /* conversion character */
+} spec_t;
+
+
+/********************
+ * parse_spec
+ ********************/
+static const char *
+parse_spec(const char *s, spec_t *spec)
+{
+    spec->start = s++;
+    spec->wstar = spec->pstar = FALSE;
+    spec->prec  = -1;
+    spec->len   = LEN_NONE;
+    spec->conv  = '\0';
+
+    while (*s == '-' || *s == '+' || *s == ' ' || *s == '#' ||
+           *s == '0' || *s == '\'')
+        s++;
+
+    if (*s == '*') {
+        spec->wstar = TRUE;
+        s++;
+    }
+    else
+        while ('0' <= *s && *s <= '9')
+            s++;
+
+    if (*s == '$')                           /* positional, unsupported */
+        goto out;
+
+    if (*s == '.') {
+        s++;
+        if (*s == '*') {
+            spec->pstar = TRUE;
+            s++;
+        }
+        else
+            for (spec->prec = 0; '0' <= *s && *s <= '9'; s++)
+                if (spec->prec < INT_MAX / 10)
+                    spec->prec = spec->prec * 10 + (*s - '0');
+    }
+
+    switch (*s) {
+    case 'h':
+        if (*++s == 'h') { spec->len = LEN_HH; s++; }
+        else               spec->len = LEN_H;
+        break;
+    case 'l':
+        if (*++s == 'l') { spec->len = LEN_LL; s++; }
+        else               spec->len = LEN_L;
+        break;
+    case 'q': spec->len = LEN_LL; s++; break;
+    case 'L': spec->len = LEN_LD; s++; break;
+    case 'j': spec->len = LEN_J;  s++; break;
+    case 'z': spec->len = LEN_Z;  s++; break;
+    case 't': spec->len = LEN_T;  s++; break;
+    }
+
+    if (*s)
+        spec->conv = *s++;
+
+ out:
+    spec->end = s;
+    return s;
+}
+
+
+#define PUT_VALUE(v) do {                                       \
+        typeof(v) __v = (v);                                    \
+        if (left < (int)sizeof(__v))                            \
+            return -EOVERFLOW;                                  \
+        memcpy(d, &__v, sizeof(__v));                           \
+        d    += sizeof(__v);                                    \
+        left -= sizeof(__v);                                    \
+    } while (0)
+
+#define GET_VALUE(v) do {                                       \
+        if (left < (int)sizeof(v))                              \
+            goto out;                                           \
+        memcpy(&(v), s, sizeof(v));                             \
+        s    += sizeof(v);                                      \
+        left -= sizeof(v);                                      \
+    } while (0)
+
+
+/********************
+ * binary_encode
+ ********************/
+static int
+binary_encode(const char *format, va_list args, char *buf, int size)
+{
+    spec_t              spec;
+    const char         *f, *str;
+    char               *d;
+    int                 left, n, prec;
+    long long           sval;
+    unsigned long long  uval;
+
+    d    = buf;
+    left = size;
+
+    for (f = format; *f; ) {
+        if (*f != '%') {
+            f++;
+            continue;
+        }
+
+        f = parse_spec(f, &spec);
+
+        if (spec.conv == '%')
+            continue;
+
+        if (spec.wstar)
+            PUT_VALUE(va_arg(args, int));
+        if (spec.pstar) {
+            prec = va_arg(args, int);        /* negative means none */
+            PUT_VALUE(prec);
+        }
+        else
+            prec = spec.prec;
+
+        switch (spec.conv) {
+        case 'd':
+        case 'i':
+            switch (spec.len) {
+            case LEN_L:  sval = va_arg(args, long);      break;
+            case LEN_LL: sval = va_arg(args, long long); break;
+            case LEN_J:  sval = va_arg(args, intmax_t);  break;
+            case LEN_Z:  sval = va_arg(args, ssize_t);   break;
+            case LEN_T:  sval = va_arg(args, ptrdiff_t); break;
+            default:     sval = va_arg(args, int);       break;
+            }
+            PUT_VALUE(sval);
+            break;
+
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            switch (spec.len) {
+            case LEN_L:  uval = va_arg(args, unsigned long);      break;
+            case LEN_LL: uval = va_arg(args, unsigned long long); break;
+            case LEN_J:  uval = va_arg(args, uintmax_t);          break;
+            case LEN_Z:  uval = va_arg(args, size_t);             break;
+            case LEN_T:  uval = va_arg(args, ptrdiff_t);          break;
+            default:     uval = va_arg(args, unsigned int);       break;
+            }
+            PUT_VALUE(uval);
+            break;
+
+        case 'c':
+            if (spec.len != LEN_NONE)
+                return -ENOTSUP;
+            PUT_VALUE(va_arg(args, int));
+            break;
+
+        case 'e': case 'E':
+        case 'f': case 'F':
+        case 'g': case 'G':
+        case 'a': case 'A':
+            if (spec.len == LEN_LD)
+                PUT_VALUE(va_arg(args, long double));
+            else
+                PUT_VALUE(va_arg(args, double));
+            break;
+
+        case 'p':
+            PUT_VALUE(va_arg(args, void *));
+            break;
+
+        case 's':
+            if (spec.len != LEN_NONE)
+                return -ENOTSUP;
+            if ((str = va_arg(args, const char *)) == NULL)
+                str = "(null)";
+            /* with a precision the string need not be terminated */
+            n = prec >= 0 ? (int)strnlen(str, prec) : (int)strlen(str);
+            PUT_VALUE(n);
+            if (left < n)
+                return -EOVERFLOW;
+            memcpy(d, str, n);
+            d    += n;
+            left -= n;
+            break;
+
+        default:
+            return -ENOTSUP;
+        }
+    }
+
+    return size - left;
+}
+
+
+#define PRINT_VALUE(v) do {                                                \
+        if (spec.wstar && spec.pstar)                                      \
+            n = snprintf(d, size, sfmt, width, prec, v);                   \
+        else if (spec.wstar)                                               \
+            n = snprintf(d, size, sfmt, width, v);                         \
+        else if (spec.pstar)                                               \
+            n = snprintf(d, size, sfmt, prec, v);                          \
+        else                                                               \
+            n = snprintf(d, size, sfmt, v);                                \
+    } while (0)
+
+
+/********************
+ * binary_decode
+ ********************/
+static int
+binary_decode(const char *format, const char *args, int len,
+              char *buf, int size)
+{
+    spec_t              spec;
+    const char         *f, *s;
+    char               *d, sfmt[64], str[MAX_MESSAGE / 2];
+    int                 left, n, width, prec, slen, cval;
+    long long           sval;
+    unsigned long long  uval;
+    double              dval;
+    long double         ldval;
+    void               *pval;
+
+    /* saved arguments are trusted to match the format, see encoding */
+
+    s    = args;
+    left = len;
+    d    = buf;
+    size--;                                  /* reserve room for '\0' */
+    width = prec = 0;
+
+    for (f = format; *f && size > 0; ) {
+        if (*f != '%') {
+            *d++ = *f++;
+            size--;
+            continue;
+        }
+
+        f = parse_spec(f, &spec);
+
+        if (spec.conv == '%') {
+            *d++ = '%';
+            size--;
+            continue;
+        }
+
+        if ((n = spec.end - spec.start) >= (int)sizeof(sfmt))
+            goto out;
+        memcpy(sfmt, spec.start, n);
+        sfmt[n] = '\0';
+
+        if (spec.wstar)
+            GET_VALUE(width);
+        if (spec.pstar)
+            GET_VALUE(prec);
+
+        switch (spec.conv) {
+        case 'd':
+        case 'i':
+            GET_VALUE(sval);
+            switch (spec.len) {
+            case LEN_HH:
+            case LEN_H:
+            case LEN_NONE: PRINT_VALUE((int)sval);       break;
+            case LEN_L:    PRINT_VALUE((long)sval);      break;
+            case LEN_J:    PRINT_VALUE((intmax_t)sval);  break;
+            case LEN_Z:    PRINT_VALUE((ssize_t)sval);   break;
+            case LEN_T:    PRINT_VALUE((ptrdiff_t)sval); break;
+            default:       PRINT_VALUE(sval);            break;
+            }
+            break;
+
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            GET_VALUE(uval);
+            switch (spec.len) {
+            case LEN_HH:
+            case LEN_H:
+            case LEN_NONE: PRINT_VALUE((unsigned int)uval);  break;
+            case LEN_L:    PRINT_VALUE((unsigned long)uval); break;
+            case LEN_J:    PRINT_VALUE((uintmax_t)uval);     break;
+            case LEN_Z:    PRINT_VALUE((size_t)uval);        break;
+            case LEN_T:    PRINT_VALUE((ptrdiff_t)uval);     break;
+            default:       PRINT_VALUE(uval);                break;
+            }
+            break;
+
+        case 'c':
+            GET_VALUE(cval);
+            PRINT_VALUE(cval);
+            break;
+
+        case 'e': case 'E':
+        case 'f': case 'F':
+        case 'g': case 'G':
+        case 'a': case 'A':
+            if (spec.len == LEN_LD) {
+                GET_VALUE(ldval);
+                PRINT_VALUE(ldval);
+            }
+            else {
+                GET_VALUE(dval);
+                PRINT_VALUE(dval);
+            }
+            break;
+
+        case 'p':
+            GET_VALUE(pval);
+            PRINT_VALUE(pval);
+            break;
+
+        case 's':
+            GET_VALUE(slen);
+            if (left < slen || slen >= (int)sizeof(str))
+                goto out;
+            memcpy(str, s, slen);
+            str[slen] = '\0';
+            s    += slen;
+            left -= slen;
+            PRINT_VALUE(str);
+            break;
+
+        default:
+            goto out;
+        }
+
+        if (n < 0)
+            goto out;
+        if (n >= size)
+            n = size;
+        d    += n;
+        size -= n;
+    }
+
+ out:
+    *d = '\0';
+    return d - buf;
+}
+
+
+
+
+/*****************************************************************************
+ *                    *** per-thread ring buffer output ***                  *
+ *****************************************************************************/
+
+/*
+ * In ring mode every thread appends its formatted messages to a ring of
+ * its own. The rings are single-producer single-consumer: only the owner
+ * thread ever advances head and only the consumer (the drainer thread or
+ * a thread flushing with ring_lock held) ever advances tail. The drainer
+ * periodically collects the pending records of all rings and writes out
+ * runs of records with the same destination using a single writev.
+ */
+
+#define RING_SIZE     (64 * 1024)            /* ring size per thread */
+#define RING_ALIGN    16                     /* record alignment, must be */
+                                             /* sizeof(ring_rec_t) so that */
+                                             /* a pad header always fits */
+#define RING_WAKEUP   (RING_SIZE / 2)        /* wake drainer at this fill */
+#define RING_PERIOD   10                     /* drainer period (ms) */
+#define RING_IOV      64                     /* max. records per writev */
+
+#define RING_RECSIZE(len) \
+    ((sizeof(ring_rec_t) + (len) + RING_ALIGN - 1) & ~(RING_ALIGN - 1))
+
+#define RING_PAD      0                      /* padding to wrap around */
+#define RING_TEXT     1                      /* formatted message */
+#define RING_BINARY   2                      /* binary record, see below */
+
+#define RING_SCRATCH  (16 * MAX_MESSAGE)     /* room for decoded records */
+
+typedef struct {
+    unsigned int  len;                       /* payload length */
+    int           type;                      /* RING_* record type */
+    int           fd;                        /* destination */
+    int           unused;
+} ring_rec_t;
+
+typedef struct ring_s ring_t;
+struct ring_s {
+    ring_t        *next;                     /* ring of the next thread */
+    int            dead;                     /* owner thread has exited */
+    unsigned long  dropped;                  /* messages dropped, ring full */
+    unsigned long  reported;                 /* drops already reported */
+    unsigned long  head __attribute__((aligned(64)));   /* producer offset */
+    unsigned long  tail __attribute__((aligned(64)));   /* consumer offset */
+    char           data[RING_SIZE] __attribute__((aligned(64)));
+};
+
+static ring_t          *rings;               /* rings of all threads */
+static pthread_mutex_t  ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   ring_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t   ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    ring_key;
+static pthread_t        ring_thread;
+static int              ring_running;
+static int              ring_stopping;
+static __thread ring_t *ring_self;
+
+
+/********************
+ * ring_release
+ ********************/
+static void
+ring_release(void *ptr)
+{
+    ring_t *r = (ring_t *)ptr;
+
+    /* owner is exiting, let the drainer free the ring once it is empty */
+    __atomic_store_n(&r->dead, TRUE, __ATOMIC_RELEASE);
+}
+
+
+/********************
+ * ring_key_init
+ ********************/
+static void
+ring_key_init(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+
+/********************
+ * ring_get
+ ********************/
+static ring_t *
+ring_get(void)
+{
+    ring_t *r = ring_self;
+
+    if (likely(r != NULL))
+        return r;
+
+    pthread_once(&ring_once, ring_key_init);
+
+    if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0)
+        return NULL;
+    memset(r, 0, sizeof(*r));
+
+    pthread_mutex_lock(&ring_lock);
+    r->next = rings;
+    rings   = r;
+    pthread_mutex_unlock(&ring_lock);
+
+    pthread_setspecific(ring_key, r);
+    ring_self = r;
+
+    return r;
+}
+
+
+/********************
+ * ring_put
+ ********************/
+static int
+ring_put(int fd, int type, const void *data, int len)
+{
+    ring_t        *r;
+    ring_rec_t    *rec;
+    unsigned long  head, tail, size, off, room, need;
+
+    if (unlikely((r = ring_get()) == NULL))
+        return -ENOMEM;
+
+    size = RING_RECSIZE(len);
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    off  = head % RING_SIZE;
+    room = RING_SIZE - off;
+    need = size + (room < size ? room : 0);  /* might need to pad to wrap */
+
+    if (unlikely(RING_SIZE - (head - tail) < need)) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&ring_cond);
+        return -ENOBUFS;
+    }
+
+    if (room < size) {
+        rec       = (ring_rec_t *)(r->data + off);
+        rec->len  = room - sizeof(*rec);
+        rec->type = RING_PAD;
+        head     += room;
+        off       = 0;
+    }
+
+    rec       = (ring_rec_t *)(r->data + off);
+    rec->len  = len;
+    rec->type = type;
+    rec->fd   = fd;
+    memcpy(rec + 1, data, len);
+
+    __atomic_store_n(&r->head, head + size, __ATOMIC_RELEASE);
+
+    if (head + size - tail >= RING_WAKEUP)
+        pthread_cond_signal(&ring_cond);
+
+    return len;
+}
+
+
+/********************
+ * ring_write
+ ********************/
+static int
+ring_write(int fd, const char *msg, int len)
+{
+    return ring_put(fd, RING_TEXT, msg, len);
+}
+
+
+/********************
+ * ring_write_binary
+ ********************/
+static int
+ring_write_binary(int fd, trace_flag64_t id, const char *file, int line,
+                  const char *func, tstamp_t *stamp,
+                  const char *format, va_list args)
+{
+    char         buf[MAX_MESSAGE / 2] __attribute__((aligned(16)));
+    binrec_t    *rec = (binrec_t *)buf;
+
+    int          n;
+
+    rec->id     = id;
+    rec->line   = line;
+    rec->file   = file;
+    rec->func   = func;
+    rec->format = format;
+    rec->stamp  = *stamp;
+
+    n = binary_encode(format, args, rec->args, sizeof(buf) - sizeof(*rec));
+
+    if (n < 0)
+        return n;
+
+    return ring_put(fd, RING_BINARY, rec, sizeof(*rec) + n);
+}
+
+
+/********************
+ * ring_decode
+ ********************/
+static int
+ring_decode(binrec_t *rec, int len, char *buf, int size)
+{
+    static char  msg[MAX_MESSAGE];           /* only used with ring_lock */
+    context_t   *ctx;
+    int          n;
+
+    if (read_enter() < 0)
+        return 0;
+
+    if ((ctx = CONTEXT_LOOKUP(FLAG_CTX(rec->id))) == NULL) {
+        read_exit();
+        return 0;
+    }
+
+    binary_decode(rec->format, rec->args, len - sizeof(*rec), msg, sizeof(msg));
+
+    n = format_text(ctx, rec->id, rec->file, rec->line, rec->func,
+                    &rec->stamp, buf, size, "%s", msg);
+
+    read_exit();
+
+    return n > 0 ? n - 1 : 0;
+}
+
+
+/********************
+ * ring_writev
+ ********************/
+static void
+ring_writev(int fd, struct iovec *iov, int niov)
+{
+    ssize_t n;
+
+    while (niov > 0) {
+        if ((n = writev(fd, iov, niov)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        while (niov > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+
+        if (niov > 0) {
+            iov->iov_base  = (char *)iov->iov_base + n;
+            iov->iov_len  -= n;
+        }
+    }
+}
+
+
+/********************
+ * ring_drain
+ ********************/
+static void
+ring_drain(ring_t *r)
+{
+    static char    scratch[RING_SCRATCH];    /* only used with ring_lock */
+    struct iovec   iov[RING_IOV];
+    ring_rec_t    *rec;
+    unsigned long  head, tail, dropped;
+    int            niov, fd, used, n;
+
+    /* must be called with ring_lock held */
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    tail = r->tail;
+
+    while (tail != head) {
+        niov = 0;
+        fd   = -1;
+        used = 0;
+
+        while (tail != head && niov < RING_IOV) {
+            rec = (ring_rec_t *)(r->data + tail % RING_SIZE);
+
+            if (rec->type != RING_PAD) {
+                if (niov > 0 && rec->fd != fd)
+                    break;
+                fd = rec->fd;
+
+                if (rec->type == RING_TEXT) {
+                    iov[niov].iov_base = rec + 1;
+                    iov[niov].iov_len  = rec->len;
+                    niov++;
+                }
+                else {
+                    if (RING_SCRATCH - used < MAX_MESSAGE)
+                        break;
+                    n = ring_decode((binrec_t *)(rec + 1), rec->len,
+                                    scratch + used, MAX_MESSAGE);
+                    if (n > 0) {
+                        iov[niov].iov_base = scratch + used;
+                        iov[niov].iov_len  = n;
+                        used += n;
+                        niov++;
+                    }
+                }
+            }
+
+            tail += RING_RECSIZE(rec->len);
+        }
+
+        if (niov > 0)
+            ring_writev(fd, iov, niov);
+
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->reported) {
+        WARNING("%lu trace messages dropped, ring full.",
+                dropped - r->reported);
+        r->reported = dropped;
+    }
+}
+
+
+/********************
+ * ring_drain_all
+ ********************/
+static void
+ring_drain_all(void)
+{
+    ring_t *r, **prev;
+
+    /* must be called with ring_lock held */
+
+    prev = &rings;
+    while ((r = *prev) != NULL) {
+        ring_drain(r);
+
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+            *prev = r->next;
+            FREE(r);
+        }
+        else
+            prev = &r->next;
+    }
+}
+
+
+/********************
+ * ring_drainer
+ ********************/
+static void *
+ring_drainer(void *data)
+{
+    struct timespec ts;
+
+    (void)data;
+
+    pthread_mutex_lock(&ring_lock);
+
+    while (!ring_stopping) {
+        ring_drain_all();
+        buffer_flush_due();
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += RING_PERIOD * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ring_cond, &ring_lock, &ts);
+    }
+
+    ring_drain_all();
+
+    pthread_mutex_unlock(&ring_lock);
+
+    return NULL;
+}
+
+
+/********************
+ * ring_start
+ ********************/
+static int
+ring_start(void)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&ring_lock);
+
+    if (!ring_running) {
+        ring_stopping = FALSE;
+        if ((err = pthread_create(&ring_thread, NULL, ring_drainer, NULL)) == 0)
+            ring_running = TRUE;
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+
+    return -err;
+}
+
+
+/********************
+ * ring_stop
+ ********************/
+static void
+ring_stop(void)
+{
+    pthread_mutex_lock(&ring_lock);
+
+    if (!ring_running) {
+        pthread_mutex_unlock(&ring_lock);
+        return;
+    }
+
+    ring_stopping = TRUE;
+    pthread_cond_signal(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+
+    pthread_join(ring_thread, NULL);
+    ring_running = FALSE;
+}
+
+
+/********************
+ * ring_flush
+ ********************/
+static void
+ring_flush(void)
+{
+    pthread_mutex_lock(&ring_lock);
+    ring_drain_all();
+    pthread_mutex_unlock(&ring_lock);
+}
+
+
+
+
+/*****************************************************************************
+ *                     *** asynchronous writer output ***                    *
+ *****************************************************************************/
+
+/*
+ * In async mode a context hands its formatted messages to a writer thread
+ * of its own through a bounded queue, so a slow target never stalls the
+ * tracing threads. The queue holds ring records (see above) and is shared
+ * by all threads of the context under a short lock taken only to copy a
+ * message in or a batch of them out; the writer writes batches with the
+ * lock released. When the queue is full the overflow policy of the context
+ * decides what happens:
+ *
+ *   - block: wait for the writer to make room,
+ *   - drop-newest: drop the new message,
+ *   - drop-oldest: drop the oldest queued messages to make room,
+ *   - spill-count: drop the new message and have the writer put a count
+ *     of the dropped messages in the output in their place.
+ *
+ * All dropped messages are counted, see trace_context_dropped.
+ */
+
+#define ASYNC_SIZE    (256 * 1024)           /* queue size per context */
+#define ASYNC_BATCH   (64 * 1024)            /* max. bytes per write */
+#define ASYNC_WAKEUP  (ASYNC_SIZE / 4)       /* wake writer at this fill */
+#define ASYNC_PERIOD  RING_PERIOD            /* writer period (ms) */
+
+
+/********************
+ * async_init
+ ********************/
+static void
+async_init(context_t *ctx)
+{
+    asyncq_t *q = &ctx->async;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->more, NULL);
+    pthread_cond_init(&q->room, NULL);
+    q->data     = NULL;
+    q->size     = 0;
+    q->head     = 0;
+    q->tail     = 0;
+    q->policy   = OVERFLOW_NEWEST;
+    q->dropped  = 0;
+    q->spilled  = 0;
+    q->spillfd  = -1;
+    q->idle     = FALSE;
+    q->busy     = FALSE;
+    q->running  = FALSE;
+    q->stopping = FALSE;
+}
+
+
+/********************
+ * async_free
+ ********************/
+static void
+async_free(context_t *ctx)
+{
+    asyncq_t *q = &ctx->async;
+
+    FREE(q->data);
+    q->data = NULL;
+    q->size = q->head = q->tail = 0;
+    pthread_cond_destroy(&q->more);
+    pthread_cond_destroy(&q->room);
+    pthread_mutex_destroy(&q->lock);
+}
+
+
+/********************
+ * async_policy
+ ********************/
+static int
+async_policy(context_t *ctx, const char *policy)
+{
+    asyncq_t *q = &ctx->async;
+    int       p;
+
+    if (policy == NULL)
+        return -EINVAL;
+
+    if      (!strcmp(policy, TRACE_OVERFLOW_BLOCK))       p = OVERFLOW_BLOCK;
+    else if (!strcmp(policy, TRACE_OVERFLOW_DROP_NEWEST)) p = OVERFLOW_NEWEST;
+    else if (!strcmp(policy, TRACE_OVERFLOW_DROP_OLDEST)) p = OVERFLOW_OLDEST;
+    else if (!strcmp(policy, TRACE_OVERFLOW_SPILL))       p = OVERFLOW_SPILL;
+    else
+        return -EINVAL;
+
+    pthread_mutex_lock(&q->lock);
+    q->policy = p;
+    pthread_cond_broadcast(&q->room);        /* unblock if no longer blocking */
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+
+/********************
+ * async_pop
+ ********************/
+static void
+async_pop(asyncq_t *q)
+{
+    ring_rec_t *rec;
+
+    /* must be called with q->lock held, drops the oldest record */
+
+    rec = (ring_rec_t *)(q->data + q->tail % q->size);
+
+    if (rec->type == RING_TEXT)
+        q->dropped++;
+
+    q->tail += RING_RECSIZE(rec->len);
+}
+
+
+/********************
+ * async_write
+ ********************/
+static int
+async_write(context_t *ctx, int fd, const char *msg, int len)
+{
+    asyncq_t      *q = &ctx->async;
+    ring_rec_t    *rec;
+    unsigned long  size, off, room, need;
+
+    if (unlikely(len > ASYNC_BATCH))         /* writer takes batches only */
+        return -EMSGSIZE;
+
+    size = RING_RECSIZE(len);
+
+    pthread_mutex_lock(&q->lock);
+
+    for (;;) {
+        off  = q->head % q->size;
+        room = q->size - off;
+        need = size + (room < size ? room : 0);
+
+        if (q->size - (q->head - q->tail) >= need)
+            break;
+
+        if (q->idle)
+            pthread_cond_signal(&q->more);
+
+        if (q->policy == OVERFLOW_BLOCK && q->running && !q->stopping) {
+            pthread_cond_wait(&q->room, &q->lock);
+            continue;
+        }
+
+        if (q->policy == OVERFLOW_OLDEST && q->tail != q->head) {
+            async_pop(q);
+            continue;
+        }
+
+        q->dropped++;
+        if (q->policy == OVERFLOW_SPILL) {
+            q->spilled++;
+            q->spillfd = fd;
+        }
+
+        pthread_mutex_unlock(&q->lock);
+        return -ENOBUFS;
+    }
+
+    if (room < size) {
+        rec       = (ring_rec_t *)(q->data + off);
+        rec->len  = room - sizeof(*rec);
+        rec->type = RING_PAD;
+        q->head  += room;
+        off       = 0;
+    }
+
+    rec       = (ring_rec_t *)(q->data + off);
+    rec->len  = len;
+    rec->type = RING_TEXT;
+    rec->fd   = fd;
+    memcpy(rec + 1, msg, len);
+
+    q->head += size;
+
+    if (q->idle && q->head - q->tail >= ASYNC_WAKEUP)
+        pthread_cond_signal(&q->more);
+
+    pthread_mutex_unlock(&q->lock);
+
+    return len;
+}
+
+
+/********************
+ * async_take
+ ********************/
+static int
+async_take(asyncq_t *q, char *buf, int *fd)
+{
+    ring_rec_t *rec;
+    int         n;
+
+    /* must be called with q->lock held, takes a batch for a single fd */
+
+    for (n = 0, *fd = -1; q->tail != q->head; ) {
+        rec = (ring_rec_t *)(q->data + q->tail % q->size);
+
+        if (rec->type == RING_TEXT) {
+            if (n > 0 && (rec->fd != *fd || n + rec->len > ASYNC_BATCH))
+                break;
+            *fd = rec->fd;
+            memcpy(buf + n, rec + 1, rec->len);
+            n += rec->len;
+        }
+
+        q->tail += RING_RECSIZE(rec->len);
+    }
+
+    return n;
+}
+
+
+/********************
+ * async_dump
+ ********************/
+static void
+async_dump(int fd, const char *data, int len)
+{
+    int n;
+
+    for ( ; len > 0; data += n, len -= n) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            break;
+        }
+    }
+}
+
+
+/********************
+ * async_writer
+ ********************/
+static void *
+async_writer(void *data)
+{
+    asyncq_t        *q = (asyncq_t *)data;
+    struct timespec  ts;
+    char             batch[ASYNC_BATCH], msg[64];
+    uint64_t         spilled;
+    int              fd, spillfd, n;
+
+    pthread_mutex_lock(&q->lock);
+
+    for (;;) {
+        if (q->head == q->tail && !q->spilled) {
+            if (q->stopping)
+                break;
+
+            q->idle = TRUE;
+            pthread_cond_broadcast(&q->room);     /* wakes flushers, too */
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += ASYNC_PERIOD * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&q->more, &q->lock, &ts);
+
+            q->idle = FALSE;
+            continue;
+        }
+
+        n          = async_take(q, batch, &fd);
+        spilled    = q->spilled;
+        spillfd    = q->spillfd;
+        q->spilled = 0;
+        q->busy    = TRUE;
+
+        pthread_cond_broadcast(&q->room);
+        pthread_mutex_unlock(&q->lock);
+
+        if (n > 0)
+            async_dump(fd, batch, n);
+
+        if (spilled > 0) {
+            n = snprintf(msg, sizeof(msg), "%llu trace messages dropped.\n",
+                         (unsigned long long)spilled);
+            async_dump(spillfd, msg, n);
+        }
+
+        pthread_mutex_lock(&q->lock);
+        q->busy = FALSE;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+
+/********************
+ * async_start
+ ********************/
+static int
+async_start(context_t *ctx)
+{
+    asyncq_t *q = &ctx->async;
+    int       err = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (!q->running) {
+        if (q->data == NULL) {
+            if ((q->data = ALLOC_ARR(char, ASYNC_SIZE)) == NULL) {
+                pthread_mutex_unlock(&q->lock);
+                return -ENOMEM;
+            }
+            q->size = ASYNC_SIZE;
+            q->head = q->tail = 0;
+        }
+
+        q->stopping = FALSE;
+        if ((err = pthread_create(&q->thread, NULL, async_writer, q)) == 0)
+            q->running = TRUE;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return -err;
+}
+
+
+/********************
+ * async_stop
+ ********************/
+static void
+async_stop(context_t *ctx)
+{
+    asyncq_t *q = &ctx->async;
+
+    /* the writer writes out the whole queue before it exits */
+
+    pthread_mutex_lock(&q->lock);
+
+    if (!q->running) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    q->stopping = TRUE;
+    pthread_cond_signal(&q->more);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_join(q->thread, NULL);
+
+    pthread_mutex_lock(&q->lock);
+    q->running  = FALSE;
+    q->stopping = FALSE;
+    pthread_cond_broadcast(&q->room);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+/********************
+ * async_flush
+ ********************/
+static void
+async_flush(context_t *ctx)
+{
+    asyncq_t *q = &ctx->async;
+
+    /* wait until the writer has written out everything queued so far */
+
+    pthread_mutex_lock(&q->lock);
+
+    while (q->running && (q->head != q->tail || q->spilled || q->busy)) {
+        if (q->idle)
+            pthread_cond_signal(&q->more);
+        pthread_cond_wait(&q->room, &q->lock);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+
+
+/*****************************************************************************
+ *                        *** flight recorder ***                            *
+ *****************************************************************************/
+
+/*
+ * Flags can be put in a third, recorded state besides on and off. Messages
+ * of recorded flags are not written to the target of the context but are
+ * kept in a per-context circular in-memory buffer, overwriting the oldest
+ * ones once the buffer is full. The buffer can be dumped to any target on
+ * demand, for instance after something has gone wrong. Recording works
+ * regardless of whether the context itself is enabled. Records use the
+ * same layout as the per-thread rings and are kept in binary form when
+ * possible so recording does not pay for formatting.
+ */
+
+#define RECORDER_SIZE (256 * 1024)           /* recorder size per context */
+
+
+/********************
+ * recorder_init
+ ********************/
+static int
+recorder_init(context_t *ctx)
+{
+    recorder_t *r = &ctx->recorder;
+
+    pthread_mutex_init(&r->lock, NULL);
+    r->data = NULL;
+    r->size = 0;
+    r->head = r->tail = 0;
+
+    return 0;
+}
+
+
+/********************
+ * recorder_free
+ ********************/
+static void
+recorder_free(context_t *ctx)
+{
+    recorder_t *r = &ctx->recorder;
+
+    pthread_mutex_lock(&r->lock);
+    FREE(r->data);
+    __atomic_store_n(&r->data, NULL, __ATOMIC_RELEASE);
+    r->size = 0;
+    r->head = r->tail = 0;
+    pthread_mutex_unlock(&r->lock);
+    pthread_mutex_destroy(&r->lock);
+}
+
+
+/********************
+ * recorder_alloc
+ ********************/
+static int
+recorder_alloc(context_t *ctx)
+{
+    recorder_t *r = &ctx->recorder;
+    char       *data;
+    int         err;
+
+    /* the buffer is allocated when the first flag is set to be recorded */
+
+    pthread_mutex_lock(&r->lock);
+
+    if (r->data != NULL)
+        err = 0;
+    else if ((data = ALLOC_ARR(char, RECORDER_SIZE)) != NULL) {
+        r->size = RECORDER_SIZE;
+        r->head = r->tail = 0;
+        __atomic_store_n(&r->data, data, __ATOMIC_RELEASE);
+        err = 0;
+    }
+    else
+        err = -ENOMEM;
+
+    pthread_mutex_unlock(&r->lock);
+
+    return err;
+}
+
+
+/********************
+ * recorder_put
+ ********************/
+static int
+recorder_put(recorder_t *r, int type, const void *data, int len)
+{
+    ring_rec_t *rec;
+    uint64_t    size, off, room, need;
+
+    /* must be called with r->lock held */
+
+    size = RING_RECSIZE(len);
+    off  = r->head % r->size;
+    room = r->size - off;
+    need = size + (room < size ? room : 0);
+
+    if (need > (uint64_t)r->size)
+        return -EOVERFLOW;
+
+    while (r->size - (r->head - r->tail) < need) {    /* evict the oldest */
+        rec      = (ring_rec_t *)(r->data + r->tail % r->size);
+        r->tail += RING_RECSIZE(rec->len);
+    }
+
+    if (room < size) {
+        rec       = (ring_rec_t *)(r->data + off);
+        rec->len  = room - sizeof(*rec);
+        rec->type = RING_PAD;
+        r->head  += room;
+        off       = 0;
+    }
+
+    rec       = (ring_rec_t *)(r->data + off);
+    rec->len  = len;
+    rec->type = type;
+    rec->fd   = -1;
+    memcpy(rec + 1, data, len);
+
+    r->head += size;
+
+    return len;
+}
+
+
+/********************
+ * recorder_write
+ ********************/
+static int
+recorder_write(context_t *ctx, trace_flag64_t id, trace_tags_t *tags,
+               const char *file, int line, const char *func,
+               const char *format, va_list args)
+{
+    recorder_t *r = &ctx->recorder;
+    char        buf[MAX_MESSAGE] __attribute__((aligned(16)));
+    binrec_t   *rec = (binrec_t *)buf;
+    tstamp_t    stamp;
+    va_list     ap;
+    int         n;
+
+    if (unlikely(__atomic_load_n(&r->data, __ATOMIC_ACQUIRE) == NULL))
+        return 0;
+
+    stamp_take(ctx, &stamp);
+
+    rec->id     = id;
+    rec->line   = line;
+    rec->file   = file;
+    rec->func   = func;
+    rec->format = format;
+    rec->stamp  = stamp;
+
+    if (tags != NULL && __atomic_load_n(&ctx->format, __ATOMIC_ACQUIRE)->tagged)
+        n = -ENOTSUP;                        /* tags can't be deferred */
+    else {
+        va_copy(ap, args);
+        n = binary_encode(format, ap, rec->args, sizeof(buf) - sizeof(*rec));
+        va_end(ap);
+    }
+
+    if (n >= 0) {
+        pthread_mutex_lock(&r->lock);
+        if (r->data != NULL)
+            n = recorder_put(r, RING_BINARY, rec, sizeof(*rec) + n);
+        pthread_mutex_unlock(&r->lock);
+        return n;
+    }
+
+    if (n != -ENOTSUP && n != -EOVERFLOW)
+        return n;
+
+    n = format_message(ctx, id, tags, file, line, func, &stamp, buf,
+                       sizeof(buf), format, args);
+    if (n < 0)
+        return n;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->data != NULL)
+        n = recorder_put(r, RING_TEXT, buf, n - 1);
+    pthread_mutex_unlock(&r->lock);
+
+    return n;
+}
+
+
+/********************
+ * recorder_dump
+ ********************/
+static int
+recorder_dump(context_t *ctx, const char *target)
+{
+    recorder_t *r = &ctx->recorder;
+    ring_rec_t *rec;
+    binrec_t   *bin;
+    FILE       *fp;
+    uint64_t    tail;
+    char        msg[MAX_MESSAGE], buf[MAX_MESSAGE];
+    const char *data;
+    int         fd, len, err;
+
+    /*
+     * Write out the recorded messages, oldest first, leaving them in the
+     * recorder. Must be called with the registry locked, so binary records
+     * can be formatted using the context.
+     */
+
+    if (target == NULL)
+        return -EINVAL;
+
+    if      (target == TRACE_TO_STDERR) fp = stderr;
+    else if (target == TRACE_TO_STDOUT) fp = stdout;
+    else if (!strcmp(target, "stderr")) fp = stderr;
+    else if (!strcmp(target, "stdout")) fp = stdout;
+    else                                fp = fopen(target, "a");
+
+    if (fp == NULL)
+        return -errno;
+
+    fflush(fp);
+    fd  = fileno(fp);
+    err = 0;
+
+    pthread_mutex_lock(&r->lock);
+
+    for (tail = r->tail; r->data != NULL && tail != r->head && !err;
+         tail += RING_RECSIZE(rec->len)) {
+        rec = (ring_rec_t *)(r->data + tail % r->size);
+
+        switch (rec->type) {
+        case RING_TEXT:
+            data = (const char *)(rec + 1);
+            len  = rec->len;
+            break;
+        case RING_BINARY:
+            bin = (binrec_t *)(rec + 1);
+            binary_decode(bin->format, bin->args, rec->len - sizeof(*bin),
+                          msg, sizeof(msg));
+            len = format_text(ctx, bin->id, bin->file, bin->line, bin->func,
+                              &bin->stamp, buf, sizeof(buf), "%s", msg);
+            data = buf;
+            len  = len > 0 ? len - 1 : 0;
+            break;
+        default:
+            continue;
+        }
+
+        if (len > 0 && write(fd, data, len) < 0)
+            err = -errno;
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    if (fp != stderr && fp != stdout)
+        fclose(fp);
+
+    return err;
+}
+
+
+
+
+/*****************************************************************************
+ *                          *** flag statistics ***                          *
+ *****************************************************************************/
+
+/*
+ * Message statistics are collected per flag when they are turned on for
+ * a context. Each flag has STATS_SHARDS cache-line sized counter shards
+ * and every thread updates the one it was assigned on its first message,
+ * so threads only contend for a line when there are more of them than
+ * shards. Reading the statistics sums up the shards. The shards of a
+ * flag are allocated the first time statistics are turned on and stay
+ * with the flag until its module is deleted; turning statistics off just
+ * stops counting.
+ */
+
+static int          stats_next;              /* next shard to assign */
+static __thread int stats_shard = -1;        /* shard of this thread */
+
+
+/********************
+ * stats_alloc
+ ********************/
+static int
+stats_alloc(module_t *mod)
+{
+    flag_t  *flg;
+    stats_t *st;
+    int      i;
+
+    for (i = 0, flg = mod->flags; i < mod->nflag; i++, flg++) {
+        if (flg->stats != NULL)
+            continue;
+
+        if (posix_memalign((void **)&st, sizeof(*st),
+                           STATS_SHARDS * sizeof(*st)))
+            return -ENOMEM;
+
+        memset(st, 0, STATS_SHARDS * sizeof(*st));
+        __atomic_store_n(&flg->stats, st, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+
+/********************
+ * stats_policy
+ ********************/
+static int
+stats_policy(context_t *ctx, const char *state)
+{
+    module_t *m;
+    flag_t   *f;
+    int       i, j, err;
+
+    if (state == NULL)
+        return -EINVAL;
+
+    if (!strcmp(state, TRACE_STATS_ON)) {
+        for (i = 0, m = ctx->modules; i < ctx->nmodule; i++, m++)
+            if (m->name != NULL && (err = stats_alloc(m)) != 0)
+                return err;
+        __atomic_store_n(&ctx->stats, TRUE, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    if (!strcmp(state, TRACE_STATS_OFF)) {
+        __atomic_store_n(&ctx->stats, FALSE, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    if (!strcmp(state, TRACE_STATS_RESET)) {
+        for (i = 0, m = ctx->modules; i < ctx->nmodule; i++, m++) {
+            if (m->name == NULL)
+                continue;
+            for (j = 0, f = m->flags; j < m->nflag; j++, f++)
+                if (f->stats != NULL)
+                    memset(f->stats, 0, STATS_SHARDS * sizeof(*f->stats));
+        }
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+
+/********************
+ * stats_get
+ ********************/
+static inline stats_t *
+stats_get(context_t *ctx, flag_t *flg)
+{
+    stats_t *st;
+
+    if (likely(!__atomic_load_n(&ctx->stats, __ATOMIC_RELAXED)))
+        return NULL;
+
+    if ((st = __atomic_load_n(&flg->stats, __ATOMIC_ACQUIRE)) == NULL)
+        return NULL;
+
+    if (unlikely(stats_shard < 0))
+        stats_shard = __atomic_fetch_add(&stats_next, 1, __ATOMIC_RELAXED) %
+            STATS_SHARDS;
+
+    return st + stats_shard;
+}
+
+
+/********************
+ * stats_count
+ ********************/
+static inline void
+stats_count(stats_t *st, int n, uint64_t format_ns)
+{
+    /* n is the result of writing the message, <= 0 if it was not written */
+
+    if (st == NULL)
+        return;
+
+    if (n > 0) {
+        __atomic_add_fetch(&st->emitted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->bytes, n, __ATOMIC_RELAXED);
+    }
+    else
+        __atomic_add_fetch(&st->suppressed, 1, __ATOMIC_RELAXED);
+
+    if (format_ns != 0)
+        __atomic_add_fetch(&st->format_ns, format_ns, __ATOMIC_RELAXED);
+}
+
+
+/********************
+ * stats_sum
+ ********************/
+static void
+stats_sum(flag_t *flg, trace_stats_t *stats)
+{
+    stats_t *st;
+    int      i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    if ((st = flg->stats) == NULL)
+        return;
+
+    for (i = 0; i < STATS_SHARDS; i++, st++) {
+        stats->emitted    += __atomic_load_n(&st->emitted, __ATOMIC_RELAXED);
+        stats->suppressed += __atomic_load_n(&st->suppressed,
+                                             __ATOMIC_RELAXED);
+        stats->bytes      += __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+        stats->format_ns  += __atomic_load_n(&st->format_ns,
+                                             __ATOMIC_RELAXED);
+    }
+}
+
+
+
+
+/*****************************************************************************
+ *                            *** rate limiting ***                          *
+ *****************************************************************************/
+
+/*
+ * A flag can be limited to a number of messages per second. The limit is
+ * a token bucket holding a second's worth of messages, kept as the time
+ * the next message is due at (GCRA): a message is let through if that
+ * time is less than a second ahead, and pushes it one interval further.
+ * This takes a single compare-and-swap and happens before the message is
+ * formatted. Messages over the limit are counted and a summary of them is
+ * emitted with the next message let through, at most once a second.
+ */
+
+#define LIMIT_BURST  1000000000ULL           /* a second's worth of burst */
+#define LIMIT_REPORT 1000000000ULL           /* summary period (ns) */
+#define LIMIT_MAX    1000000000              /* highest limit (1/s) */
+
+
+/********************
+ * limit_set
+ ********************/
+static void
+limit_set(flag_t *flg, int rate)
+{
+    flg->rate = rate;
+    __atomic_store_n(&flg->tat, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&flg->interval, rate ? 1000000000ULL / rate : 0,
+                     __ATOMIC_RELEASE);
+}
+
+
+/********************
+ * limit_check
+ ********************/
+static inline int
+limit_check(flag_t *flg, uint64_t *now)
+{
+    uint64_t interval, tat, next;
+
+    interval = __atomic_load_n(&flg->interval, __ATOMIC_ACQUIRE);
+    *now     = clock_ns(CLK_MONOTONIC);
+    tat      = __atomic_load_n(&flg->tat, __ATOMIC_RELAXED);
+
+    do {
+        next = (tat > *now ? tat : *now) + interval;
+        if (next - *now > LIMIT_BURST) {
+            __atomic_add_fetch(&flg->dropped, 1, __ATOMIC_RELAXED);
+            return FALSE;
+        }
+    } while (!__atomic_compare_exchange_n(&flg->tat, &tat, next, TRUE,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return TRUE;
+}
+
+
+/********************
+ * limit_message
+ ********************/
+static int
+limit_message(context_t *ctx, trace_flag64_t id, const char *file, int line,
+              const char *func, char *buf, int size, const char *format, ...)
+{
+    va_list ap;
+    int     n;
+
+    va_start(ap, format);
+    n = format_message(ctx, id, NULL, file, line, func, NULL, buf, size,
+                       format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+
+/********************
+ * limit_report
+ ********************/
+static void
+limit_report(context_t *ctx, trace_flag64_t id, flag_t *flg, uint64_t now,
+             const char *file, int line, const char *func, char *buf, int size)
+{
+    uint64_t last, dropped;
+    FILE    *fp;
+    tmap_t  *map;
+    int      n;
+
+    /* only one thread gets to report, and only once a period */
+
+    last = __atomic_load_n(&flg->reported, __ATOMIC_RELAXED);
+
+    if (now - last < LIMIT_REPORT && last != 0)
+        return;
+
+    if (!__atomic_compare_exchange_n(&flg->reported, &last, now, FALSE,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    if ((dropped = __atomic_exchange_n(&flg->dropped, 0,
+                                       __ATOMIC_RELAXED)) == 0)
+        return;
+
+    n = limit_message(ctx, id, file, line, func, buf, size,
+                      "%llu messages suppressed (limit %d/s)\n",
+                      (unsigned long long)dropped, flg->rate);
+
+    if (n > 0) {
+        fp  = __atomic_load_n(&ctx->destination, __ATOMIC_ACQUIRE);
+        map = __atomic_load_n(&ctx->map, __ATOMIC_ACQUIRE);
+        trace_output(ctx, fp, map, __atomic_load_n(&ctx->mode,
+                                                   __ATOMIC_ACQUIRE),
+                     buf, n - 1);
+    }
+}
+
+
+/********************
+ * parse_rate
+ ********************/
+static int
+parse_rate(const char *spec)
+{
+    char *end;
+    long  n;
+
+    /* N/s */
+
+    n = strtol(spec, &end, 10);
+
+    if (end == spec || strcmp(end, "/s") || n <= 0 || n > LIMIT_MAX)
+        return -EINVAL;
+
+    return (int)n;
+}
+
+
+
+
+/*****************************************************************************
+ *                              *** sampling ***                             *
+ *****************************************************************************/
+
+/*
+ * A flag can be sampled, so that only 1 in N of its messages is formatted
+ * and written, either every Nth message or a random one in N. Sampling is
+ * decided per thread without touching any shared data: every Nth message
+ * is counted down in a per-thread table of countdowns, and random ones
+ * are picked with a per-thread xorshift generator. Every flag sampled by
+ * count gets a slot of its own in the table when sampling is turned on,
+ * and gives it back when sampling is turned off or its module goes away.
+ * Once all slots are taken, further flags are sampled randomly instead,
+ * which keeps them at about 1 in N without a countdown to share. A slot
+ * given back and taken again may start mid-count. Sampling happens before
+ * rate limiting, so a limit applies to the messages sampled.
+ */
+
+#define SAMPLE_SLOTS 256                     /* per-thread countdowns */
+#define SAMPLE_MAX   INT_MAX                 /* largest N of 1/N */
+
+static unsigned long     sample_used[SAMPLE_SLOTS / BITS_PER_LONG]; /* taken */
+static __thread uint64_t sample_seed;        /* xorshift state of thread */
+static __thread int      sample_left[SAMPLE_SLOTS]; /* messages until next */
+
+
+/********************
+ * sample_release
+ ********************/
+static void
+sample_release(flag_t *flg)
+{
+    int slot = flg->slot;
+
+    if (slot != 0) {
+        sample_used[slot / BITS_PER_LONG] &= ~(1UL << (slot % BITS_PER_LONG));
+        __atomic_store_n(&flg->slot, 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+/********************
+ * sample_set
+ ********************/
+static void
+sample_set(flag_t *flg, int n, int random)
+{
+    unsigned long *w, b;
+    int            slot;
+
+    /* slot 0 is not a countdown, flags left without one sample randomly */
+    if (n > 1 && !random) {
+        for (slot = 1; flg->slot == 0 && slot < SAMPLE_SLOTS; slot++) {
+            w = sample_used + slot / BITS_PER_LONG;
+            b = 1UL << (slot % BITS_PER_LONG);
+            if (!(*w & b)) {
+                *w |= b;
+                __atomic_store_n(&flg->slot, slot, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    else
+        sample_release(flg);
+
+    __atomic_store_n(&flg->random, random ? TRUE : FALSE, __ATOMIC_RELAXED);
+    __atomic_store_n(&flg->sample, n > 1 ? n : 0, __ATOMIC_RELEASE);
+}
+
+
+/********************
+ * sample_check
+ ********************/
+static inline int
+sample_check(flag_t *flg, int n)
+{
+    int      *left, slot;
+    uint64_t  x;
+
+    slot = __atomic_load_n(&flg->slot, __ATOMIC_RELAXED);
+
+    if (slot == 0 || __atomic_load_n(&flg->random, __ATOMIC_RELAXED)) {
+        if (unlikely((x = sample_seed) == 0))
+            x = ((uint64_t)(uintptr_t)&sample_seed ^
+                 clock_ns(CLK_MONOTONIC)) | 1;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sample_seed = x;
+
+        return (((x >> 32) * (uint64_t)n) >> 32) == 0;
+    }
+
+    left = sample_left + slot;
+
+    if (*left >= n)                          /* N was lowered */
+        *left = 0;
+
+    if (*left > 0) {
+        (*left)--;
+        return FALSE;
+    }
+
+    *left = n - 1;
+    return TRUE;
+}
+
+
+/********************
+ * parse_sample
+ ********************/
+static int
+parse_sample(const char *spec, int *random)
+{
+    char *end;
+    long  n;
+
+    /* 1/N or ~1/N */
+
+    if ((*random = (*spec == '~')))
+        spec++;
+
+    if (strncmp(spec, "1/", 2))
+        return -EINVAL;
+
+    spec += 2;
+    n = strtol(spec, &end, 10);
+
+    if (end == spec || *end || n <= 0 || n > SAMPLE_MAX)
+        return -EINVAL;
+
+    return (int)n;
+}
+
+
+
+
+/*****************************************************************************
+ *                             *** tag filters ***                           *
+ *****************************************************************************/
+
+/*
+ * The tag filters of a context are compiled into an index whenever they
+ * change. Every filter is anchored at one of its expressions, preferably
+ * an exact key=value one, and the index maps the anchors to the filters
+ * anchored there: exact ones by key=value, any-value and regexp ones by
+ * key. Checking a message takes one or two hash lookups per tag and only
+ * evaluates the filters anchored at one of its tags, however many filters
+ * there are. The index is never modified once built. A new one replaces
+ * it and the old one is freed once no thread is using it, just like a
+ * context format, so the trace path reads it without locking.
+ */
+
+#define FILTER_TERM 256                      /* max. indexed key=value */
+
+
+/********************
+ * filter_free
+ ********************/
+static void
+filter_free(filter_t *f)
+{
+    filtexpr_t *e;
+    int         i;
+
+    if (f == NULL)
+        return;
+
+    for (i = 0, e = f->exprs; i < f->nexpr; i++, e++) {
+        FREE(e->key);
+        FREE(e->value);
+        if (e->re != NULL) {
+            regfree(e->re);
+            FREE(e->re);
+        }
+    }
+
+    FREE(f);
+}
+
+
+/********************
+ * filter_new
+ ********************/
+static filter_t *
+filter_new(trace_tags_t *tags, int regexp)
+{
+    filter_t    *f;
+    filtexpr_t  *e;
+    trace_tag_t *t;
+    int          ntag, i;
+
+    ntag = tags != NULL ? tags->ntag : 0;
+
+    f = (filter_t *)ALLOC_ARR(char, sizeof(*f) + ntag * sizeof(f->exprs[0]));
+
+    if (f == NULL)
+        return NULL;
+
+    f->regexp = regexp;
+
+    for (i = 0, t = tags ? tags->tags : NULL; i < ntag; i++, t++) {
+        e = f->exprs + f->nexpr++;
+
+        if (t->key == NULL || t->value == NULL || !*t->key ||
+            strchr(t->key, '=') != NULL ||
+            strlen(t->key) + 1 + strlen(t->value) >= FILTER_TERM) {
+            filter_free(f);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        if ((e->key = STRDUP(t->key)) == NULL)
+            goto nomem;
+
+        if (!regexp && !strcmp(t->value, TRACE_FILTER_ANY))
+            continue;
+
+        if ((e->value = STRDUP(t->value)) == NULL)
+            goto nomem;
+
+        if (regexp) {
+            if ((e->re = ALLOC(regex_t)) == NULL)
+                goto nomem;
+            if (regcomp(e->re, e->value, REG_EXTENDED | REG_NOSUB) != 0) {
+                FREE(e->re);
+                e->re = NULL;
+                filter_free(f);
+                errno = EINVAL;
+                return NULL;
+            }
+        }
+    }
+
+    return f;
+
+ nomem:
+    filter_free(f);
+    errno = ENOMEM;
+    return NULL;
+}
+
+
+/********************
+ * filter_same
+ ********************/
+static int
+filter_same(filter_t *a, filter_t *b)
+{
+    filtexpr_t *x, *y;
+    int         i, j;
+
+    if (a->regexp != b->regexp || a->nexpr != b->nexpr)
+        return FALSE;
+
+    for (i = 0, x = a->exprs; i < a->nexpr; i++, x++) {
+        for (j = 0, y = b->exprs; j < b->nexpr; j++, y++)
+            if (!strcmp(x->key, y->key) &&
+                (x->value == NULL ? y->value == NULL :
+                 y->value != NULL && !strcmp(x->value, y->value)))
+                break;
+        if (j == b->nexpr)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/********************
+ * filter_match
+ ********************/
+static int
+filter_match(filter_t *f, trace_tags_t *tags)
+{
+    filtexpr_t  *e;
+    trace_tag_t *t;
+    int          i, j;
+
+    /* every expression must be matched by some tag */
+
+    for (i = 0, e = f->exprs; i < f->nexpr; i++, e++) {
+        for (j = 0, t = tags->tags; j < tags->ntag; j++, t++) {
+            if (strcmp(t->key, e->key))
+                continue;
+            if (e->value == NULL)
+                break;
+            if (e->re != NULL ? !regexec(e->re, t->value, 0, NULL, 0) :
+                !strcmp(t->value, e->value))
+                break;
+        }
+        if (j == tags->ntag)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/********************
+ * filtidx_free
+ ********************/
+static void
+filtidx_free(filtidx_t *idx)
+{
+    int i;
+
+    if (idx == NULL)
+        return;
+
+    for (i = 0; i < idx->nterm; i++) {
+        FREE(idx->terms[i].name);
+        FREE(idx->terms[i].filters);
+    }
+
+    FREE(idx->terms);
+    FREE(idx->filters);
+    hash_free(&idx->values);
+    hash_free(&idx->keys);
+    FREE(idx);
+}
+
+
+/********************
+ * filtidx_anchor
+ ********************/
+static int
+filtidx_anchor(filtidx_t *idx, hashidx_t *terms, const char *name, int filter)
+{
+    filtterm_t *t;
+    int         i, *filters;
+
+    if ((i = hash_find(terms, name, strlen(name))) < 0) {
+        if (REALLOC_ARR(idx->terms, idx->nterm, idx->nterm + 1) == NULL)
+            return -ENOMEM;
+        t = idx->terms + idx->nterm;
+        if ((t->name = STRDUP(name)) == NULL)
+            return -ENOMEM;
+        if (hash_add(terms, t->name, idx->nterm) != 0) {
+            FREE(t->name);
+            t->name = NULL;
+            return -ENOMEM;
+        }
+        i = idx->nterm++;
+    }
+
+    t       = idx->terms + i;
+    filters = t->filters;
+
+    if (REALLOC_ARR(filters, t->nfilter, t->nfilter + 1) == NULL)
+        return -ENOMEM;
+
+    t->filters = filters;
+    t->filters[t->nfilter++] = filter;
+
+    return 0;
+}
+
+
+/********************
+ * filtidx_build
+ ********************/
+static filtidx_t *
+filtidx_build(context_t *ctx)
+{
+    filtidx_t  *idx;
+    filter_t   *f;
+    filtexpr_t *e, *anchor;
+    char        term[FILTER_TERM];
+    int         i, j;
+
+    if (ctx->nfilter == 0)
+        return NULL;
+
+    if ((idx = ALLOC(filtidx_t)) == NULL)
+        return NULL;
+
+    hash_init(&idx->values);
+    hash_init(&idx->keys);
+
+    if ((idx->filters = ALLOC_ARR(filter_t *, ctx->nfilter)) == NULL)
+        goto fail;
+
+    memcpy(idx->filters, ctx->filters, ctx->nfilter * sizeof(*ctx->filters));
+    idx->nfilter = ctx->nfilter;
+
+    for (i = 0; i < idx->nfilter; i++) {
+        f = idx->filters[i];
+
+        if (f->nexpr == 0) {
+            idx->all = TRUE;
+            continue;
+        }
+
+        /* anchor at the first exact expression, or the first one */
+        for (j = 0, e = f->exprs, anchor = e; j < f->nexpr; j++, e++)
+            if (e->value != NULL && e->re == NULL) {
+                anchor = e;
+                break;
+            }
+
+        if (anchor->value != NULL && anchor->re == NULL) {
+            snprintf(term, sizeof(term), "%s=%s", anchor->key, anchor->value);
+            if (filtidx_anchor(idx, &idx->values, term, i) != 0)
+                goto fail;
+        }
+        else if (filtidx_anchor(idx, &idx->keys, anchor->key, i) != 0)
+            goto fail;
+    }
+
+    return idx;
+
+ fail:
+    filtidx_free(idx);
+    return NULL;
+}
+
+
+/********************
+ * filter_publish
+ ********************/
+static int
+filter_publish(context_t *ctx)
+{
+    filtidx_t *old, *new;
+
+    /* must be called with the registry locked */
+
+    if ((new = filtidx_build(ctx)) == NULL && ctx->nfilter > 0)
+        return -ENOMEM;
+
+    old = ctx->filtidx;
+    __atomic_store_n(&ctx->filtidx, new, __ATOMIC_RELEASE);
+
+    if (old != NULL) {
+        registry_sync();
+        filtidx_free(old);
+    }
+
+    return 0;
+}
+
+
+/********************
+ * filter_add
+ ********************/
+static int
+filter_add(context_t *ctx, trace_tags_t *tags, int regexp)
+{
+    filter_t **filters, *f;
+    int        err;
+
+    if ((f = filter_new(tags, regexp)) == NULL)
+        return -errno;
+
+    filters = ctx->filters;
+    if (REALLOC_ARR(filters, ctx->nfilter, ctx->nfilter + 1) == NULL) {
+        filter_free(f);
+        return -ENOMEM;
+    }
+
+    ctx->filters = filters;
+    ctx->filters[ctx->nfilter++] = f;
+
+    if ((err = filter_publish(ctx)) != 0) {
+        ctx->nfilter--;
+        filter_free(f);
+    }
+
+    return err;
+}
+
+
+/********************
+ * filter_del
+ ********************/
+static int
+filter_del(context_t *ctx, trace_tags_t *tags, int regexp)
+{
+    filter_t *f, *old;
+    int       i, err;
+
+    if ((f = filter_new(tags, regexp)) == NULL)
+        return -errno;
+
+    for (i = 0; i < ctx->nfilter; i++)
+        if (filter_same(ctx->filters[i], f))
+            break;
+
+    filter_free(f);
+
+    if (i == ctx->nfilter)
+        return -ENOENT;
+
+    old = ctx->filters[i];
+    memmove(ctx->filters + i, ctx->filters + i + 1,
+            (ctx->nfilter - i - 1) * sizeof(*ctx->filters));
+    ctx->nfilter--;
+
+    if ((err = filter_publish(ctx)) != 0) {
+        memmove(ctx->filters + i + 1, ctx->filters + i,
+                (ctx->nfilter - i) * sizeof(*ctx->filters));
+        ctx->filters[i] = old;
+        ctx->nfilter++;
+        return err;
+    }
+
+    filter_free(old);                        /* index no longer refers to it */
+
+    return 0;
+}
+
+
+/********************
+ * filter_reset
+ ********************/
+static void
+filter_reset(context_t *ctx)
+{
+    int i, n;
+
+    n = ctx->nfilter;
+    ctx->nfilter = 0;
+    filter_publish(ctx);                     /* can't fail without filters */
+
+    for (i = 0; i < n; i++)
+        filter_free(ctx->filters[i]);
+
+    FREE(ctx->filters);
+    ctx->filters = NULL;
+}
+
+
+/********************
+ * filter_term
+ ********************/
+static inline int
+filter_term(filtidx_t *idx, int term, trace_tags_t *tags)
+{
+    filtterm_t *t = idx->terms + term;
+    int         i;
+
+    for (i = 0; i < t->nfilter; i++)
+        if (filter_match(idx->filters[t->filters[i]], tags))
+            return TRUE;
+
+    return FALSE;
+}
+
+
+/********************
+ * filter_check
+ ********************/
+static int
+filter_check(context_t *ctx, trace_tags_t *tags)
+{
+    filtidx_t   *idx;
+    trace_tag_t *t;
+    char         term[FILTER_TERM];
+    int          i, k, klen, vlen;
+
+    if ((idx = __atomic_load_n(&ctx->filtidx, __ATOMIC_ACQUIRE)) == NULL)
+        return TRUE;                         /* no filters, nothing to check */
+
+    if (idx->all)
+        return TRUE;
+
+    for (i = 0, t = tags->tags; i < tags->ntag; i++, t++) {
+        klen = strlen(t->key);
+        vlen = strlen(t->value);
+
+        if (klen + 1 + vlen < FILTER_TERM) {
+            memcpy(term, t->key, klen);
+            term[klen] = '=';
+            memcpy(term + klen + 1, t->value, vlen);
+            if ((k = hash_find(&idx->values, term, klen + 1 + vlen)) >= 0 &&
+                filter_term(idx, k, tags))
+                return TRUE;
+        }
+
+        if ((k = hash_find(&idx->keys, t->key, klen)) >= 0 &&
+            filter_term(idx, k, tags))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/********************
+ * parse_filter
+ ********************/
+static int
+parse_filter(char *args, trace_tags_t *tags)
+{
+    char *key, *value, *next;
+
+    /* split "key=value key2=value2 ..." in place */
+
+    for (key = args; key != NULL && *key; key = next) {
+        while (*key == ' ')
+            key++;
+        if (!*key)
+            break;
+
+        if ((next = strchr(key, ' ')) != NULL)
+            *next++ = '\0';
+
+        if ((value = strchr(key, '=')) == NULL || value == key)
+            return -EINVAL;
+        *value++ = '\0';
+
+        if (trace_tag_add(tags, key, value) != 0)
+            return -ENOSPC;
+    }
+
+    return 0;
+}
+
+
+
+
+/*****************************************************************************
+ *                   *** memory-mapped circular file target ***              *
+ *****************************************************************************/
 
-    const char *s;
-    char       *d, stamp[STAMP_SIZE];
-    int         left, n, msg_printed;
+/*
+ * A target of the form mmap:path[:size=N[k|m|g]] preallocates a file of
+ * the given size, maps it and uses it as a circular buffer of messages,
+ * so writing a message is a memcpy without any system calls, and the
+ * most recent messages survive a crash of the process. An existing file
+ * of the same size is reused and appended to. trace-extract dumps the
+ * messages of such a file in order.
+ */
 
-    struct timeval diff, now;
-    
-    
-    mod = NULL;
-    flg = NULL;
-    now.tv_sec = now.tv_usec = 0;
-    msg_printed = FALSE;
-    stamp[0] = '\0';
+#define MMAP_DEFAULT_SIZE (16 * 1024 * 1024)
+#define MMAP_SIZE_OPT     ":size="
 
-    s    = ctx->format;
-    d    = buf;
-    left = bufsize - 1;
 
-    while (*s && left > 0) {
-        
-        if (*s != '%') {
-            *d++ = *s++;
-            left--;
-            continue;
+/********************
+ * mmap_parse
+ ********************/
+static int
+mmap_parse(const char *target, char *path, size_t len, uint64_t *sizep)
+{
+    const char         *p, *opt;
+    char               *end;
+    unsigned long long  size;
+    size_t              n;
+
+    p = target + sizeof(TRACE_TO_MMAP_PREFIX) - 1;
+
+    if ((opt = strstr(p, MMAP_SIZE_OPT)) != NULL) {
+        size = strtoull(opt + sizeof(MMAP_SIZE_OPT) - 1, &end, 10);
+        switch (*end) {
+        case 'g': case 'G': size *= 1024;          /* fall through */
+        case 'm': case 'M': size *= 1024;          /* fall through */
+        case 'k': case 'K': size *= 1024; end++;   /* fall through */
+        case '\0':                        break;
+        default:                          return -EINVAL;
         }
+        if (*end || end == opt + sizeof(MMAP_SIZE_OPT) - 1 || size == 0)
+            return -EINVAL;
+        n = opt - p;
+    }
+    else {
+        size = MMAP_DEFAULT_SIZE;
+        n    = strlen(p);
+    }
 
-        s++;
-
-        /* hmm... should we add support for field width (ie. %15c) ? */
+    if (n == 0 || n >= len)
+        return -EINVAL;
 
-        switch (*s) {
-        case 'c':                                           /* context name */
-            n = snprintf(d, left, "%s", ctx->name);
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
+    memcpy(path, p, n);
+    path[n] = '\0';
+    *sizep  = size;
 
-        case 'm':                                            /* module name */
-            m   = FLAG_MOD(id);
-            mod = MODULE_LOOKUP(ctx, m);
-            n   = snprintf(d, left, "%s", mod ? mod->name : "<unknown>");
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
+    return 0;
+}
 
-        case 'f':                                              /* flag name */
-            if (mod == NULL) {
-                m   = FLAG_MOD(id);
-                mod = MODULE_LOOKUP(ctx, m);
-            }
-            f   = FLAG_IDX(id);
-            flg = FLAG_LOOKUP(mod, f);
-            n   = snprintf(d, left, "%s", flg ? flg->name : "<unknown>");
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
 
-        case 'W':                         /* __FUNCTION__@__FILE__:__LINE__ */
-            n = snprintf(d, left, "%s@%s:%d", func, file, line);
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
+/********************
+ * mmap_open
+ ********************/
+static tmap_t *
+mmap_open(const char *target)
+{
+    trace_mmap_hdr_t *hdr;
+    tmap_t           *map;
+    struct stat       st;
+    char              path[PATH_MAX];
+    uint64_t          size;
+    size_t            len;
+    void             *ptr;
+    int               fd, err, reuse;
+
+    if ((err = mmap_parse(target, path, sizeof(path), &size)) < 0) {
+        errno = -err;
+        return NULL;
+    }
 
-        case 'C':                                           /* __FUNCTION__ */
-            n = snprintf(d, left, "%s", func);
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return NULL;
 
-        case 'F':                                               /* __FILE__ */
-            n = snprintf(d, left, "%s", file);
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
+    len = TRACE_MMAP_HDRSIZE + size;
 
-        case 'L':                                               /* __LINE__ */
-            n = snprintf(d, left, "%d", line);
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
-            
-        case 'U':                                /* absolute UTC time stamp */
-            n = snprintf(d, left, "%s", get_timestamp(stamp, &now));
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
+    if (fstat(fd, &st) < 0)
+        goto fail;
 
-        case 'u':                                   /* delta UTC time stamp */
-            if (!ctx->prev.tv_sec) {
-                n = snprintf(d, left, "%s",
-                             stamp[0] ? stamp : get_timestamp(stamp, &now));
-            }
-            else {
-                if (!now.tv_sec)
-                    gettimeofday(&now, NULL);
-                TIMEVAL_DIFF(diff, now, ctx->prev);
-                n = snprintf(d, left, "+%4.4d.%3.3d",
-                             (int)diff.tv_sec, (int)diff.tv_usec % 1000);
-            }
-            ctx->prev = now;
-            CHECK_SPACE(n, left);
-            d    += n;
-            left -= n;
-            break;
-        
-        case 'M':                                  /* user supplied message */
-            n = vsnprintf(d, left, format, args);
-            CHECK_SPACE(n, left);
-            d    += (n - 1);                       /* chop off trailing '\n' */
-            left -= (n - 1);
-            msg_printed = TRUE;
-            break;
+    reuse = ((uint64_t)st.st_size == len);
 
-        default:
-            *d++ = *s;
-            left--;
+    if (!reuse) {
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, len) < 0)
+            goto fail;
+        if ((err = posix_fallocate(fd, 0, len)) != 0 && err != EOPNOTSUPP) {
+            errno = err;
+            goto fail;
         }
-
-        s++;
-    }
-    
-    if (!msg_printed) {
-        n = vsnprintf(d, left, format, args);
-        CHECK_SPACE(n, left);
-        d    += (n - 1);                           /* chop off trailing '\n' */
-        left -= (n - 1);
     }
-    
-    if (left < 2)
-        goto nospace;
-    *d++ = '\n'; left--;
-    *d   = '\0';
-    
-    return bufsize - left;
-    
 
- nospace:
-    /* in the case of overflow try to end the message with '...\0' */
-    if (bufsize >= 4) {
-        d = buf + bufsize - 1 - 3;
-        d[0] = d[1] = d[2] = '.';
-        d[3] = '\0';
+    ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        goto fail;
+    close(fd);
+
+    hdr = (trace_mmap_hdr_t *)ptr;
+
+    if (!reuse || strcmp(hdr->magic, TRACE_MMAP_MAGIC) ||
+        hdr->version != TRACE_MMAP_VERSION ||
+        hdr->hdrsize != TRACE_MMAP_HDRSIZE || hdr->size != size) {
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->version = TRACE_MMAP_VERSION;
+        hdr->hdrsize = TRACE_MMAP_HDRSIZE;
+        hdr->size    = size;
+        hdr->head    = 0;
+        strcpy(hdr->magic, TRACE_MMAP_MAGIC);
     }
-    else {
-        *d = '\0';
+
+    if (ALLOC_OBJ(map) == NULL) {
+        munmap(ptr, len);
+        errno = ENOMEM;
+        return NULL;
     }
-    return -EOVERFLOW;
+
+    map->hdr  = hdr;
+    map->data = (char *)ptr + TRACE_MMAP_HDRSIZE;
+    map->size = size;
+    map->len  = len;
+
+    return map;
+
+ fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
 }
 
 
+/********************
+ * mmap_close
+ ********************/
+static void
+mmap_close(tmap_t *map)
+{
+    if (map == NULL)
+        return;
+
+    msync(map->hdr, map->len, MS_ASYNC);
+    munmap(map->hdr, map->len);
+    FREE(map);
+}
+
 
 /********************
- * check_format
+ * mmap_write
  ********************/
 static int
-check_format(const char *format)
+mmap_write(tmap_t *map, const char *msg, int len)
 {
-    const char *s = format;
-
-    if (format == NULL || !*format)
-        return -EILSEQ;
+    uint64_t pos, off, n;
 
-    while (*s) {
-        if (*s != '%') {
-            s++;
-            continue;
-        }
+    if (unlikely((uint64_t)len > map->size))
+        return -EMSGSIZE;
 
-        s++;
+    pos = __atomic_fetch_add(&map->hdr->head, len, __ATOMIC_RELAXED);
+    off = pos % map->size;
+    n   = map->size - off;
 
-        switch (*s) {
-        case 'c':                                           /* context name */
-        case 'm':                                            /* module name */
-        case 'f':                                              /* flag name */
-        case 'W':                         /* __FUNCTION__@__FILE__:__LINE__ */
-        case 'C':                                           /* __FUNCTION__ */
-        case 'F':                                               /* __FILE__ */
-        case 'L':                                               /* __LINE__ */
-        case 'U':                                /* absolute UTC time stamp */
-        case 'u':                                   /* delta UTC time stamp */
-        case 'M':                                  /* user supplied message */
-            break;
-        default:
-            ERROR("Invalid format format string \"%s\".", format);
-            ERROR("Illegal part detected at \"%s\".", s);
-            return -EILSEQ;
-        }
-        
-        s++;
+    if (n >= (uint64_t)len)
+        memcpy(map->data + off, msg, len);
+    else {
+        memcpy(map->data + off, msg, n);
+        memcpy(map->data, msg + n, len - n);
     }
-    
-    return 0;
+
+    return len;
 }
 
 
+
+
 /*****************************************************************************
- *                     *** bitmap manipulation routines ***                  *
+ *                         *** buffered direct output ***                    *
  *****************************************************************************/
 
+/*
+ * By default direct mode writes every message with a write of its own.
+ * With any other flush policy messages are coalesced into a per-context
+ * buffer, which is written out when
+ *
+ *   - it does not have room for the next message (size=N: N bytes),
+ *   - the flush interval has elapsed (interval=T, checked by the drainer),
+ *   - the context is closed or retargeted, or the library is shut down,
+ *   - trace_context_flush(cid, NULL) is called, or
+ *   - the process crashes (SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT).
+ *
+ * Ring and binary modes are already coalesced by the drainer, async mode
+ * by its writer thread, and are not affected by the flush policy.
+ */
+
+#define FLUSH_BUFSIZE   (64 * 1024)          /* default buffer size */
+#define FLUSH_MAXSIZE   (16 * 1024 * 1024)   /* maximum buffer size */
+
+static int fatal_signals[] = {                /* crashes only */
+    SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+};
+
+#define NFATAL ((int)(sizeof(fatal_signals) / sizeof(fatal_signals[0])))
+
+static struct sigaction fatal_saved[NFATAL];
+static int              fatal_installed;
+
 
 /********************
- * alloc_bit
+ * buffer_init
  ********************/
-static inline int
-alloc_bit(bitmap_t *bits)
+static int
+buffer_init(context_t *ctx)
 {
-    unsigned long *wptr, word;
-    int            nw, i;
-    
-    if (bits->nbit <= BITS_PER_LONG) {
-        wptr = &bits->bits.word;
-        nw   = 1;
-    }
-    else {
-        wptr = bits->bits.wptr;
-        nw   = (bits->nbit + BITS_PER_LONG - 1) / BITS_PER_LONG;
-    }
-	
-	
-    /*
-     * find word with free bit, then binary search within that word
-     */
-    
-    for (i = 0, word = *wptr; i < nw && (word = *wptr) == (-1UL); i++, wptr++)
-        ;
+    outbuf_t *out = &ctx->out;
 
-    if (i < nw) {
-        int j;
-        i *= BITS_PER_LONG;
+    pthread_mutex_init(&out->lock, NULL);
+    out->data    = NULL;
+    out->size    = 0;
+    out->used    = 0;
+    out->fd      = -1;
+    out->flushed = 0;
 
-        for (j = BITS_PER_LONG / 2; j > 0; j /= 2) {
-            if ((word & (BIT_MASK_GEN(j))) == (BIT_MASK_GEN(j)))
-                i += j, word >>= j;
-        }
+    return 0;
+}
 
-        *wptr |= (0x1UL << (i & (BITS_PER_LONG - 1)));
 
-        return i;
-    }
+/********************
+ * buffer_free
+ ********************/
+static void
+buffer_free(context_t *ctx)
+{
+    outbuf_t *out = &ctx->out;
 
-    return -1;
+    FREE(out->data);
+    out->data = NULL;
+    out->size = out->used = 0;
+    pthread_mutex_destroy(&out->lock);
 }
 
 
 /********************
- * set_bit
+ * buffer_dump
  ********************/
-static inline int
-set_bit(bitmap_t *bits, int i)
+static void
+buffer_dump(outbuf_t *out)
 {
-    unsigned long *wptr;
-    
-    if (0 <= i && i < bits->nbit) {
-        if (bits->nbit <= BITS_PER_LONG)
-            wptr = &bits->bits.word;
-        else
-            wptr = &bits->bits.wptr[i / BITS_PER_LONG];
-        *wptr |= 1 << (i & (BITS_PER_LONG - 1));
-    
-        return 0;
+    int n, left;
+
+    /* must be called with out->lock held, or from a fatal signal */
+
+    for (left = out->used; left > 0; left -= n) {
+        n = write(out->fd, out->data + out->used - left, left);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            break;
+        }
     }
-    else
-        return -EOVERFLOW;
+
+    out->used    = 0;
+    out->flushed = clock_ns(CLK_MONOTONIC);
 }
 
 
 /********************
- * clr_bit
+ * buffer_flush
  ********************/
-static inline int
-clr_bit(bitmap_t *bits, int i)
+static void
+buffer_flush(context_t *ctx)
 {
-    unsigned long *wptr;
-	
-    if (0 <= i && i < bits->nbit) {
-        if (bits->nbit <= BITS_PER_LONG)
-            wptr = &bits->bits.word;
-        else
-            wptr = bits->bits.wptr + (i / BITS_PER_LONG);
+    outbuf_t *out = &ctx->out;
 
-        *wptr &= ~(0x1UL << (i & (BITS_PER_LONG - 1)));
-        return 0;
-    }
-    else
-        return -EOVERFLOW;
+    pthread_mutex_lock(&out->lock);
+    if (out->used > 0)
+        buffer_dump(out);
+    pthread_mutex_unlock(&out->lock);
 }
 
 
 /********************
- * tst_bit
+ * buffer_write
  ********************/
-static inline int
-tst_bit(bitmap_t *bits, int i)
+static int
+buffer_write(context_t *ctx, int fd, const char *msg, int len)
 {
-    unsigned long word;
-	
-    if (0 <= i && i < bits->nbit) {
-        if (bits->nbit <= BITS_PER_LONG)
-            word = bits->bits.word;
-        else
-            word = bits->bits.wptr[i / BITS_PER_LONG];
-        
-        return (word & (1 << (i & (BITS_PER_LONG - 1)))) != 0;
+    outbuf_t *out = &ctx->out;
+    int       n;
+
+    pthread_mutex_lock(&out->lock);
+
+    if (out->used > 0 && (out->fd != fd || out->size - out->used < len))
+        buffer_dump(out);
+
+    if (len <= out->size) {
+        memcpy(out->data + out->used, msg, len);
+        out->used += len;
+        out->fd    = fd;
+        n          = len;
     }
     else
-        return 0;
+        n = write(fd, msg, len);           /* too big or buffer disabled */
+
+    pthread_mutex_unlock(&out->lock);
+
+    return n;
 }
 
 
 /********************
- * init_bits
+ * buffer_flush_due
  ********************/
 static void
-init_bits(bitmap_t *bits)
+buffer_flush_due(void)
 {
-    bits->nbit = 32;
+    context_t *ctx;
+    uint64_t   now;
+    int        i;
+
+    /* called periodically by the drainer thread */
+
+    if (read_enter() < 0)
+        return;
+
+    now = clock_ns(CLK_MONOTONIC);
+
+    for (i = 0; i < MAX_CONTEXTS; i++) {
+        if ((ctx = CONTEXT_LOOKUP(i)) == NULL)
+            continue;
+        if (__atomic_load_n(&ctx->flush, __ATOMIC_ACQUIRE) != FLUSH_INTERVAL)
+            continue;
+        if (!__atomic_load_n(&ctx->out.used, __ATOMIC_RELAXED))
+            continue;
+
+        pthread_mutex_lock(&ctx->out.lock);
+        if (ctx->out.used > 0 && now - ctx->out.flushed >= ctx->interval)
+            buffer_dump(&ctx->out);
+        pthread_mutex_unlock(&ctx->out.lock);
+    }
+
+    read_exit();
 }
 
 
 /********************
- * realloc_bits
+ * fatal_handler
  ********************/
-static int
-realloc_bits(bitmap_t *bits, int n)
+static void
+fatal_handler(int sig, siginfo_t *info, void *uc)
 {
-    int            oldn, newn;
-    unsigned long *wptr;
-	
-    if (unlikely(n == bits->nbit))
-        return 0;
-	
-    oldn = (bits->nbit + BITS_PER_LONG - 1) / BITS_PER_LONG;
-    newn = (n          + BITS_PER_LONG - 1) / BITS_PER_LONG;
-        
-    if (n > bits->nbit) {                               /* grow */
-        if (oldn == 1) {
-            if ((wptr = ALLOC_ARR(typeof(*wptr), newn)) == NULL)
-                return -ENOMEM;
-            *wptr = bits->bits.word;
-            bits->bits.wptr = wptr;
-        }
-        else {
-            if (REALLOC_ARR(bits->bits.wptr, oldn, newn) == NULL)
-                return -ENOMEM;
-        }
+    struct sigaction *old;
+    context_t        *ctx;
+    int               i;
+
+    /*
+     * Write out whatever is buffered without locking, then pass the
+     * signal on to the previous handler or the default action.
+     */
+
+    for (i = 0; i < MAX_CONTEXTS; i++) {
+        ctx = contexts + i;
+        if (ctx->name != NULL && ctx->out.used > 0)
+            buffer_dump(&ctx->out);
     }
-    else {                                            /* shrink */
-        if (newn == 1) {
-            wptr = bits->bits.wptr;
-            bits->bits.word = *wptr;
-            FREE(wptr);
-        }
-        else {
-            if (REALLOC_ARR(bits->bits.wptr, oldn, newn) == NULL)
-                return -ENOMEM;
-        }
+
+    for (i = 0, old = NULL; i < NFATAL; i++)
+        if (fatal_signals[i] == sig)
+            old = fatal_saved + i;
+
+    if (old == NULL)
+        return;
+
+    if (old->sa_flags & SA_SIGINFO)
+        old->sa_sigaction(sig, info, uc);
+    else if (old->sa_handler == SIG_IGN)
+        return;
+    else if (old->sa_handler != SIG_DFL)
+        old->sa_handler(sig);
+    else {
+        sigaction(sig, old, NULL);
+        raise(sig);
     }
-    
-    bits->nbit = newn * BITS_PER_LONG;
-    
-    return 0;
 }
 
 
 /********************
- * free_bits
+ * fatal_install
+ ********************/
+static void
+fatal_install(void)
+{
+    struct sigaction sa;
+    int              i;
+
+    if (fatal_installed)
+        return;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fatal_handler;
+    sa.sa_flags     = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    for (i = 0; i < NFATAL; i++)
+        sigaction(fatal_signals[i], &sa, fatal_saved + i);
+
+    fatal_installed = TRUE;
+}
+
+
+/********************
+ * fatal_restore
  ********************/
 static void
-free_bits(bitmap_t *bits)
+fatal_restore(void)
 {
-    if (bits->nbit > BITS_PER_LONG) {
-        free(bits->bits.wptr);
-        bits->bits.word = 0;
-        bits->nbit      = BITS_PER_LONG;
+    struct sigaction cur;
+    int              i;
+
+    if (!fatal_installed)
+        return;
+
+    /* leave alone handlers the application installed after ours */
+    for (i = 0; i < NFATAL; i++) {
+        if (sigaction(fatal_signals[i], NULL, &cur) < 0)
+            continue;
+        if ((cur.sa_flags & SA_SIGINFO) && cur.sa_sigaction == fatal_handler)
+            sigaction(fatal_signals[i], fatal_saved + i, NULL);
     }
+
+    fatal_installed = FALSE;
 }
 
 
 /********************
- * alloc_flag
+ * parse_policy
  ********************/
-static inline int
-alloc_flag(context_t *ctx)
+static int
+parse_policy(const char *policy, long *value)
+{
+    const char *v;
+    char       *end;
+    long        n;
+
+    if (policy == NULL)
+        return -EINVAL;
+
+    if (!strcmp(policy, TRACE_FLUSH_LINE))
+        return FLUSH_LINE;
+    if (!strcmp(policy, TRACE_FLUSH_NEVER))
+        return FLUSH_NEVER;
+
+    if (!strncmp(policy, "size=", 5)) {
+        v = policy + 5;
+        n = strtol(v, &end, 10);
+        if      (!strcasecmp(end, "k")) n *= 1024;
+        else if (!strcasecmp(end, "m")) n *= 1024 * 1024;
+        else if (*end)                  return -EINVAL;
+        if (end == v || n <= 0 || n > FLUSH_MAXSIZE)
+            return -EINVAL;
+        *value = n;
+        return FLUSH_SIZE;
+    }
+
+    if (!strncmp(policy, "interval=", 9)) {
+        v = policy + 9;
+        n = strtol(v, &end, 10);
+        if      (!strcmp(end, "ms")) n *= 1000000L;
+        else if (!strcmp(end, "s"))  n *= 1000000000L;
+        else if (!strcmp(end, "us")) n *= 1000L;
+        else                         return -EINVAL;
+        if (end == v || n <= 0)
+            return -EINVAL;
+        *value = n;
+        return FLUSH_INTERVAL;
+    }
+
+    return -EINVAL;
+}
+
+
+/********************
+ * buffer_policy
+ ********************/
+static int
+buffer_policy(context_t *ctx, const char *policy)
 {
-    bitmap_t *bits = &ctx->bits;
-    bitmap_t *mask = &ctx->mask;
-    int       bit  = alloc_bit(bits);
+    outbuf_t *out = &ctx->out;
+    char     *data;
+    long      value;
+    int       flush, size, err;
+
+    if ((flush = parse_policy(policy, &value)) < 0)
+        return flush;
+
+    if (flush == FLUSH_INTERVAL && (err = ring_start()) < 0)
+        return err;
+
+    size = flush == FLUSH_SIZE ? (int)value : FLUSH_BUFSIZE;
 
-    if (bit < 0) {
-        realloc_bits(bits, bits->nbit + 1);
-        realloc_bits(mask, mask->nbit + 1);
-        bit = alloc_bit(bits);
+    pthread_mutex_lock(&out->lock);
+
+    if (out->used > 0)
+        buffer_dump(out);
+
+    if (flush != FLUSH_LINE && out->size != size) {
+        if ((data = ALLOC_ARR(char, size)) == NULL) {
+            pthread_mutex_unlock(&out->lock);
+            return -ENOMEM;
+        }
+        FREE(out->data);
+        out->data = data;
+        out->size = size;
     }
 
-    return bit;
+    ctx->interval = flush == FLUSH_INTERVAL ? (uint64_t)value : 0;
+    __atomic_store_n(&ctx->flush, flush, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&out->lock);
+
+    if (flush != FLUSH_LINE)
+        fatal_install();
+
+    return 0;
 }
 
 
@@ -1312,9 +7868,17 @@ alloc_flag(context_t *ctx)
 /*
  * The possible commands are currently:
  *
- *    context.module=[+|-]flag1, ..., [+|-]flagn
+ *    context.module=[+|-|~]flag1[%[~]1/N][@N/s], ..., [+|-|~]flagn[...]
  *    context > path, or context target path
  *    context format 'format'
+ *    context mode direct|ring|binary|async
+ *    context overflow block|drop-newest|drop-oldest|spill-count
+ *    context clock realtime|monotonic|monotonic_raw|tsc
+ *    context flush line|size=N[k|m]|interval=T{us|ms|s}|never
+ *    context dump path|stdout|stderr
+ *    context stats on|off|reset
+ *    context filter add|del|add-regexp|del-regexp key=value ...
+ *    context filter reset
  *    context enable
  *    context disable
  */
@@ -1326,11 +7890,20 @@ alloc_flag(context_t *ctx)
 #define MODSEP   '.'
 #define FLAGSEP  ','
 #define CMDSEP   ';'
+#define RATESEP  '@'
+#define SAMPLESEP '%'
 #define ENABLE   "enabled"
 #define DISABLE  "disable"
 #define TARGET   "target"
 #define REDIR    ">"
 #define FORMAT   "format"
+#define MODE     "mode"
+#define CLOCK    "clock"
+#define FLUSH    "flush"
+#define DUMP     "dump"
+#define STATS    "stats"
+#define OVERFLOW "overflow"
+#define FILTER   "filter"
 
 
 /********************
@@ -1342,9 +7915,14 @@ flip_flag(char *context, char *module, char *flag)
     context_t *cptr;
     module_t  *mptr;
     flag_t    *fptr;
-    int        nctx, nmod, nflg, off = FALSE;
+    char      *limit, *sample, rinfo[32], sinfo[32];
+    int        nctx, nmod, off = FALSE, rec = FALSE, rate, nth, rnd, i;
 
     switch (flag[0]) {
+    case '~':
+        rec = TRUE;
+        flag++;
+        break;
     case '-':
         off = TRUE;
         /* fall through */
@@ -1352,6 +7930,41 @@ flip_flag(char *context, char *module, char *flag)
         flag++;
     }
 
+    /* a flag setting also sets the sampling and rate limit of the flag */
+    limit  = strchr(flag, RATESEP);
+    sample = strchr(flag, SAMPLESEP);
+
+    if (sample != NULL)
+        *sample++ = '\0';
+    if (limit != NULL)
+        *limit++ = '\0';
+
+    if (sample != NULL) {
+        if ((nth = parse_sample(sample, &rnd)) < 0) {
+            ERROR("Invalid sampling \"%s\" for flag \"%s\".", sample, flag);
+            return -EINVAL;
+        }
+        snprintf(sinfo, sizeof(sinfo), ", sampled %s1/%d", rnd ? "~" : "",
+                 nth);
+    }
+    else {
+        nth      = 0;
+        rnd      = FALSE;
+        sinfo[0] = '\0';
+    }
+
+    if (limit != NULL) {
+        if ((rate = parse_rate(limit)) < 0) {
+            ERROR("Invalid rate limit \"%s\" for flag \"%s\".", limit, flag);
+            return -EINVAL;
+        }
+        snprintf(rinfo, sizeof(rinfo), ", at most %d/s", rate);
+    }
+    else {
+        rate     = 0;
+        rinfo[0] = '\0';
+    }
+
     /* pick all or the named context */
     if (!strcmp(context, WILDCARD)) {
         cptr = contexts;
@@ -1369,6 +7982,11 @@ flip_flag(char *context, char *module, char *flag)
         if (cptr->name == NULL)                    /* skip deleted contexts */
             continue;
 
+        if (rec && recorder_alloc(cptr) != 0) {
+            ERROR("Failed to set up flight recorder for \"%s\".", cptr->name);
+            return -ENOMEM;
+        }
+
         /* pick all or the named module */
         if (!strcmp(module, WILDCARD)) {
             mptr = cptr->modules;
@@ -1388,37 +8006,61 @@ flip_flag(char *context, char *module, char *flag)
             if (mptr->name == NULL)                /* skip deleted modules */
                 continue;
         
-            /* pick all or the named flag */
+            /* flip all flags of the module at once */
             if (!strcmp(flag, FLAG_ALL)) {
-                fptr = mptr->flags;
-                nflg = mptr->nflag;
-            }
-            else {
-                if ((fptr = flag_find(mptr, flag, NULL)) == NULL) {
-                    ERROR("Flag \"%s.%s.%s\" does not exist.", context,
-                          module, flag);
-                    return -ENOENT;
-                }
-                nflg = 1;
-            }
-
-            /* do the actual flag flipping */
-            for ( ; nflg > 0; fptr++, nflg--) {
-                if (fptr->name == NULL)            /* skip deleted flags */
-                    continue;
-
                 if (off) {
-                    clr_bit(&cptr->mask, fptr->bit);
-                    INFO("%s.%s.%s is now off.", cptr->name, mptr->name,
-                               fptr->name);
+                    bits_andnot(&cptr->mask, &mptr->bits);
+                    bits_andnot(&cptr->record, &mptr->bits);
+                }
+                else if (rec) {
+                    bits_andnot(&cptr->mask, &mptr->bits);
+                    bits_or(&cptr->record, &mptr->bits);
                 }
                 else {
-                    set_bit(&cptr->mask, fptr->bit);
-                    INFO("%s.%s.%s is now on.", cptr->name, mptr->name,
-                               fptr->name);
+                    bits_or(&cptr->mask, &mptr->bits);
+                    bits_andnot(&cptr->record, &mptr->bits);
+                }
+                for (i = 0; i < mptr->nflag; i++) {
+                    sample_set(mptr->flags + i, nth, rnd);
+                    limit_set(mptr->flags + i, rate);
                 }
+                INFO("%s.%s.%s is now %s%s%s.", cptr->name, mptr->name,
+                     FLAG_ALL, off ? "off" : (rec ? "recorded" : "on"),
+                     sinfo, rinfo);
+                continue;
+            }
+
+            /* flip the named flag */
+            if ((fptr = flag_find(mptr, flag, NULL)) == NULL) {
+                ERROR("Flag \"%s.%s.%s\" does not exist.", context,
+                      module, flag);
+                return -ENOENT;
+            }
+
+            sample_set(fptr, nth, rnd);
+            limit_set(fptr, rate);
+
+            if (off) {
+                clr_bit(&cptr->mask, fptr->bit);
+                clr_bit(&cptr->record, fptr->bit);
+                INFO("%s.%s.%s is now off%s%s.", cptr->name, mptr->name,
+                     fptr->name, sinfo, rinfo);
+            }
+            else if (rec) {
+                clr_bit(&cptr->mask, fptr->bit);
+                set_bit(&cptr->record, fptr->bit);
+                INFO("%s.%s.%s is now recorded%s%s.", cptr->name,
+                     mptr->name, fptr->name, sinfo, rinfo);
+            }
+            else {
+                set_bit(&cptr->mask, fptr->bit);
+                clr_bit(&cptr->record, fptr->bit);
+                INFO("%s.%s.%s is now on%s%s.", cptr->name, mptr->name,
+                     fptr->name, sinfo, rinfo);
             }
         }
+
+        context_publish(cptr);
     }
 
     return 0;
@@ -1460,6 +8102,7 @@ context_command(char *context, char *command, char *args)
             if (cptr->name == NULL)
                 continue;
             cptr->disabled = (command[0] == 'd' ? TRUE : FALSE);
+            context_publish(cptr);
             INFO("%s is now %sabled.", context, command[0] == 'd' ? "dis":"en");
         }
         
@@ -1521,6 +8164,158 @@ context_command(char *context, char *command, char *args)
     }
 
 
+    /* command: "context mode direct|ring|binary|async" */
+    if (!strcmp(command, MODE)) {
+        for (status = 0; nctx > 0; cptr++, nctx--) {
+            if (cptr->name == NULL)
+                continue;
+            if (context_mode(cptr, args) != 0) {
+                ERROR("Failed to set mode '%s' for '%s'.", args, cptr->name);
+                status = -EINVAL;
+            }
+            else
+                INFO("Mode for '%s' is now '%s'.", cptr->name, args);
+        }
+
+        return status;
+    }
+
+
+    /* command: "context clock realtime|monotonic|monotonic_raw|tsc" */
+    if (!strcmp(command, CLOCK)) {
+        for (status = 0; nctx > 0; cptr++, nctx--) {
+            if (cptr->name == NULL)
+                continue;
+            if (context_clock(cptr, args) != 0) {
+                ERROR("Failed to set clock '%s' for '%s'.", args, cptr->name);
+                status = -EINVAL;
+            }
+            else
+                INFO("Clock for '%s' is now '%s'.", cptr->name, args);
+        }
+
+        return status;
+    }
+
+
+    /* command: "context flush line|size=N|interval=T|never" */
+    if (!strcmp(command, FLUSH)) {
+        for (status = 0; nctx > 0; cptr++, nctx--) {
+            if (cptr->name == NULL)
+                continue;
+            if (buffer_policy(cptr, args) != 0) {
+                ERROR("Failed to set flush policy '%s' for '%s'.", args,
+                      cptr->name);
+                status = -EINVAL;
+            }
+            else
+                INFO("Flush policy for '%s' is now '%s'.", cptr->name, args);
+        }
+
+        return status;
+    }
+
+
+    /* command: "context overflow block|drop-newest|drop-oldest|spill-count" */
+    if (!strcmp(command, OVERFLOW)) {
+        for (status = 0; nctx > 0; cptr++, nctx--) {
+            if (cptr->name == NULL)
+                continue;
+            if (async_policy(cptr, args) != 0) {
+                ERROR("Failed to set overflow policy '%s' for '%s'.", args,
+                      cptr->name);
+                status = -EINVAL;
+            }
+            else
+                INFO("Overflow policy for '%s' is now '%s'.", cptr->name,
+                     args);
+        }
+
+        return status;
+    }
+
+
+    /* command: "context filter add|del|add-regexp|del-regexp k=v ...|reset" */
+    if (!strcmp(command, FILTER)) {
+        TRACE_DECLARE_TAGS(filter, MAX_NAME / 4, 0);
+        char *op = args, *tags;
+        int   regexp, err;
+
+        if ((tags = strchr(args, ' ')) != NULL)
+            *tags++ = '\0';
+        else
+            tags = "";
+
+        regexp = !strcmp(op, "add-regexp") || !strcmp(op, "del-regexp");
+
+        if (strcmp(op, "reset") && strcmp(op, "add") && strcmp(op, "del") &&
+            !regexp) {
+            ERROR("Invalid filter command '%s'.", op);
+            return -EINVAL;
+        }
+
+        if (parse_filter(tags, &filter) != 0) {
+            ERROR("Invalid filter '%s'.", tags);
+            return -EINVAL;
+        }
+
+        for (status = 0; nctx > 0; cptr++, nctx--) {
+            if (cptr->name == NULL)
+                continue;
+            if (op[0] == 'r') {
+                filter_reset(cptr);
+                continue;
+            }
+            if (op[0] == 'a')
+                err = filter_add(cptr, &filter, regexp);
+            else
+                err = filter_del(cptr, &filter, regexp);
+            if (err == -ENOENT && !strcmp(context, WILDCARD))
+                continue;                    /* not all contexts have it */
+            if (err != 0) {
+                ERROR("Failed to %s filter for '%s' (%d: %s).", op,
+                      cptr->name, -err, strerror(-err));
+                status = err;
+            }
+        }
+
+        return status;
+    }
+
+
+    /* command: "context dump path|stdout|stderr" */
+    if (!strcmp(command, DUMP)) {
+        for (status = 0; nctx > 0; cptr++, nctx--) {
+            if (cptr->name == NULL)
+                continue;
+            if (recorder_dump(cptr, args) < 0) {
+                ERROR("Failed to dump '%s' to '%s'.", cptr->name, args);
+                status = -EIO;
+            }
+        }
+
+        return status;
+    }
+
+
+    /* command: "context stats on|off|reset" */
+    if (!strcmp(command, STATS)) {
+        for (status = 0; nctx > 0; cptr++, nctx--) {
+            if (cptr->name == NULL)
+                continue;
+            if (stats_policy(cptr, args) != 0) {
+                ERROR("Failed to turn statistics '%s' for '%s'.", args,
+                      cptr->name);
+                status = -EINVAL;
+            }
+            else
+                INFO("Statistics for '%s' are now '%s'.", cptr->name, args);
+        }
+
+        return status;
+    }
+
+
     ERROR("Unkown command '%s' for context '%s'.", command, context);
     return -EILSEQ;
 }
@@ -1601,7 +8396,7 @@ context_configure(char *context, const char *config)
         
         d = args;
         l = 0;
-        while (*s && *s != CMDSEP) {
+        while (*s && *s != CMDSEP && l < MAX_NAME - 1) {
             *d++ = *s++;
             l++;
         }
@@ -1640,6 +8435,9 @@ trace_configure(const char *config)
     if (config == NULL)
         return -EINVAL;
     
+    REGISTRY_LOCK();
+    jump_hold++;                             /* patch once, when done */
+
     s = config;
 
     while (s != NULL && *s) {
@@ -1663,13 +8461,226 @@ trace_configure(const char *config)
             *d = '\0';
         
         if ((s = context_configure(context, s)) == NULL)
-            return -1;
+            break;
         
         if (*s == CMDSEP)
             s++;
     }
 
-    return 0;
+    jump_hold--;
+    jump_update();
+    REGISTRY_UNLOCK();
+
+    return s != NULL ? 0 : -1;
+}
+
+
+/*
+ * trace_show appends to the buffer of the caller through a running length,
+ * so showing thousands of flags stays linear. Once the buffer is full the
+ * rest of the output is only measured, so the caller learns the size it
+ * needs from the return value, just like with snprintf.
+ */
+
+typedef struct {
+    char   *buf;                             /* buffer of the caller */
+    size_t  size;                            /* size of buffer */
+    size_t  len;                             /* length of full output */
+} show_t;
+
+static const char *mode_names[] = {
+    [MODE_DIRECT] = TRACE_MODE_DIRECT,
+    [MODE_RING]   = TRACE_MODE_RING,
+    [MODE_BINARY] = TRACE_MODE_BINARY,
+    [MODE_ASYNC]  = TRACE_MODE_ASYNC,
+};
+
+static const char *overflow_names[] = {
+    [OVERFLOW_BLOCK]  = TRACE_OVERFLOW_BLOCK,
+    [OVERFLOW_NEWEST] = TRACE_OVERFLOW_DROP_NEWEST,
+    [OVERFLOW_OLDEST] = TRACE_OVERFLOW_DROP_OLDEST,
+    [OVERFLOW_SPILL]  = TRACE_OVERFLOW_SPILL,
+};
+
+
+/********************
+ * show_printf
+ ********************/
+static void __attribute__((format(printf, 2, 3)))
+show_printf(show_t *s, const char *format, ...)
+{
+    va_list ap;
+    char   *p;
+    size_t  room;
+    int     n;
+
+    if (s->len < s->size) {
+        p    = s->buf  + s->len;
+        room = s->size - s->len;
+    }
+    else {
+        p    = NULL;
+        room = 0;
+    }
+
+    va_start(ap, format);
+    n = vsnprintf(p, room, format, ap);
+    va_end(ap);
+
+    if (n > 0)
+        s->len += n;
+}
+
+
+/********************
+ * show_string
+ ********************/
+static void
+show_string(show_t *s, const char *str)
+{
+    const char *p;
+
+    /* a quoted and escaped JSON string */
+
+    show_printf(s, "\"");
+
+    for (p = str; *p; p++) {
+        if (*p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+            continue;
+        show_printf(s, "%.*s", (int)(p - str), str);
+        if (*p == '"' || *p == '\\')
+            show_printf(s, "\\%c", *p);
+        else
+            show_printf(s, "\\u%04x", (unsigned char)*p);
+        str = p + 1;
+    }
+
+    show_printf(s, "%s\"", str);
+}
+
+
+/********************
+ * show_mask
+ ********************/
+static void
+show_mask(show_t *s, bitmap_t *bits)
+{
+    int i;
+
+    /* the words in use as a single hexadecimal number */
+
+    show_printf(s, "\"0x");
+    for (i = bits->nword - 1; i >= 0; i--)
+        show_printf(s, "%0*lx", BITS_PER_LONG / 4, bits->w[i]);
+    show_printf(s, "\"");
+}
+
+
+/********************
+ * show_context
+ ********************/
+static void
+show_context(show_t *s, context_t *c)
+{
+    show_printf(s, "{\"context\":");
+    show_string(s, c->name);
+    show_printf(s, ",\"id\":%d,\"enabled\":%s,\"target\":", c->id,
+                c->disabled ? "false" : "true");
+    show_string(s, c->target ? c->target : "stderr");
+    show_printf(s, ",\"format\":");
+    show_string(s, c->format->source);
+    show_printf(s, ",\"mode\":\"%s\",\"clock\":\"%s\",\"flush\":",
+                mode_names[c->mode], clocks[c->clock].name);
+
+    switch (c->flush) {
+    case FLUSH_SIZE:
+        show_printf(s, "\"size=%d\"", c->out.size);
+        break;
+    case FLUSH_INTERVAL:
+        show_printf(s, "\"interval=%lluus\"",
+                    (unsigned long long)c->interval / 1000);
+        break;
+    case FLUSH_NEVER:
+        show_printf(s, "\"%s\"", TRACE_FLUSH_NEVER);
+        break;
+    default:
+        show_printf(s, "\"%s\"", TRACE_FLUSH_LINE);
+    }
+
+    show_printf(s, ",\"overflow\":\"%s\",\"dropped\":%llu",
+                overflow_names[c->async.policy],
+                (unsigned long long)c->async.dropped);
+    show_printf(s, ",\"filters\":%d", c->nfilter);
+    show_printf(s, ",\"memory\":%zu", c->arena.used);
+    show_printf(s, ",\"stats\":%s,\"mask\":", c->stats ? "true" : "false");
+    show_mask(s, &c->mask);
+    show_printf(s, ",\"record\":");
+    show_mask(s, &c->record);
+    show_printf(s, "}\n");
+}
+
+
+/********************
+ * show_flag
+ ********************/
+static void
+show_flag(show_t *s, context_t *c, module_t *m, flag_t *f, const char *format)
+{
+    trace_stats_t st;
+    int           state;
+
+    if (tst_bit(&c->mask, f->bit))
+        state = '+';
+    else if (tst_bit(&c->record, f->bit))
+        state = '~';
+    else
+        state = '-';
+
+    if (format == NULL || !strcmp(format, TRACE_SHOW_FLAGS)) {
+        show_printf(s, "%s.%s=%c%s", c->name, m->name, state, f->name);
+        if (f->sample)
+            show_printf(s, "%c%s1/%d", SAMPLESEP, f->random ? "~" : "",
+                        f->sample);
+        if (f->rate)
+            show_printf(s, "%c%d/s", RATESEP, f->rate);
+        show_printf(s, "\n");
+        return;
+    }
+
+    if (f->stats != NULL)
+        stats_sum(f, &st);
+
+    if (!strcmp(format, TRACE_SHOW_STATS)) {
+        if (f->stats != NULL)
+            show_printf(s, "%s.%s.%s emitted=%llu suppressed=%llu"
+                        " bytes=%llu format_ns=%llu\n",
+                        c->name, m->name, f->name,
+                        (unsigned long long)st.emitted,
+                        (unsigned long long)st.suppressed,
+                        (unsigned long long)st.bytes,
+                        (unsigned long long)st.format_ns);
+        return;
+    }
+
+    /* TRACE_SHOW_JSON */
+    show_printf(s, "{\"context\":");
+    show_string(s, c->name);
+    show_printf(s, ",\"module\":");
+    show_string(s, m->name);
+    show_printf(s, ",\"flag\":");
+    show_string(s, f->name);
+    show_printf(s, ",\"state\":\"%s\",\"bit\":%d,\"limit\":%d,"
+                "\"sample\":%d,\"random\":%s",
+                state == '+' ? "on" : (state == '~' ? "recorded" : "off"),
+                f->bit, f->rate, f->sample, f->random ? "true" : "false");
+    if (f->stats != NULL)
+        show_printf(s, ",\"emitted\":%llu,\"suppressed\":%llu,"
+                    "\"bytes\":%llu,\"format_ns\":%llu",
+                    (unsigned long long)st.emitted,
+                    (unsigned long long)st.suppressed,
+                    (unsigned long long)st.bytes,
+                    (unsigned long long)st.format_ns);
+    show_printf(s, "}\n");
 }
 
 
@@ -1682,33 +8693,56 @@ trace_show(char *context, char *buf, size_t bufsize, const char *format)
     context_t *c;
     module_t  *m;
     flag_t    *f;
-    int        nc, nm, nf, on;
-    
-    /* XXX FIXME temporarily just dump to stdout */
-    (void)context;
-    (void)buf;
-    (void)bufsize;
-    (void)format;
+    show_t     s;
+    int        nc, nm, nf, json;
 
-    for (nc = 0, c = contexts; nc < ncontext; nc++, c++) {
+    if (format != NULL && strcmp(format, TRACE_SHOW_FLAGS) &&
+        strcmp(format, TRACE_SHOW_STATS) && strcmp(format, TRACE_SHOW_JSON))
+        return -EINVAL;
+
+    json = format != NULL && !strcmp(format, TRACE_SHOW_JSON);
+
+    s.buf  = buf;
+    s.size = buf != NULL ? bufsize : 0;
+    s.len  = 0;
+
+    if (s.size > 0)
+        s.buf[0] = '\0';
+
+    REGISTRY_LOCK();
+
+    if (context != NULL && strcmp(context, WILDCARD)) {
+        if ((c = context_find(context, NULL)) == NULL) {
+            REGISTRY_UNLOCK();
+            return -ENOENT;
+        }
+        nc = 1;
+    }
+    else {
+        c  = contexts;
+        nc = ncontext;
+    }
+
+    for ( ; nc > 0; nc--, c++) {
         if (c->name == NULL)
             continue;
+
+        if (json)
+            show_context(&s, c);
         
         for (nm = 0, m = c->modules; nm < c->nmodule; nm++, m++) {
             if (m->name == NULL)
                 continue;
             
-            for (nf = 0, f = m->flags; nf < m->nflag; nf++, f++) {
-                if (f->name == NULL)
-                    continue;
-                
-                on = tst_bit(&c->mask, f->bit);
-                printf("%s.%s=%c%s\n", c->name, m->name, on ? '+':'-', f->name);
-            }
+            for (nf = 0, f = m->flags; nf < m->nflag; nf++, f++)
+                if (f->name != NULL)
+                    show_flag(&s, c, m, f, format);
         }
     }
 
-    return 0;
+    REGISTRY_UNLOCK();
+
+    return s.len > INT_MAX ? -EOVERFLOW : (int)s.len;
 }
 
 
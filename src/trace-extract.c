@@ -0,0 +1,158 @@
+/*************************************************************************
+This file is part of libtrace
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+/*
+ * trace-extract: dump the messages of a memory-mapped circular trace
+ * file (see trace-mmap.h) in the order they were written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace-mmap.h"
+
+#define fatal(ec, fmt, args...) do {                            \
+        fprintf(stderr, "[ERROR] "fmt"\n", ## args);            \
+        fflush(stderr);                                         \
+        exit(ec);                                               \
+    } while (0)
+
+
+/********************
+ * dump
+ ********************/
+static void
+dump(const char *data, size_t size)
+{
+    size_t n;
+
+    while (size > 0) {
+        if ((n = fwrite(data, 1, size, stdout)) == 0)
+            fatal(1, "failed to write output (%d: %s)", errno,
+                  strerror(errno));
+        data += n;
+        size -= n;
+    }
+}
+
+
+/********************
+ * usage
+ ********************/
+static void
+usage(const char *argv0, int exit_code)
+{
+    printf("usage: %s [-r] file\n", argv0);
+    printf("  -r  also dump the partially overwritten oldest message\n");
+    exit(exit_code);
+}
+
+
+int main(int argc, char *argv[])
+{
+    trace_mmap_hdr_t *hdr;
+    struct stat       st;
+    const char       *path, *data, *nl;
+    uint64_t          head, size, off;
+    void             *ptr;
+    int               fd, raw, opt;
+
+    raw = 0;
+    while ((opt = getopt(argc, argv, "rh")) != -1) {
+        switch (opt) {
+        case 'r': raw = 1;                break;
+        case 'h': usage(argv[0], 0);      break;
+        default:  usage(argv[0], 1);      break;
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0], 1);
+    path = argv[optind];
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        fatal(1, "failed to open %s (%d: %s)", path, errno, strerror(errno));
+
+    if ((size_t)st.st_size < sizeof(*hdr))
+        fatal(1, "%s is not a trace file", path);
+
+    ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        fatal(1, "failed to map %s (%d: %s)", path, errno, strerror(errno));
+    close(fd);
+
+    hdr = (trace_mmap_hdr_t *)ptr;
+
+    if (strncmp(hdr->magic, TRACE_MMAP_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != TRACE_MMAP_VERSION)
+        fatal(1, "%s is not a trace file", path);
+
+    size = hdr->size;
+    head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    data = (const char *)ptr + hdr->hdrsize;
+
+    if ((uint64_t)st.st_size < hdr->hdrsize + size)
+        fatal(1, "%s is truncated", path);
+
+    if (head <= size)                        /* not wrapped around yet */
+        dump(data, head);
+    else {
+        off = head % size;
+
+        if (!raw) {                          /* skip the clobbered message */
+            nl = memchr(data + off, '\n', size - off);
+            if (nl != NULL)
+                off = nl + 1 - data;
+            else {
+                nl = memchr(data, '\n', off);
+                if (nl == NULL)
+                    return 0;
+                dump(nl + 1, data + head % size - (nl + 1));
+                return 0;
+            }
+        }
+
+        dump(data + off, size - off);
+        dump(data, head % size);
+    }
+
+    munmap(ptr, st.st_size);
+
+    return 0;
+}
+
+
+
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:set expandtab shiftwidth=4:
+ */
@@ -0,0 +1,51 @@
+/*************************************************************************
+This file is part of libtrace
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+#ifndef __TRACE_MMAP_H__
+#define __TRACE_MMAP_H__
+
+#include <stdint.h>
+
+/*
+ * Layout of memory-mapped circular trace files.
+ *
+ * The file starts with a header of TRACE_MMAP_HDRSIZE bytes, followed
+ * by a data area of size bytes used as a circular buffer of formatted
+ * messages. head counts all bytes ever written, so the oldest byte still
+ * in the file is at head - size (if head > size) and the next write goes
+ * to head % size. Writers reserve room by atomically advancing head.
+ */
+
+#define TRACE_MMAP_MAGIC    "TRCMMAP"        /* with terminating '\0' */
+#define TRACE_MMAP_VERSION  1
+#define TRACE_MMAP_HDRSIZE  4096             /* data starts at this offset */
+
+typedef struct {
+    char      magic[8];                      /* TRACE_MMAP_MAGIC */
+    uint32_t  version;                       /* TRACE_MMAP_VERSION */
+    uint32_t  hdrsize;                       /* offset of data area */
+    uint64_t  size;                          /* size of data area */
+    uint64_t  head __attribute__((aligned(64)));   /* bytes written */
+} trace_mmap_hdr_t;
+
+
+#endif /* __TRACE_MMAP_H__ */
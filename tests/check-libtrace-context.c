@@ -21,6 +21,8 @@ USA.
 
 
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <check.h>
 
 #include <simple-trace/simple-trace.h>
@@ -84,6 +86,53 @@ START_TEST(multiple_close)
 END_TEST
 
 
+START_TEST(show)
+{
+#define SHOW_FLAGS "show.module=+foo\nshow.module=~bar\nshow.module=-foobar\n"
+    int  DBG_FOO, DBG_BAR, DBG_FOOBAR;
+    char buf[1024], *p;
+    int  cid, n, lines;
+
+    TRACE_DECLARE_MODULE(test, "module",
+        TRACE_FLAG("foo"   , "flag foo"   , &DBG_FOO),
+        TRACE_FLAG("bar"   , "flag bar"   , &DBG_BAR),
+        TRACE_FLAG("foobar", "flag foobar", &DBG_FOOBAR));
+
+    fail_unless((cid = trace_context_open("show")) >= 0);
+    fail_unless(trace_add_module(cid, &test) == 0);
+    fail_unless(trace_flag_set(DBG_FOO) == 0);
+    fail_unless(trace_flag_record(DBG_BAR) == 0);
+
+    /* flags are shown as configuration commands, only of the given context */
+    n = trace_show("show", NULL, 0, NULL);
+    fail_unless(n == (int)strlen(SHOW_FLAGS));
+    fail_unless(trace_show("show", buf, sizeof(buf), TRACE_SHOW_FLAGS) == n);
+    fail_unless(!strcmp(buf, SHOW_FLAGS));
+
+    /* a short buffer is filled and terminated, the full size is returned */
+    fail_unless(trace_show("show", buf, 8, NULL) == n);
+    fail_unless(strlen(buf) == 7 && !strncmp(buf, SHOW_FLAGS, 7));
+
+    fail_unless(trace_show("nonexistent", buf, sizeof(buf), NULL) == -ENOENT);
+    fail_unless(trace_show("show", buf, sizeof(buf), "bogus") == -EINVAL);
+
+    /* one JSON line for the context and one for each of its flags */
+    fail_unless(trace_context_format(cid, "\"%M\"") == 0);
+    n = trace_show("show", buf, sizeof(buf), TRACE_SHOW_JSON);
+    fail_unless(n > 0 && n == (int)strlen(buf));
+    for (lines = 0, p = buf; (p = strchr(p, '\n')) != NULL; p++)
+        lines++;
+    fail_unless(lines == 4);
+    fail_unless(!strncmp(buf, "{\"context\":\"show\",", 18));
+    fail_unless(strstr(buf, "\"format\":\"\\\"%M\\\"\"") != NULL);
+    fail_unless(strstr(buf, "\"mode\":\"direct\"") != NULL);
+    fail_unless(strstr(buf, "\"flag\":\"bar\",\"state\":\"recorded\"") != NULL);
+
+    fail_unless(trace_context_close(cid) == 0);
+}
+END_TEST
+
+
 void
 chktrace_context_tests(Suite *suite)
 {
@@ -95,6 +144,7 @@ chktrace_context_tests(Suite *suite)
     tcase_add_test(tc, spurious_close);
     tcase_add_test(tc, normal_open_close);
     tcase_add_test(tc, multiple_close);
+    tcase_add_test(tc, show);
     suite_add_tcase(suite, tc);
 }
 
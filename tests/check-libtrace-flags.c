@@ -22,6 +22,7 @@ USA.
 
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <errno.h>
 #include <check.h>
 
@@ -126,6 +127,322 @@ START_TEST(enabled_flag)
 END_TEST
 
 
+static int nevaluated;
+
+static int
+count_evaluation(void)
+{
+    return ++nevaluated;
+}
+
+
+START_TEST(skipped_arguments)
+{
+    int  fd_err, fd_pipe[2], fd_save;
+    char buf[1024];
+
+    fail_unless(trace_context_enable(cid) == 0);
+    fail_unless(trace_flag_set(DBG_FOO) == 0);
+
+    fd_err = fileno(stderr);
+    fail_unless(capture_fd(fd_err, fd_pipe, &fd_save) == 0);
+
+    nevaluated = 0;
+    fail_unless(trace_printf(DBG_BAR, "bar %d", count_evaluation()) == 0);
+    fail_unless(nevaluated == 0);
+    fail_unless(trace_printf(DBG_FOO, "foo %d", count_evaluation()) > 0);
+    fail_unless(nevaluated == 1);
+    fail_unless(read(fd_pipe[0], buf, sizeof(buf)) > 0);
+
+    fail_unless(trace_context_disable(cid) == 0);
+    fail_unless(trace_printf(DBG_FOO, "foo %d", count_evaluation()) == 0);
+    fail_unless(nevaluated == 1);
+    fail_unless(read(fd_pipe[0], buf, sizeof(buf)) < 0 && errno == EAGAIN);
+
+    fail_unless(trace_context_enable(cid) == 0);
+    fail_unless(trace_flag_clr(DBG_FOO) == 0);
+    fail_unless(trace_printf(DBG_FOO, "foo %d", count_evaluation()) == 0);
+    fail_unless(nevaluated == 1);
+
+    fail_unless(release_fd(fd_err, fd_pipe, fd_save) == 0);
+}
+END_TEST
+
+
+START_TEST(word_boundaries)
+{
+#define WORD_FLAGS 130
+    static int       ids[WORD_FLAGS];
+    static char      names[WORD_FLAGS][16];
+    trace_flagdef_t  flags[WORD_FLAGS + 1];
+    trace_moduledef_t words = { "words", flags, WORD_FLAGS + 1 };
+    int              i;
+
+    /* with the 3 flags of the test module these span three words */
+    for (i = 0; i < WORD_FLAGS; i++) {
+        snprintf(names[i], sizeof(names[i]), "flag%d", i);
+        flags[i].name    = names[i];
+        flags[i].descr   = "word boundary flag";
+        flags[i].flagptr = ids + i;
+    }
+    memset(flags + WORD_FLAGS, 0, sizeof(flags[0]));
+    fail_unless(trace_add_module(cid, &words) == 0);
+    fail_unless(trace_context_enable(cid) == 0);
+
+    fail_unless(trace_configure(CONTEXT_NAME".words=+all") == 0);
+    for (i = 0; i < WORD_FLAGS; i++)
+        fail_unless(trace_flag_tst(ids[i]) == 1 && __trace_enabled(ids[i]));
+    fail_unless(trace_flag_tst(DBG_FOO) == 0 && !__trace_enabled(DBG_FOO));
+
+    fail_unless(trace_configure(CONTEXT_NAME".*=-all") == 0);
+    for (i = 0; i < WORD_FLAGS; i++)
+        fail_unless(trace_flag_tst(ids[i]) == 0 && !__trace_enabled(ids[i]));
+
+    for (i = 0; i < WORD_FLAGS; i += 3)
+        fail_unless(trace_flag_set(ids[i]) == 0);
+    for (i = 0; i < WORD_FLAGS; i++) {
+        fail_unless(trace_flag_tst(ids[i]) == (i % 3 == 0));
+        fail_unless(__trace_enabled(ids[i]) == (i % 3 == 0));
+    }
+
+    /* recorded flags pass the inline check but are not on */
+    fail_unless(trace_configure(CONTEXT_NAME".words=~all") == 0);
+    fail_unless(trace_configure(CONTEXT_NAME".test=+foo") == 0);
+    for (i = 0; i < WORD_FLAGS; i++)
+        fail_unless(trace_flag_tst(ids[i]) == 0 && __trace_enabled(ids[i]));
+    fail_unless(trace_flag_tst(DBG_FOO) == 1);
+
+    /* deleting the module turns all of its flags off */
+    fail_unless(trace_del_module(cid, "words") == 0);
+    for (i = 0; i < WORD_FLAGS; i++)
+        fail_unless(!__trace_enabled(ids[i]));
+    fail_unless(trace_flag_tst(DBG_FOO) == 1);
+}
+END_TEST
+
+
+#define RUN_FLAGS 200
+
+static trace_flag64_t    run_ids[5][RUN_FLAGS];
+static char              run_names[256][16];
+static trace_flagdef64_t run_flags[5][RUN_FLAGS + 1];
+
+static trace_moduledef64_t *
+run_module(int m, const char *name, int nflag)
+{
+    static trace_moduledef64_t mods[5];
+    int                        i;
+
+    for (i = 0; i < nflag; i++) {
+        snprintf(run_names[i], sizeof(run_names[i]), "flag%d", i);
+        run_flags[m][i].name    = run_names[i];
+        run_flags[m][i].descr   = "run flag";
+        run_flags[m][i].flagptr = run_ids[m] + i;
+    }
+    memset(run_flags[m] + nflag, 0, sizeof(run_flags[m][0]));
+
+    mods[m].name  = (char *)name;
+    mods[m].flags = run_flags[m];
+    mods[m].nflag = nflag + 1;
+
+    return mods + m;
+}
+
+
+/* the flag bit is in the lowest 16 bits of a 64-bit flag id */
+#define RUN_BIT(m, i) ((int)(run_ids[m][i] & 0xffff))
+
+static int
+is_run(int m, int nflag)
+{
+    int i;
+
+    for (i = 1; i < nflag; i++)
+        if (RUN_BIT(m, i) != RUN_BIT(m, 0) + i)
+            return FALSE;
+
+    return TRUE;
+}
+
+
+START_TEST(contiguous_runs)
+{
+#define SCATTER_FLAGS 220
+    static int        scatter_ids[SCATTER_FLAGS];
+    trace_flagdef_t   scatter_flags[SCATTER_FLAGS + 1];
+    trace_moduledef_t scatter = { "scatter", scatter_flags, SCATTER_FLAGS + 1 };
+    int               i;
+
+    /* a large module gets a single run of bits across several words */
+    fail_unless(trace_add_module64(cid, run_module(0, "big", RUN_FLAGS)) == 0);
+    fail_unless(is_run(0, RUN_FLAGS));
+    fail_unless(trace_del_module(cid, "big") == 0);
+
+    /* a hole too small for a module is skipped, then reused */
+    fail_unless(trace_add_module64(cid, run_module(1, "b", 10)) == 0);
+    fail_unless(trace_add_module64(cid, run_module(2, "c", 10)) == 0);
+    fail_unless(trace_del_module(cid, "b") == 0);
+    fail_unless(trace_add_module64(cid, run_module(3, "d", 20)) == 0);
+    fail_unless(is_run(3, 20) && RUN_BIT(3, 0) > RUN_BIT(2, 9));
+    fail_unless(trace_add_module64(cid, run_module(4, "e", 5)) == 0);
+    fail_unless(is_run(4, 5) && RUN_BIT(4, 4) < RUN_BIT(2, 0));
+
+    /* int flag ids need bits below 256, there is no run of 220 left */
+    fail_unless(trace_del_module(cid, "c") == 0);
+    for (i = 0; i < SCATTER_FLAGS; i++) {
+        snprintf(run_names[i], sizeof(run_names[i]), "flag%d", i);
+        scatter_flags[i].name    = run_names[i];
+        scatter_flags[i].descr   = "scattered flag";
+        scatter_flags[i].flagptr = scatter_ids + i;
+    }
+    memset(scatter_flags + SCATTER_FLAGS, 0, sizeof(scatter_flags[0]));
+    fail_unless(trace_add_module(cid, &scatter) == 0);
+    for (i = 1; i < SCATTER_FLAGS; i++)
+        if ((scatter_ids[i] & 0xff) != (scatter_ids[0] & 0xff) + i)
+            break;
+    fail_unless(i < SCATTER_FLAGS);
+    for (i = 0; i < SCATTER_FLAGS; i++)
+        fail_unless(trace_flag_set(scatter_ids[i]) == 0 &&
+                    trace_flag_tst(scatter_ids[i]) == 1);
+    fail_unless(trace_flag_tst64(run_ids[3][0]) == 0);
+    fail_unless(trace_flag_tst64(run_ids[4][0]) == 0);
+    fail_unless(trace_del_module(cid, "scatter") == 0);
+
+    fail_unless(trace_del_module(cid, "d") == 0);
+    fail_unless(trace_del_module(cid, "e") == 0);
+}
+END_TEST
+
+
+START_TEST(flag_lookup)
+{
+#define LOOKUP_MODULES 100
+    static char       names[LOOKUP_MODULES][16];
+    static int        ids[LOOKUP_MODULES];
+    trace_flagdef_t   flags[LOOKUP_MODULES][2];
+    trace_moduledef_t mods[LOOKUP_MODULES];
+    char              name[64];
+    int               i;
+
+    fail_unless(trace_flag_lookup(CONTEXT_NAME".test.foo") == DBG_FOO);
+    fail_unless(trace_flag_lookup(CONTEXT_NAME".test.bar") == DBG_BAR);
+    fail_unless(trace_flag_lookup(CONTEXT_NAME".test.foobar") == DBG_FOOBAR);
+
+    fail_unless(trace_flag_lookup(NULL) == -EINVAL);
+    fail_unless(trace_flag_lookup("test") == -EINVAL);
+    fail_unless(trace_flag_lookup("test.foo") == -EINVAL);
+    fail_unless(trace_flag_lookup("nope.test.foo") == -ENOENT);
+    fail_unless(trace_flag_lookup(CONTEXT_NAME".tes.foo") == -ENOENT);
+    fail_unless(trace_flag_lookup(CONTEXT_NAME".test.fo") == -ENOENT);
+    fail_unless(trace_flag_lookup(CONTEXT_NAME".test.foob") == -ENOENT);
+
+    /* enough modules to grow the index, then remove and re-add some */
+    for (i = 0; i < LOOKUP_MODULES; i++) {
+        snprintf(names[i], sizeof(names[i]), "mod%d", i);
+        flags[i][0].name    = "flag";
+        flags[i][0].descr   = "lookup flag";
+        flags[i][0].flagptr = ids + i;
+        memset(&flags[i][1], 0, sizeof(flags[i][1]));
+        mods[i].name  = names[i];
+        mods[i].flags = flags[i];
+        mods[i].nflag = 2;
+        fail_unless(trace_add_module(cid, mods + i) == 0);
+    }
+    for (i = 0; i < LOOKUP_MODULES; i += 2)
+        fail_unless(trace_del_module(cid, names[i]) == 0);
+    for (i = 0; i < LOOKUP_MODULES; i += 4)
+        fail_unless(trace_add_module(cid, mods + i) == 0);
+
+    for (i = 0; i < LOOKUP_MODULES; i++) {
+        snprintf(name, sizeof(name), CONTEXT_NAME".%s.flag", names[i]);
+        if (i % 4 == 2)
+            fail_unless(trace_flag_lookup(name) == -ENOENT);
+        else
+            fail_unless(trace_flag_lookup(name) == ids[i]);
+    }
+
+    for (i = 0; i < LOOKUP_MODULES; i++)
+        if (i % 4 != 2)
+            fail_unless(trace_del_module(cid, names[i]) == 0);
+}
+END_TEST
+
+
+START_TEST(wide_flags)
+{
+#define WIDE_FLAGS    300
+#define WIDE_CONTEXTS 200
+    static trace_flag64_t ids[WIDE_FLAGS], id;
+    static char           names[WIDE_FLAGS][16];
+    trace_flagdef64_t     flags[WIDE_FLAGS + 1];
+    trace_moduledef64_t   wide = { "wide", flags, WIDE_FLAGS + 1 };
+    int                   cids[WIDE_CONTEXTS];
+    int                   fd_err, fd_pipe[2], fd_save, i, id32;
+    char                  buf[1024], name[64];
+
+    for (i = 0; i < WIDE_FLAGS; i++) {
+        snprintf(names[i], sizeof(names[i]), "flag%d", i);
+        flags[i].name    = names[i];
+        flags[i].descr   = "wide flag";
+        flags[i].flagptr = ids + i;
+    }
+    memset(flags + WIDE_FLAGS, 0, sizeof(flags[0]));
+
+    /* more flags than an int id can address */
+    fail_unless(trace_add_module64(cid, &wide) == 0);
+    for (i = 0; i < WIDE_FLAGS; i++) {
+        snprintf(name, sizeof(name), CONTEXT_NAME".wide.%s", names[i]);
+        fail_unless(trace_flag_lookup64(name, &id) == 0 && id == ids[i]);
+        id32 = trace_flag_lookup(name);
+        if (i >= 256)
+            fail_unless(id32 == -EOVERFLOW);
+        else if (id32 >= 0)
+            fail_unless(trace_flag_tst(id32) == 0);
+        else
+            fail_unless(id32 == -EOVERFLOW);
+    }
+
+    fail_unless(trace_context_enable(cid) == 0);
+    fail_unless(trace_flag_set64(ids[WIDE_FLAGS - 1]) == 0);
+    fail_unless(trace_flag_tst64(ids[WIDE_FLAGS - 1]) == 1);
+    fail_unless(trace_flag_tst64(ids[WIDE_FLAGS - 2]) == 0);
+    fail_unless(trace_flag_tst(DBG_FOO) == 0);
+
+    fd_err = fileno(stderr);
+    fail_unless(capture_fd(fd_err, fd_pipe, &fd_save) == 0);
+    fail_unless(trace_printf64(ids[WIDE_FLAGS - 1], "wide") > 0);
+    fail_unless(read(fd_pipe[0], buf, sizeof(buf)) > 0);
+    fail_unless(trace_printf64(ids[WIDE_FLAGS - 2], "wide") == 0);
+    fail_unless(read(fd_pipe[0], buf, sizeof(buf)) < 0 && errno == EAGAIN);
+    fail_unless(release_fd(fd_err, fd_pipe, fd_save) == 0);
+
+    fail_unless(trace_flag_clr64(ids[WIDE_FLAGS - 1]) == 0);
+    fail_unless(trace_flag_tst64(ids[WIDE_FLAGS - 1]) == 0);
+    fail_unless(trace_del_module(cid, "wide") == 0);
+    fail_unless(trace_flag_set64(ids[0]) == -ENOENT);
+
+    /* more contexts than an int id can address */
+    for (i = 0; i < WIDE_CONTEXTS; i++) {
+        snprintf(name, sizeof(name), "wide%d", i);
+        fail_unless((cids[i] = trace_context_open(name)) > 0);
+    }
+    fail_unless(cids[WIDE_CONTEXTS - 1] >= 127);
+    fail_unless(trace_add_module(cids[WIDE_CONTEXTS - 1], &flagtest) ==
+                -EOVERFLOW);
+    fail_unless(trace_add_module64(cids[WIDE_CONTEXTS - 1], &wide) == 0);
+    fail_unless(trace_context_enable(cids[WIDE_CONTEXTS - 1]) == 0);
+    fail_unless(trace_flag_set64(ids[1]) == 0);
+    fail_unless(trace_flag_tst64(ids[1]) == 1);
+    fail_unless(__trace_enabled64(ids[1]));
+    fail_unless(!__trace_enabled64(ids[2]));
+
+    for (i = 0; i < WIDE_CONTEXTS; i++)
+        fail_unless(trace_context_close(cids[i]) == 0);
+    fail_unless(!__trace_enabled64(ids[1]));
+}
+END_TEST
+
+
 void
 chktrace_flag_tests(Suite *suite)
 {
@@ -137,6 +454,11 @@ chktrace_flag_tests(Suite *suite)
     tcase_add_test(tc, disabled_context);
     tcase_add_test(tc, disabled_flag);
     tcase_add_test(tc, enabled_flag);
+    tcase_add_test(tc, skipped_arguments);
+    tcase_add_test(tc, word_boundaries);
+    tcase_add_test(tc, contiguous_runs);
+    tcase_add_test(tc, flag_lookup);
+    tcase_add_test(tc, wide_flags);
     suite_add_tcase(suite, tc);
 }
 
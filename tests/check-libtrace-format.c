@@ -220,6 +220,42 @@ START_TEST(delta_stamp)
 END_TEST
 
 
+START_TEST(clock_stamp)
+{
+    static const char *clocks[] = {
+        TRACE_CLOCK_MONOTONIC, TRACE_CLOCK_MONOTONIC_RAW,
+        TRACE_CLOCK_REALTIME , TRACE_CLOCK_TSC          ,
+        NULL
+    };
+    unsigned long long sec, nsec, prev, now;
+    char               msg[256];
+    int                c, i, err;
+    
+    fail_unless(trace_context_format(cid, "[%N] %M") == 0);
+    fail_unless(trace_context_clock(cid, "sundial") == -EINVAL);
+
+    for (c = 0; clocks[c] != NULL; c++) {
+        err = trace_context_clock(cid, clocks[c]);
+        if (err == -ENOTSUP && !strcmp(clocks[c], TRACE_CLOCK_TSC))
+            continue;
+        fail_unless(err == 0);
+
+        for (i = 0, prev = 0; i < 3; i++) {
+            fail_unless(trace_printf(DBG_TEST, "%s", TEST_MESSAGE) > 0);
+            fail_unless(fscanf(stdtrc, "[%llu.%llu] %[a-zA-Z. ]\n",
+                               &sec, &nsec, msg) == 3);
+            fail_unless(!strcmp(msg, TEST_MESSAGE));
+            fail_unless(nsec < 1000000000ULL);
+
+            now = sec * 1000000000ULL + nsec;
+            fail_unless(now >= prev);
+            prev = now;
+        }
+    }
+}
+END_TEST
+
+
 START_TEST(message)
 {
     char msg[256];
@@ -251,6 +287,177 @@ START_TEST(and_one_more)
 END_TEST
 
 
+START_TEST(tags)
+{
+    TRACE_DECLARE_TAGS(tags, 4, 32);
+    char msg[256];
+
+    fail_unless(trace_tag_add(&tags, "user", "alice") == 0);
+    fail_unless(trace_tag_addf(&tags, "id", "%d", 42) == 0);
+    fail_unless(trace_tag_add(&tags, NULL, "foo") == -EINVAL);
+
+    fail_unless(trace_context_format(cid, "[%T] %M") == 0);
+    fail_unless(trace_write_tags(DBG_TEST, &tags, "%s", TEST_MESSAGE) > 0);
+    fail_unless(trace_printf(DBG_TEST, "%s", TEST_MESSAGE) > 0);
+
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, "[user=alice id=42] "TEST_MESSAGE"\n"));
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, "[] "TEST_MESSAGE"\n"));
+}
+END_TEST
+
+
+START_TEST(gathered)
+{
+#define GATHER_LITERAL "is a literal long enough to be passed by reference"
+
+    char exp[512], msg[512], *p;
+    int  n, i, line;
+
+    /*
+     * Pieces of at least FMT_MINREF (32) bytes are gathered into a writev
+     * by reference, shorter ones are merged into a single copy, and formats
+     * with too many pieces are copied as a whole.
+     */
+
+    fail_unless(trace_context_format(cid, "%c " GATHER_LITERAL " %f: %M")
+                == 0);
+    n = trace_printf(DBG_TEST, "%s", TEST_MESSAGE);
+    snprintf(exp, sizeof(exp), "%s " GATHER_LITERAL " %s: %s\n",
+             TEST_CONTEXT, TEST_FLAG, TEST_MESSAGE);
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, exp));
+    fail_unless(n == (int)strlen(exp));
+
+    fail_unless(trace_context_format(cid, "%c.%m.%f %C:%L %M") == 0);
+    n = trace_printf(DBG_TEST, "%s", TEST_MESSAGE); line = __LINE__;
+    snprintf(exp, sizeof(exp), "%s.%s.%s %s:%d %s\n", TEST_CONTEXT,
+             TEST_MODULE, TEST_FLAG, __FUNCTION__, line, TEST_MESSAGE);
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, exp));
+    fail_unless(n == (int)strlen(exp));
+
+    fail_unless(trace_context_format(cid, "%c.%m.%f %c.%m.%f %c.%m.%f "
+                                     "%c.%m.%f %c.%m.%f %c.%m.%f %M") == 0);
+    n = trace_printf(DBG_TEST, "%s", TEST_MESSAGE);
+    for (i = 0, p = exp; i < 6; i++)
+        p += sprintf(p, "%s.%s.%s ", TEST_CONTEXT, TEST_MODULE, TEST_FLAG);
+    sprintf(p, "%s\n", TEST_MESSAGE);
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, exp));
+    fail_unless(n == (int)strlen(exp));
+}
+END_TEST
+
+
+START_TEST(long_messages)
+{
+    static const char *formats[] = {
+        "%c: %M",                                  /* gathered */
+        "%c %m %f %c %m %f %c %m %f %c %m %f: %M", /* copied */
+        NULL
+    };
+    static char msg[256 * 1024], big[128 * 1024], exp[256 * 1024];
+    int         sizes[] = { 1000, 10000, 100000, 0 };
+    int         f, i, n;
+
+    /* messages of any length are written out in full */
+
+    fail_unless(fcntl(fd_out, F_SETPIPE_SZ, sizeof(msg)) >= 0);
+
+    for (f = 0; formats[f] != NULL; f++) {
+        fail_unless(trace_context_format(cid, formats[f]) == 0);
+
+        for (i = 0; sizes[i] != 0; i++) {
+            memset(big, 'a' + i, sizes[i]);
+            big[sizes[i]] = '\0';
+
+            if (f == 0)
+                snprintf(exp, sizeof(exp), "%s: %s\n", TEST_CONTEXT, big);
+            else
+                snprintf(exp, sizeof(exp), "%s %s %s %s %s %s %s %s %s "
+                         "%s %s %s: %s\n",
+                         TEST_CONTEXT, TEST_MODULE, TEST_FLAG,
+                         TEST_CONTEXT, TEST_MODULE, TEST_FLAG,
+                         TEST_CONTEXT, TEST_MODULE, TEST_FLAG,
+                         TEST_CONTEXT, TEST_MODULE, TEST_FLAG, big);
+
+            n = trace_printf(DBG_TEST, "%s", big);
+            fail_unless(n == (int)strlen(exp));
+            fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+            fail_unless(!strcmp(msg, exp));
+        }
+    }
+}
+END_TEST
+
+
+START_TEST(tag_filters)
+{
+    TRACE_DECLARE_TAGS(alice, 2, 0);
+    TRACE_DECLARE_TAGS(bob, 2, 0);
+    TRACE_DECLARE_TAGS(filter, 2, 0);
+    TRACE_DECLARE_TAGS(regexp, 1, 0);
+    TRACE_DECLARE_TAGS(invalid, 1, 0);
+    char msg[256], buf[1024];
+
+    trace_tag_add(&alice, "user", "alice");
+    trace_tag_add(&alice, "id", "42");
+    trace_tag_add(&bob, "user", "bob");
+    trace_tag_add(&bob, "id", "7");
+
+    fail_unless(trace_context_format(cid, "%T: %M") == 0);
+
+    /* user=alice, id=* */
+    trace_tag_add(&filter, "id", TRACE_FILTER_ANY);
+    trace_tag_add(&filter, "user", "alice");
+    fail_unless(trace_add_simple_filter(cid, &filter) == 0);
+
+    trace_write_tags(DBG_TEST, &bob, "dropped");
+    trace_write_tags(DBG_TEST, &alice, "written");
+    trace_printf(DBG_TEST, "untagged");              /* never filtered */
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, "user=alice id=42: written\n"));
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, ": untagged\n"));
+
+    /* id=^[0-9]$ also lets bob through */
+    trace_tag_add(&regexp, "id", "^[0-9]$");
+    fail_unless(trace_add_regexp_filter(cid, &regexp) == 0);
+    trace_write_tags(DBG_TEST, &bob, "written");
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, "user=bob id=7: written\n"));
+
+    /* filters are deleted regardless of the order of their tags */
+    fail_unless(trace_del_simple_filter(cid, &regexp) == -ENOENT);
+    fail_unless(trace_configure("* filter del user=alice id=*;")
+                == 0);
+    fail_unless(trace_del_regexp_filter(cid, &regexp) == 0);
+    fail_unless(trace_configure("* filter add user=bob;") == 0);
+    fail_unless(trace_show(TEST_CONTEXT, buf, sizeof(buf),
+                           TRACE_SHOW_JSON) > 0);
+    fail_unless(strstr(buf, "\"filters\":1") != NULL);
+
+    trace_write_tags(DBG_TEST, &alice, "dropped");
+    trace_write_tags(DBG_TEST, &bob, "written");
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, "user=bob id=7: written\n"));
+
+    fail_unless(trace_configure("* filter reset;") == 0);
+    trace_write_tags(DBG_TEST, &alice, "written");
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, "user=alice id=42: written\n"));
+
+    trace_tag_add(&invalid, "us=er", "alice");
+    fail_unless(trace_add_simple_filter(cid, &invalid) == -EINVAL);
+    invalid.ntag = 0;
+    trace_tag_add(&invalid, "user", "(");
+    fail_unless(trace_add_regexp_filter(cid, &invalid) == -EINVAL);
+}
+END_TEST
+
+
 void
 chktrace_format_tests(Suite *suite)
 {
@@ -268,8 +475,13 @@ chktrace_format_tests(Suite *suite)
     tcase_add_test(tc, line);
     tcase_add_test(tc, abs_stamp);
     tcase_add_test(tc, delta_stamp);
+    tcase_add_test(tc, clock_stamp);
     tcase_add_test(tc, message);
     tcase_add_test(tc, and_one_more);
+    tcase_add_test(tc, tags);
+    tcase_add_test(tc, tag_filters);
+    tcase_add_test(tc, gathered);
+    tcase_add_test(tc, long_messages);
 
     suite_add_tcase(suite, tc);
 }
@@ -0,0 +1,246 @@
+/*************************************************************************
+This file is part of libtrace
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+
+/*
+ * trace points in this file are compiled as patchable jump labels
+ */
+#define TRACE_JUMP_LABEL
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <check.h>
+
+
+#include <simple-trace/simple-trace.h>
+#include "check-libtrace.h"
+
+#define TEST_CONTEXT "jumptest"
+#define TEST_MODULE  "test-module"
+#define TEST_FLAG    "test-flag"
+#define TEST_MESSAGE "The quick brown fox jumps over the lazy dog."
+
+static int            cid;
+static int            DBG_TEST;
+static trace_flag64_t DBG_TEST64;
+
+TRACE_DECLARE_MODULE(jumptest, TEST_MODULE,
+                     TRACE_FLAG(TEST_FLAG, "flag foo", &DBG_TEST));
+TRACE_DECLARE_MODULE64(jumptest64, TEST_MODULE"64",
+                       TRACE_FLAG(TEST_FLAG, "flag foo", &DBG_TEST64));
+
+static int   fd_out, fd_pipe[2], fd_save;
+static FILE *stdtrc;
+static int   patchable;
+
+static trace_jump_t *site_of(const void *id);
+
+
+static void
+setup(void)
+{
+    fail_unless(trace_init() == 0);
+    fail_unless((cid = trace_context_open(TEST_CONTEXT)) >= 0);
+    fail_unless(trace_add_module(cid, &jumptest) == 0);
+    fail_unless(trace_add_module64(cid, &jumptest64) == 0);
+
+    fail_unless(trace_context_enable(cid) == 0);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+
+#ifdef TRACE_HAVE_JUMP_LABEL
+    /* the flags are off, so a patchable site has been turned into a NOP */
+    patchable = !site_of(&DBG_TEST)->enabled;
+#endif
+
+    fd_out = fileno(stderr);
+    fail_unless(capture_fd(fd_out, fd_pipe, &fd_save) == 0);
+    fail_unless((stdtrc = fdopen(fd_pipe[0], "r")) != NULL);
+}
+
+
+static void
+teardown(void)
+{
+    fail_unless(release_fd(fd_out, fd_pipe, fd_save) == 0);
+    fail_unless(trace_del_module(cid, jumptest.name) == 0);
+    fail_unless(trace_del_module(cid, jumptest64.name) == 0);
+    fail_unless(trace_context_close(cid) == 0);
+}
+
+
+static int __attribute__((noinline))
+emit(void)
+{
+    return trace_write(DBG_TEST, "%s", TEST_MESSAGE);
+}
+
+
+static int __attribute__((noinline))
+emit64(void)
+{
+    return trace_write64(DBG_TEST64, "%s", TEST_MESSAGE);
+}
+
+
+static trace_jump_t *
+site_of(const void *id)
+{
+#ifdef TRACE_HAVE_JUMP_LABEL
+    trace_jump_t *j;
+
+    for (j = __start___trace_jump; j < __stop___trace_jump; j++)
+        if (j->key->id == id)
+            return j;
+#endif
+
+    (void)id;
+    return NULL;
+}
+
+
+static int
+site_is(trace_jump_t *j, int enabled)
+{
+    /* without jump labels there is no site to check */
+    if (j == NULL)
+        return TRUE;
+
+    /* without membarrier sync-core sites are never patched, stay jumps */
+    if (!patchable)
+        return j->enabled && *(unsigned char *)j->code == 0xe9;
+
+    return j->enabled == (unsigned long)enabled &&
+        *(unsigned char *)j->code == (enabled ? 0xe9 : 0x0f);
+}
+
+
+START_TEST(sites)
+{
+    trace_jump_t *j = site_of(&DBG_TEST);
+    char          msg[256];
+
+#ifdef TRACE_HAVE_JUMP_LABEL
+    fail_unless(j != NULL);
+#endif
+
+    fail_unless(site_is(j, FALSE));
+    fail_unless(emit() == 0);
+
+    fail_unless(trace_flag_set(DBG_TEST) == 0);
+    fail_unless(site_is(j, TRUE));
+    fail_unless(emit() > 0);
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, TEST_MESSAGE"\n"));
+
+    fail_unless(trace_context_disable(cid) == 0);
+    fail_unless(site_is(j, FALSE));
+    fail_unless(emit() == 0);
+
+    fail_unless(trace_context_enable(cid) == 0);
+    fail_unless(site_is(j, TRUE));
+
+    fail_unless(trace_flag_clr(DBG_TEST) == 0);
+    fail_unless(site_is(j, FALSE));
+    fail_unless(emit() == 0);
+
+    fail_unless(trace_configure(TEST_CONTEXT".*=+"TEST_FLAG) == 0);
+    fail_unless(site_is(j, TRUE));
+    fail_unless(emit() > 0);
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, TEST_MESSAGE"\n"));
+}
+END_TEST
+
+
+START_TEST(sites64)
+{
+    trace_jump_t *j = site_of(&DBG_TEST64);
+    char          msg[256];
+
+    fail_unless(site_is(j, FALSE));
+    fail_unless(emit64() == 0);
+
+    fail_unless(trace_flag_set64(DBG_TEST64) == 0);
+    fail_unless(site_is(j, TRUE));
+    fail_unless(emit64() > 0);
+    fail_unless(fgets(msg, sizeof(msg), stdtrc) != NULL);
+    fail_unless(!strcmp(msg, TEST_MESSAGE"\n"));
+
+    fail_unless(trace_flag_clr64(DBG_TEST64) == 0);
+    fail_unless(site_is(j, FALSE));
+    fail_unless(emit64() == 0);
+}
+END_TEST
+
+
+START_TEST(sites_configure)
+{
+    trace_jump_t *j = site_of(&DBG_TEST), *j64 = site_of(&DBG_TEST64);
+
+    /* sites get patched once trace_configure is done with all changes */
+
+    fail_unless(trace_configure(TEST_CONTEXT".*=+"TEST_FLAG";"
+                                TEST_CONTEXT".*=-"TEST_FLAG";"
+                                TEST_CONTEXT"."TEST_MODULE"64=+"TEST_FLAG)
+                == 0);
+    fail_unless(site_is(j, FALSE));
+    fail_unless(site_is(j64, TRUE));
+    fail_unless(emit() == 0);
+    fail_unless(emit64() > 0);
+
+    fail_unless(trace_configure(TEST_CONTEXT".*=-"TEST_FLAG";"
+                                TEST_CONTEXT"."TEST_MODULE"=+"TEST_FLAG)
+                == 0);
+    fail_unless(site_is(j, TRUE));
+    fail_unless(site_is(j64, FALSE));
+}
+END_TEST
+
+
+void
+chktrace_jump_tests(Suite *suite)
+{
+    TCase *tc;
+
+    tc = tcase_create("jump labels");
+    tcase_add_checked_fixture(tc, setup, teardown);
+
+    tcase_add_test(tc, sites);
+    tcase_add_test(tc, sites64);
+    tcase_add_test(tc, sites_configure);
+
+    suite_add_tcase(suite, tc);
+}
+
+
+
+/* 
+ * Local Variables:
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:set expandtab shiftwidth=4:
+ */
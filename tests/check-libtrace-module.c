@@ -21,6 +21,8 @@ USA.
 
 
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <check.h>
 
 #include <simple-trace/simple-trace.h>
@@ -37,6 +39,15 @@ TRACE_DECLARE_MODULE(moduletest, "test",
                      TRACE_FLAG("bar"   , "flag bar"   , &DBG_BAR),
                      TRACE_FLAG("foobar", "flag foobar", &DBG_FOOBAR));
 
+static int            DBG_STATIC1, DBG_STATIC2;
+static trace_flag64_t DBG_STATIC64;
+
+TRACE_DEFINE_MODULE_STATIC(staticmod, "static-module",
+                           TRACE_FLAG("static1", "flag 1", &DBG_STATIC1),
+                           TRACE_FLAG("static2", NULL    , &DBG_STATIC2));
+TRACE_DEFINE_MODULE_STATIC64(staticmod64, "static-module64",
+                             TRACE_FLAG("static", "flag", &DBG_STATIC64));
+
 
 static void
 setup(void)
@@ -89,6 +100,80 @@ START_TEST(multiple_unregister)
 END_TEST
 
 
+START_TEST(static_modules)
+{
+    char buf[4096];
+
+    /* added to the default context by trace_init */
+    fail_unless(trace_add_module(TRACE_DEFAULT_CONTEXT, &staticmod) ==
+                -EEXIST);
+    fail_unless(trace_flag_set(DBG_STATIC1) == 0);
+    fail_unless(trace_flag_set(DBG_STATIC2) == 0);
+    fail_unless(trace_flag_set64(DBG_STATIC64) == 0);
+    fail_unless(DBG_STATIC2 != DBG_STATIC1);
+
+    fail_unless(trace_show(TRACE_DEFAULT_NAME, buf, sizeof(buf),
+                           TRACE_SHOW_FLAGS) > 0);
+    fail_unless(strstr(buf, "static-module=+static1") != NULL);
+    fail_unless(strstr(buf, "static-module64=+static") != NULL);
+
+    /* deleted once the last registration of the table is gone */
+    __trace_modules_unregister(__start___trace_modules,
+                               __stop___trace_modules);
+    fail_unless(trace_flag_set(DBG_STATIC1) == 0);
+    __trace_modules_unregister(__start___trace_modules,
+                               __stop___trace_modules);
+    fail_unless(trace_del_module(TRACE_DEFAULT_CONTEXT, "static-module") < 0);
+    fail_unless(trace_show(TRACE_DEFAULT_NAME, buf, sizeof(buf),
+                           TRACE_SHOW_FLAGS) >= 0);
+    fail_unless(strstr(buf, "static-module") == NULL);
+
+    /* and added right away once initialized */
+    __trace_modules_register(__start___trace_modules, __stop___trace_modules);
+    fail_unless(trace_flag_set(DBG_STATIC2) == 0);
+    fail_unless(trace_del_module(TRACE_DEFAULT_CONTEXT, "static-module") == 0);
+}
+END_TEST
+
+
+static size_t
+context_memory(void)
+{
+    char   buf[8192], *p;
+    size_t used;
+
+    fail_unless(trace_show(CONTEXT_NAME, buf, sizeof(buf),
+                           TRACE_SHOW_JSON) > 0);
+    fail_unless((p = strstr(buf, "\"memory\":")) != NULL);
+    fail_unless(sscanf(p, "\"memory\":%zu", &used) == 1);
+
+    return used;
+}
+
+
+START_TEST(module_memory)
+{
+    size_t empty, added;
+    int    i;
+
+    empty = context_memory();
+    fail_unless(trace_add_module(cid, &moduletest) == 0);
+    added = context_memory();
+    fail_unless(added > empty);
+
+    /* deleted modules give their memory back for reuse */
+    for (i = 0; i < 10; i++) {
+        fail_unless(trace_del_module(cid, moduletest.name) == 0);
+        fail_unless(context_memory() == empty);
+        fail_unless(trace_add_module(cid, &moduletest) == 0);
+        fail_unless(context_memory() == added);
+    }
+
+    fail_unless(trace_del_module(cid, moduletest.name) == 0);
+}
+END_TEST
+
+
 void
 chktrace_module_tests(Suite *suite)
 {
@@ -101,6 +186,8 @@ chktrace_module_tests(Suite *suite)
     tcase_add_test(tc, spurious_unregister);
     tcase_add_test(tc, register_unregister);
     tcase_add_test(tc, multiple_unregister);
+    tcase_add_test(tc, static_modules);
+    tcase_add_test(tc, module_memory);
     suite_add_tcase(suite, tc);
 }
 
@@ -21,9 +21,16 @@ USA.
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <check.h>
 
 
@@ -108,6 +115,682 @@ START_TEST(test_file)
 END_TEST
 
 
+#define RING_THREADS  4
+#define RING_MESSAGES 100
+
+static void *
+ring_thread(void *data)
+{
+    int i;
+
+    (void)data;
+
+    for (i = 0; i < RING_MESSAGES; i++)
+        trace_printf(DBG_FOO, "message #%d", i);
+
+    return NULL;
+}
+
+
+START_TEST(test_ring)
+{
+#define RING_FILE "/tmp/trace-test-ring.log"
+    pthread_t  tid[RING_THREADS];
+    FILE      *fp;
+    char       buf[1024];
+    int        i, nline;
+
+    unlink(RING_FILE);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(RING_FILE)) == 0);
+    fail_unless(trace_context_mode(cid, TRACE_MODE_RING) == 0);
+    fail_unless(trace_context_mode(cid, "bogus") < 0);
+
+    for (i = 0; i < RING_THREADS; i++)
+        fail_unless(pthread_create(tid + i, NULL, ring_thread, NULL) == 0);
+    ring_thread(NULL);
+    for (i = 0; i < RING_THREADS; i++)
+        pthread_join(tid[i], NULL);
+
+    /* switching back to direct mode flushes all pending messages */
+    fail_unless(trace_context_mode(cid, TRACE_MODE_DIRECT) == 0);
+
+    fail_unless((fp = fopen(RING_FILE, "r")) != NULL);
+    for (nline = 0; fgets(buf, sizeof(buf), fp) != NULL; nline++)
+        fail_unless(strstr(buf, "message #") != NULL);
+    fclose(fp);
+    unlink(RING_FILE);
+
+    fail_unless(nline == (RING_THREADS + 1) * RING_MESSAGES);
+}
+END_TEST
+
+
+#define BINARY_FORMAT "%d %i %ld %lld %u %x %#o %c %s %-8s| %.3s %*d %.*f " \
+                      "%5.2f %e %g %Lf %zu %p %hhd %hu %% %s"
+
+static void
+binary_messages(void)
+{
+    char *abc;
+
+    /* strings with a precision need not be terminated */
+    fail_unless((abc = malloc(3)) != NULL);
+    memcpy(abc, "abc", 3);
+
+    trace_printf(DBG_FOO, BINARY_FORMAT, -1, 2, -3L, 4LL, 5U, 0xabcU, 8U,
+                 'c', "string", "left", "truncated", 6, 7, 2, 3.14159,
+                 2.5, 1e10, 0.5, 1.25L, (size_t)9, (void *)&cid,
+                 (char)10, (unsigned short)11, (char *)NULL);
+    trace_printf(DBG_FOO, "%ls", L"wide strings are formatted directly");
+    trace_printf(DBG_FOO, "no arguments");
+    trace_printf(DBG_FOO, "%.*s|%.3s|%.*s|%.*s", 2, abc, abc, 3, abc,
+                 -1, "negative precision");
+
+    free(abc);
+}
+
+
+START_TEST(test_binary)
+{
+#define BINARY_FILE "/tmp/trace-test-binary.log"
+    FILE *fp;
+    char  direct[4][1024], binary[4][1024];
+    int   i;
+
+    unlink(BINARY_FILE);
+    fail_unless(trace_context_format(cid, "%c %m %f %M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(BINARY_FILE)) == 0);
+
+    binary_messages();
+    fail_unless(trace_context_mode(cid, TRACE_MODE_BINARY) == 0);
+    binary_messages();
+    fail_unless(trace_context_mode(cid, TRACE_MODE_DIRECT) == 0);
+
+    fail_unless((fp = fopen(BINARY_FILE, "r")) != NULL);
+    for (i = 0; i < 4; i++)
+        fail_unless(fgets(direct[i], sizeof(direct[i]), fp) != NULL);
+    for (i = 0; i < 4; i++)
+        fail_unless(fgets(binary[i], sizeof(binary[i]), fp) != NULL);
+    fclose(fp);
+    unlink(BINARY_FILE);
+
+    for (i = 0; i < 4; i++)
+        fail_unless(!strcmp(direct[i], binary[i]));
+    fail_unless(strstr(direct[3], "ab|abc|abc|negative precision") != NULL);
+}
+END_TEST
+
+
+static int
+file_size(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+        return -1;
+    else
+        return (int)st.st_size;
+}
+
+
+START_TEST(test_flush)
+{
+#define FLUSH_FILE    "/tmp/trace-test-flush.log"
+#define FLUSH_MESSAGE "a fairly uninteresting message of some length"
+    int i, n, total;
+
+    unlink(FLUSH_FILE);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(FLUSH_FILE)) == 0);
+
+    fail_unless(trace_context_flush(cid, "size=") == -EINVAL);
+    fail_unless(trace_context_flush(cid, "interval=10") == -EINVAL);
+    fail_unless(trace_context_flush(cid, "sometimes") == -EINVAL);
+
+    /* messages are coalesced until the buffer fills up */
+    fail_unless(trace_context_flush(cid, TRACE_FLUSH_SIZE("1k")) == 0);
+    for (i = total = 0; i < 100; i++) {
+        fail_unless((n = trace_printf(DBG_FOO, FLUSH_MESSAGE)) > 0);
+        total += n;
+        fail_unless(file_size(FLUSH_FILE) > total - 1024);
+        fail_unless(file_size(FLUSH_FILE) % n == 0);
+    }
+    fail_unless(file_size(FLUSH_FILE) < total);
+    fail_unless(trace_context_flush(cid, NULL) == 0);
+    fail_unless(file_size(FLUSH_FILE) == total);
+
+    /* ... until the interval expires */
+    fail_unless(trace_context_flush(cid, TRACE_FLUSH_INTERVAL("20ms")) == 0);
+    fail_unless((n = trace_printf(DBG_FOO, FLUSH_MESSAGE)) > 0);
+    total += n;
+    fail_unless(file_size(FLUSH_FILE) < total);
+    usleep(200 * 1000);
+    fail_unless(file_size(FLUSH_FILE) == total);
+
+    /* ... or the target is changed */
+    fail_unless(trace_context_flush(cid, TRACE_FLUSH_NEVER) == 0);
+    fail_unless((n = trace_printf(DBG_FOO, FLUSH_MESSAGE)) > 0);
+    total += n;
+    fail_unless(file_size(FLUSH_FILE) < total);
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    fail_unless(file_size(FLUSH_FILE) == total);
+
+    unlink(FLUSH_FILE);
+}
+END_TEST
+
+
+START_TEST(test_flush_close)
+{
+    int n;
+
+    unlink(FLUSH_FILE);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(FLUSH_FILE)) == 0);
+    fail_unless(trace_configure(CONTEXT_NAME" flush never") == 0);
+    fail_unless((n = trace_printf(DBG_FOO, FLUSH_MESSAGE)) > 0);
+    fail_unless(file_size(FLUSH_FILE) == 0);
+    fail_unless(trace_del_module(cid, targettest.name) == 0);
+    fail_unless(trace_context_close(cid) == 0);
+    fail_unless(file_size(FLUSH_FILE) == n);
+
+    /* make teardown happy */
+    fail_unless((cid = trace_context_open(CONTEXT_NAME)) >= 0);
+    fail_unless(trace_add_module(cid, &targettest) == 0);
+
+    unlink(FLUSH_FILE);
+}
+END_TEST
+
+
+START_TEST(test_flush_signal)
+{
+    pid_t pid;
+    int   n, status;
+
+    unlink(FLUSH_FILE);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(FLUSH_FILE)) == 0);
+    fail_unless(trace_context_flush(cid, TRACE_FLUSH_NEVER) == 0);
+    fail_unless((n = trace_printf(DBG_FOO, FLUSH_MESSAGE)) > 0);
+    fail_unless(file_size(FLUSH_FILE) == 0);
+
+    if ((pid = fork()) == 0) {
+        fail_unless(trace_printf(DBG_FOO, FLUSH_MESSAGE) == n);
+        abort();
+    }
+
+    fail_unless(pid > 0);
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    fail_unless(file_size(FLUSH_FILE) == 2 * n);
+
+    unlink(FLUSH_FILE);
+}
+END_TEST
+
+
+static void
+app_handler(int sig)
+{
+    (void)sig;
+}
+
+
+START_TEST(test_flush_handlers)
+{
+    struct sigaction sa;
+    pid_t            pid;
+    int              status;
+
+    /* only crash signals are caught, later handlers are left in place */
+
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(FLUSH_FILE)) == 0);
+    fail_unless(trace_context_flush(cid, TRACE_FLUSH_NEVER) == 0);
+
+    fail_unless(sigaction(SIGTERM, NULL, &sa) == 0);
+    fail_unless(!(sa.sa_flags & SA_SIGINFO) && sa.sa_handler == SIG_DFL);
+
+    if ((pid = fork()) == 0) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = app_handler;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGFPE, &sa, NULL) < 0)
+            _exit(1);
+        trace_exit();
+        if (sigaction(SIGFPE, NULL, &sa) < 0 || sa.sa_handler != app_handler)
+            _exit(2);
+        _exit(0);
+    }
+
+    fail_unless(pid > 0);
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    fail_unless(trace_context_flush(cid, TRACE_FLUSH_LINE) == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    unlink(FLUSH_FILE);
+}
+END_TEST
+
+
+START_TEST(test_mmap)
+{
+#define MMAP_FILE    "/tmp/trace-test-mmap.trace"
+#define MMAP_MESSAGE "message #%04d"
+    char path[256], buf[64];
+    FILE *fp;
+    int   i, n;
+
+    unlink(MMAP_FILE);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, "mmap:") == -EINVAL);
+    fail_unless(trace_context_target(cid, TRACE_TO_MMAP(MMAP_FILE, "1x")) ==
+                -EINVAL);
+
+    /* 1000 messages of 14 bytes wrap around a 4k ring a few times */
+    fail_unless(trace_context_target(cid, TRACE_TO_MMAP(MMAP_FILE, "4k")) ==
+                0);
+    fail_unless(file_size(MMAP_FILE) > 4096);
+    for (i = 0; i < 1000; i++)
+        fail_unless(trace_printf(DBG_FOO, MMAP_MESSAGE, i) > 0);
+
+    snprintf(path, sizeof(path), "../src/trace-extract %s", MMAP_FILE);
+    fail_unless((fp = popen(path, "r")) != NULL);
+    fail_unless(fgets(buf, sizeof(buf), fp) != NULL);
+
+    /* the oldest complete message, then all the rest in order */
+    fail_unless(sscanf(buf, "message #%d", &n) == 1);
+    fail_unless(n > 1000 - 4096 / 14 - 1 && n < 1000 - 4096 / 14 + 2);
+    for (i = n + 1; fgets(buf, sizeof(buf), fp) != NULL; i++) {
+        fail_unless(sscanf(buf, "message #%d", &n) == 1);
+        fail_unless(n == i);
+    }
+    fail_unless(i == 1000);
+    pclose(fp);
+
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    unlink(MMAP_FILE);
+}
+END_TEST
+
+
+START_TEST(test_record)
+{
+#define RECORD_FILE    "/tmp/trace-test-record.log"
+#define RECORD_DUMP    "/tmp/trace-test-record.dump"
+#define RECORD_MESSAGE "record #%d %s"
+    char  buf[64], str[16];
+    FILE *fp;
+    int   i, n;
+
+    unlink(RECORD_FILE);
+    unlink(RECORD_DUMP);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(RECORD_FILE)) == 0);
+
+    /* recorded messages do not show up in the target, not even disabled */
+    fail_unless(trace_configure(CONTEXT_NAME".module=~bar") == 0);
+    fail_unless(trace_flag_tst(DBG_BAR) == 0);
+    fail_unless(trace_context_disable(cid) == 0);
+    for (i = 0; i < 20000; i++)
+        fail_unless(trace_printf(DBG_BAR, RECORD_MESSAGE, i, "bar") > 0);
+    fail_unless(trace_context_enable(cid) == 0);
+    fail_unless(file_size(RECORD_FILE) == 0);
+
+    /* the most recent ones are dumped in order, and can be dumped again */
+    fail_unless(trace_configure(CONTEXT_NAME" dump "RECORD_DUMP) == 0);
+    fail_unless((fp = fopen(RECORD_DUMP, "r")) != NULL);
+    fail_unless(fgets(buf, sizeof(buf), fp) != NULL);
+    fail_unless(sscanf(buf, "record #%d %15s", &n, str) == 2);
+    fail_unless(n > 0 && !strcmp(str, "bar"));
+    for (i = n + 1; fgets(buf, sizeof(buf), fp) != NULL; i++) {
+        fail_unless(sscanf(buf, "record #%d %15s", &n, str) == 2);
+        fail_unless(n == i && !strcmp(str, "bar"));
+    }
+    fail_unless(i == 20000);
+    fclose(fp);
+    n = file_size(RECORD_DUMP);
+    fail_unless(trace_context_dump(cid, RECORD_DUMP) == 0);
+    fail_unless(file_size(RECORD_DUMP) == 2 * n);
+    fail_unless(file_size(RECORD_FILE) == 0);
+
+    /* a recorded flag turned on is printed but not recorded any more */
+    fail_unless(trace_flag_set(DBG_BAR) == 0);
+    fail_unless((n = trace_printf(DBG_BAR, RECORD_MESSAGE, 0, "bar")) > 0);
+    fail_unless(file_size(RECORD_FILE) == n);
+    fail_unless(trace_flag_record(DBG_BAR) == 0);
+    fail_unless(trace_flag_tst(DBG_BAR) == 0);
+    fail_unless(trace_flag_clr(DBG_BAR) == 0);
+    fail_unless(trace_printf(DBG_BAR, RECORD_MESSAGE, 0, "bar") == 0);
+
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    unlink(RECORD_FILE);
+    unlink(RECORD_DUMP);
+}
+END_TEST
+
+
+START_TEST(test_stats)
+{
+#define STATS_FILE "/tmp/trace-test-stats.log"
+    pthread_t     threads[RING_THREADS];
+    trace_stats_t st;
+    int           i;
+
+    unlink(STATS_FILE);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(STATS_FILE)) == 0);
+
+    /* nothing is counted until statistics are turned on */
+    fail_unless(trace_printf(DBG_FOO, "foo") > 0);
+    fail_unless(trace_stats(DBG_FOO, &st) == 0);
+    fail_unless(st.emitted == 0 && st.bytes == 0);
+    fail_unless(trace_context_stats(cid, "bogus") == -EINVAL);
+    fail_unless(trace_configure(CONTEXT_NAME" stats "TRACE_STATS_ON) == 0);
+
+    /* every thread counts into a shard, the sums cover all of them */
+    for (i = 0; i < RING_THREADS; i++)
+        fail_unless(pthread_create(threads + i, NULL, ring_thread,
+                                   NULL) == 0);
+    for (i = 0; i < RING_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    fail_unless(trace_stats(DBG_FOO, &st) == 0);
+    fail_unless(st.emitted == RING_THREADS * RING_MESSAGES);
+    fail_unless(st.suppressed == 0);
+    fail_unless(st.bytes == (uint64_t)file_size(STATS_FILE) - 4);
+    fail_unless(st.format_ns > 0);
+
+    /* recorded messages are suppressed, disabled ones are not seen at all */
+    fail_unless(trace_flag_record(DBG_BAR) == 0);
+    fail_unless(trace_printf(DBG_BAR, "bar") > 0);
+    fail_unless(trace_flag_clr(DBG_BAR) == 0);
+    fail_unless(trace_printf(DBG_BAR, "bar") == 0);
+    fail_unless(trace_stats(DBG_BAR, &st) == 0);
+    fail_unless(st.emitted == 0 && st.suppressed == 1 && st.bytes == 0);
+
+    /* turning statistics off keeps the counters, resetting clears them */
+    fail_unless(trace_context_stats(cid, TRACE_STATS_OFF) == 0);
+    fail_unless(trace_printf(DBG_FOO, "foo") > 0);
+    fail_unless(trace_stats(DBG_FOO, &st) == 0);
+    fail_unless(st.emitted == RING_THREADS * RING_MESSAGES);
+    fail_unless(trace_context_stats(cid, TRACE_STATS_RESET) == 0);
+    fail_unless(trace_stats(DBG_FOO, &st) == 0);
+    fail_unless(st.emitted == 0 && st.bytes == 0 && st.format_ns == 0);
+
+    fail_unless(trace_stats(-1, &st) == -ENOENT);
+
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    unlink(STATS_FILE);
+}
+END_TEST
+
+
+START_TEST(test_limit)
+{
+#define LIMIT_FILE "/tmp/trace-test-limit.log"
+    trace_stats_t st;
+    char          buf[256];
+    FILE         *fp;
+    int           i, n, found;
+
+    unlink(LIMIT_FILE);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(LIMIT_FILE)) == 0);
+    fail_unless(trace_context_stats(cid, TRACE_STATS_ON) == 0);
+
+    /* a burst of a second's worth of messages gets through, no more */
+    fail_unless(trace_configure(CONTEXT_NAME".module=+foo@100/s") == 0);
+    for (i = n = 0; i < 1000; i++)
+        if (trace_printf(DBG_FOO, "limited #%d", i) > 0)
+            n++;
+    fail_unless(100 <= n && n < 110);
+    fail_unless(trace_stats(DBG_FOO, &st) == 0);
+    fail_unless(st.emitted == (uint64_t)n && st.suppressed == 1000ULL - n);
+
+    fail_unless(trace_show(CONTEXT_NAME, buf, sizeof(buf), NULL) > 0);
+    fail_unless(strstr(buf, CONTEXT_NAME".module=+foo@100/s\n") != NULL);
+
+    /* the next message let through is preceded by a summary */
+    usleep(20 * 1000);
+    fail_unless(trace_printf(DBG_FOO, "limited #%d", i) > 0);
+    fail_unless((fp = fopen(LIMIT_FILE, "r")) != NULL);
+    for (found = 0; fgets(buf, sizeof(buf), fp) != NULL; )
+        if (strstr(buf, " messages suppressed (limit 100/s)") != NULL)
+            found++;
+    fclose(fp);
+    fail_unless(found == 1);
+
+    /* without a limit everything gets through again */
+    fail_unless(trace_flag_limit(DBG_FOO, -1) == -EINVAL);
+    fail_unless(trace_flag_limit(DBG_FOO, 0) == 0);
+    for (i = n = 0; i < 1000; i++)
+        if (trace_printf(DBG_FOO, "unlimited #%d", i) > 0)
+            n++;
+    fail_unless(n == 1000);
+
+    fail_unless(trace_context_stats(cid, TRACE_STATS_OFF) == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    unlink(LIMIT_FILE);
+}
+END_TEST
+
+
+START_TEST(test_sample)
+{
+#define SAMPLE_FILE  "/tmp/trace-test-sample.log"
+#define SAMPLE_FLAGS 65                      /* more than the table once had */
+    static int        ids[SAMPLE_FLAGS];
+    static char       names[SAMPLE_FLAGS][16];
+    trace_flagdef_t   flags[SAMPLE_FLAGS + 1];
+    trace_moduledef_t sampled = { "sampled", flags, SAMPLE_FLAGS + 1 };
+    trace_stats_t     st;
+    char              buf[256];
+    int               cnt[SAMPLE_FLAGS], i, n, m;
+
+    unlink(SAMPLE_FILE);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(SAMPLE_FILE)) == 0);
+    fail_unless(trace_context_stats(cid, TRACE_STATS_ON) == 0);
+
+    /* every Nth message gets through, starting with the first one */
+    fail_unless(trace_configure(CONTEXT_NAME".module=+foo%1/10") == 0);
+    for (i = n = 0; i < 1000; i++)
+        if (trace_printf(DBG_FOO, "sampled #%d", i) > 0) {
+            fail_unless(i % 10 == 0);
+            n++;
+        }
+    fail_unless(n == 100);
+    fail_unless(trace_stats(DBG_FOO, &st) == 0);
+    fail_unless(st.emitted == 100 && st.suppressed == 900);
+
+    fail_unless(trace_show(CONTEXT_NAME, buf, sizeof(buf), NULL) > 0);
+    fail_unless(strstr(buf, CONTEXT_NAME".module=+foo%1/10\n") != NULL);
+
+    /* flags sampled in turn keep counts of their own, however many */
+    for (i = 0; i < SAMPLE_FLAGS; i++) {
+        snprintf(names[i], sizeof(names[i]), "flag%d", i);
+        flags[i].name    = names[i];
+        flags[i].descr   = "sampled flag";
+        flags[i].flagptr = ids + i;
+    }
+    memset(flags + SAMPLE_FLAGS, 0, sizeof(flags[0]));
+    fail_unless(trace_add_module(cid, &sampled) == 0);
+    fail_unless(trace_configure(CONTEXT_NAME".sampled=+all%1/10") == 0);
+    memset(cnt, 0, sizeof(cnt));
+    for (i = 0; i < 1000; i++)
+        for (m = 0; m < SAMPLE_FLAGS; m++)
+            if (trace_printf(ids[m], "sampled #%d", i) > 0)
+                cnt[m]++;
+    for (m = 0; m < SAMPLE_FLAGS; m++)
+        fail_unless(cnt[m] == 100);
+    fail_unless(trace_del_module(cid, "sampled") == 0);
+
+    /* random sampling gets through about 1 in N */
+    fail_unless(trace_configure(CONTEXT_NAME".module=+foo%~1/10@1000000/s")
+                == 0);
+    fail_unless(trace_show(CONTEXT_NAME, buf, sizeof(buf), NULL) > 0);
+    fail_unless(strstr(buf, CONTEXT_NAME".module=+foo%~1/10@1000000/s\n")
+                != NULL);
+    for (i = n = 0; i < 10000; i++)
+        if (trace_printf(DBG_FOO, "random #%d", i) > 0)
+            n++;
+    fail_unless(500 < n && n < 1500);
+
+    /* invalid sampling leaves the flag as it was */
+    trace_configure(CONTEXT_NAME".module=+foo%2/10,+foo%1/0");
+    fail_unless(trace_show(CONTEXT_NAME, buf, sizeof(buf), NULL) > 0);
+    fail_unless(strstr(buf, CONTEXT_NAME".module=+foo%~1/10@1000000/s\n")
+                != NULL);
+
+    /* without sampling everything gets through again */
+    fail_unless(trace_flag_sample(DBG_FOO, -1, FALSE) == -EINVAL);
+    fail_unless(trace_flag_sample(DBG_FOO, 0, FALSE) == 0);
+    fail_unless(trace_flag_limit(DBG_FOO, 0) == 0);
+    for (i = n = 0; i < 1000; i++)
+        if (trace_printf(DBG_FOO, "unsampled #%d", i) > 0)
+            n++;
+    fail_unless(n == 1000);
+
+    fail_unless(trace_context_stats(cid, TRACE_STATS_OFF) == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    unlink(SAMPLE_FILE);
+}
+END_TEST
+
+
+#define ASYNC_FIFO     "/tmp/trace-test-async.fifo"
+#define ASYNC_MESSAGES 5000
+#define ASYNC_PADDING  "...................................................."
+
+typedef struct {
+    int                fd;                   /* fifo to read */
+    int                nline;                /* messages read */
+    int                last;                 /* last message read */
+    unsigned long long spilled;              /* drops reported in output */
+} fifo_t;
+
+static void *
+fifo_read(void *data)
+{
+    fifo_t             *f = (fifo_t *)data;
+    struct pollfd       pfd = { .fd = f->fd, .events = POLLIN };
+    char                buf[4096], line[1024];
+    unsigned long long  count;
+    int                 n, i, len;
+
+    /* read until the fifo stays silent for a while */
+
+    f->nline = f->spilled = 0;
+    f->last  = -1;
+    len      = 0;
+
+    while (poll(&pfd, 1, 500) > 0 && (n = read(f->fd, buf, sizeof(buf))) > 0)
+        for (i = 0; i < n; i++) {
+            if (buf[i] != '\n') {
+                if (len < (int)sizeof(line) - 1)
+                    line[len++] = buf[i];
+                continue;
+            }
+            line[len] = '\0';
+            len       = 0;
+            if (sscanf(line, "overflow #%d", &f->last) == 1)
+                f->nline++;
+            else if (sscanf(line, "%llu trace messages dropped.", &count) == 1)
+                f->spilled += count;
+        }
+
+    return NULL;
+}
+
+static void
+async_messages(void)
+{
+    int i;
+
+    for (i = 0; i < ASYNC_MESSAGES; i++)
+        trace_printf(DBG_FOO, "overflow #%d %s", i, ASYNC_PADDING);
+}
+
+
+START_TEST(test_async)
+{
+#define ASYNC_FILE "/tmp/trace-test-async.log"
+    pthread_t  tid[RING_THREADS];
+    FILE      *fp;
+    fifo_t     f;
+    uint64_t   dropped, before;
+    char       buf[1024];
+    static char big[100000];
+    int        i, nline;
+
+    /* messages of all threads get written by the writer thread */
+    unlink(ASYNC_FILE);
+    fail_unless(trace_context_format(cid, "%M") == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(ASYNC_FILE)) == 0);
+    fail_unless(trace_configure(CONTEXT_NAME" mode "TRACE_MODE_ASYNC) == 0);
+
+    for (i = 0; i < RING_THREADS; i++)
+        fail_unless(pthread_create(tid + i, NULL, ring_thread, NULL) == 0);
+    ring_thread(NULL);
+    for (i = 0; i < RING_THREADS; i++)
+        pthread_join(tid[i], NULL);
+
+    /* messages too big for a writer batch are refused */
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    fail_unless(trace_printf(DBG_FOO, "%s", big) == -EMSGSIZE);
+
+    fail_unless(trace_context_flush(cid, NULL) == 0);
+    fail_unless((fp = fopen(ASYNC_FILE, "r")) != NULL);
+    for (nline = 0; fgets(buf, sizeof(buf), fp) != NULL; nline++)
+        fail_unless(strstr(buf, "message #") != NULL);
+    fclose(fp);
+    unlink(ASYNC_FILE);
+    fail_unless(nline == (RING_THREADS + 1) * RING_MESSAGES);
+    fail_unless(trace_context_dropped(cid, &dropped) == 0 && dropped == 0);
+
+    /* a stalled target overflows the queue */
+    unlink(ASYNC_FIFO);
+    fail_unless(mkfifo(ASYNC_FIFO, 0600) == 0);
+    fail_unless((f.fd = open(ASYNC_FIFO, O_RDONLY | O_NONBLOCK)) >= 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(ASYNC_FIFO)) == 0);
+    fail_unless(trace_context_overflow(cid, "bogus") == -EINVAL);
+
+    /* drop-oldest keeps the latest messages */
+    fail_unless(trace_context_overflow(cid, TRACE_OVERFLOW_DROP_OLDEST) == 0);
+    async_messages();
+    fifo_read(&f);
+    fail_unless(trace_context_dropped(cid, &dropped) == 0 && dropped > 0);
+    fail_unless(f.nline + dropped == ASYNC_MESSAGES);
+    fail_unless(f.last == ASYNC_MESSAGES - 1);
+
+    /* spill-count reports the number of dropped messages in the output */
+    before = dropped;
+    fail_unless(trace_configure(CONTEXT_NAME" overflow "
+                                TRACE_OVERFLOW_SPILL) == 0);
+    async_messages();
+    fifo_read(&f);
+    fail_unless(trace_context_dropped(cid, &dropped) == 0);
+    fail_unless(dropped > before && f.spilled == dropped - before);
+    fail_unless(f.nline + f.spilled == ASYNC_MESSAGES);
+
+    /* block waits for the writer instead */
+    before = dropped;
+    fail_unless(trace_context_overflow(cid, TRACE_OVERFLOW_BLOCK) == 0);
+    fail_unless(pthread_create(tid, NULL, fifo_read, &f) == 0);
+    async_messages();
+    pthread_join(tid[0], NULL);
+    fail_unless(trace_context_dropped(cid, &dropped) == 0 && dropped == before);
+    fail_unless(f.nline == ASYNC_MESSAGES);
+
+    fail_unless(trace_context_mode(cid, TRACE_MODE_DIRECT) == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_STDERR) == 0);
+    close(f.fd);
+    unlink(ASYNC_FIFO);
+}
+END_TEST
+
+
 void
 chktrace_target_tests(Suite *suite)
 {
@@ -118,6 +801,18 @@ chktrace_target_tests(Suite *suite)
 
     tcase_add_test(tc, test_stdout);
     tcase_add_test(tc, test_file);
+    tcase_add_test(tc, test_ring);
+    tcase_add_test(tc, test_binary);
+    tcase_add_test(tc, test_flush);
+    tcase_add_test(tc, test_flush_close);
+    tcase_add_test(tc, test_flush_signal);
+    tcase_add_test(tc, test_flush_handlers);
+    tcase_add_test(tc, test_mmap);
+    tcase_add_test(tc, test_record);
+    tcase_add_test(tc, test_stats);
+    tcase_add_test(tc, test_limit);
+    tcase_add_test(tc, test_sample);
+    tcase_add_test(tc, test_async);
     suite_add_tcase(suite, tc);
 }
 
@@ -0,0 +1,210 @@
+/*************************************************************************
+This file is part of libtrace
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <check.h>
+
+
+#include <simple-trace/simple-trace.h>
+#include "check-libtrace.h"
+
+#define CONTEXT_NAME "stress"
+#define NTHREAD      4
+#define NROUND       500
+#define TRACE_FILE_A "/tmp/trace-test-stress-a.log"
+#define TRACE_FILE_B "/tmp/trace-test-stress-b.log"
+
+static int cid;
+static int DBG_STABLE, DBG_FOO, DBG_BAR;
+static int done;
+
+TRACE_DECLARE_MODULE(stable, "stable",
+                     TRACE_FLAG("stable", "flag stable", &DBG_STABLE));
+
+TRACE_DECLARE_MODULE(volatile_module, "volatile",
+                     TRACE_FLAG("foo", "flag foo", &DBG_FOO),
+                     TRACE_FLAG("bar", "flag bar", &DBG_BAR));
+
+
+static void
+setup(void)
+{
+    fail_unless(trace_init() == 0);
+    fail_unless((cid = trace_context_open(CONTEXT_NAME)) >= 0);
+    fail_unless(trace_add_module(cid, &stable) == 0);
+    fail_unless(trace_context_target(cid, TRACE_TO_FILE(TRACE_FILE_A)) == 0);
+    fail_unless(trace_context_enable(cid) == 0);
+    fail_unless(trace_flag_set(DBG_STABLE) == 0);
+}
+
+
+static void
+teardown(void)
+{
+    fail_unless(trace_del_module(cid, stable.name) == 0);
+    fail_unless(trace_context_close(cid) == 0);
+    trace_exit();
+    unlink(TRACE_FILE_A);
+    unlink(TRACE_FILE_B);
+}
+
+
+static void *
+tracer(void *data)
+{
+    int i;
+
+    (void)data;
+
+    for (i = 0; !__atomic_load_n(&done, __ATOMIC_ACQUIRE); i++) {
+        trace_printf(DBG_STABLE, "stable message #%d", i);
+        trace_printf(DBG_FOO, "foo message #%d %s", i, "with a string");
+        trace_printf(DBG_BAR, "bar message #%d", i);
+    }
+
+    return NULL;
+}
+
+
+static pthread_key_t late_key;
+static int           late_n;
+
+
+static void
+late_tracer(void *data)
+{
+    /* runs after the destructor of the message buffer of the thread */
+    late_n = trace_printf(DBG_STABLE, "late %s%s", (char *)data, (char *)data);
+}
+
+
+static void *
+long_tracer(void *data)
+{
+    fail_unless(trace_printf(DBG_STABLE, "long %s", (char *)data) > 0);
+    fail_unless(pthread_key_create(&late_key, late_tracer) == 0);
+    fail_unless(pthread_setspecific(late_key, data) == 0);
+
+    return NULL;
+}
+
+
+START_TEST(trace_from_destructor)
+{
+    static char long_msg[2048];
+    pthread_t   tid;
+
+    memset(long_msg, 'x', sizeof(long_msg) - 1);
+    fail_unless(pthread_create(&tid, NULL, long_tracer, long_msg) == 0);
+    pthread_join(tid, NULL);
+    pthread_key_delete(late_key);
+
+    fail_unless(late_n > (int)(2 * strlen(long_msg)));
+}
+END_TEST
+
+
+START_TEST(modules_while_tracing)
+{
+    pthread_t tid[NTHREAD];
+    int       i;
+
+    done = FALSE;
+    for (i = 0; i < NTHREAD; i++)
+        fail_unless(pthread_create(tid + i, NULL, tracer, NULL) == 0);
+
+    for (i = 0; i < NROUND; i++) {
+        fail_unless(trace_add_module(cid, &volatile_module) == 0);
+        trace_flag_set(DBG_FOO);
+        trace_flag_set(DBG_BAR);
+        fail_unless(trace_del_module(cid, volatile_module.name) == 0);
+    }
+
+    __atomic_store_n(&done, TRUE, __ATOMIC_RELEASE);
+    for (i = 0; i < NTHREAD; i++)
+        pthread_join(tid[i], NULL);
+}
+END_TEST
+
+
+START_TEST(configure_while_tracing)
+{
+    pthread_t tid[NTHREAD];
+    int       i;
+
+    fail_unless(trace_add_module(cid, &volatile_module) == 0);
+
+    done = FALSE;
+    for (i = 0; i < NTHREAD; i++)
+        fail_unless(pthread_create(tid + i, NULL, tracer, NULL) == 0);
+
+    for (i = 0; i < NROUND; i++) {
+        trace_configure(CONTEXT_NAME".volatile=+foo,-bar");
+        trace_configure(CONTEXT_NAME" format '%c.%m.%f: %M'");
+        trace_configure(CONTEXT_NAME" target "TRACE_FILE_B);
+        trace_configure(CONTEXT_NAME" mode ring");
+        trace_configure(CONTEXT_NAME".volatile=-foo,+bar");
+        trace_configure(CONTEXT_NAME" format '[%C] %M'");
+        trace_configure(CONTEXT_NAME" target "TRACE_FILE_A);
+        trace_configure(CONTEXT_NAME" mode binary");
+        trace_configure(CONTEXT_NAME" disable");
+        trace_configure(CONTEXT_NAME" enabled");
+        trace_configure(CONTEXT_NAME" mode direct");
+    }
+
+    __atomic_store_n(&done, TRUE, __ATOMIC_RELEASE);
+    for (i = 0; i < NTHREAD; i++)
+        pthread_join(tid[i], NULL);
+
+    fail_unless(trace_del_module(cid, volatile_module.name) == 0);
+}
+END_TEST
+
+
+void
+chktrace_thread_tests(Suite *suite)
+{
+    TCase *tc;
+
+    tc = tcase_create("trace threads");
+    tcase_add_checked_fixture(tc, setup, teardown);
+    tcase_set_timeout(tc, 60);
+
+    tcase_add_test(tc, modules_while_tracing);
+    tcase_add_test(tc, configure_while_tracing);
+    tcase_add_test(tc, trace_from_destructor);
+    suite_add_tcase(suite, tc);
+}
+
+
+
+/* 
+ * Local Variables:
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:set expandtab shiftwidth=4:
+ */
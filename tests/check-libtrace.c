@@ -81,6 +81,8 @@ chktrace_suite(void)
 #if 1
     chktrace_target_tests(suite);
 #endif
+    chktrace_thread_tests(suite);
+    chktrace_jump_tests(suite);
 
     return suite;
 }
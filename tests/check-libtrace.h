@@ -31,6 +31,8 @@ void chktrace_flag_tests(Suite *suite);
 void chktrace_format_tests(Suite *suite);
 void chktrace_default_tests(Suite *suite);
 void chktrace_target_tests(Suite *suite);
+void chktrace_thread_tests(Suite *suite);
+void chktrace_jump_tests(Suite *suite);
 int capture_fd(int fd, int *pipe_fd, int *saved_fd);
 int release_fd(int fd, int *pipe_fd, int saved_fd);
 
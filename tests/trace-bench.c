@@ -0,0 +1,747 @@
+/*************************************************************************
+This file is part of libtrace
+
+Copyright (C) 2010 Nokia Corporation.
+
+This library is free software; you can redistribute
+it and/or modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation
+version 2.1 of the License.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+USA.
+*************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <malloc.h>
+
+#include <simple-trace/simple-trace.h>
+
+#define fatal(ec, fmt, args...) do {                            \
+        fprintf(stderr, "[ERROR] "fmt"\n", ## args);            \
+        fflush(stderr);                                         \
+        exit(ec);                                               \
+    } while (0)
+
+#define info(fmt, args...) do {                                 \
+        fprintf(stdout, "[INFO] "fmt"\n", ## args);             \
+        fflush(stdout);                                         \
+    } while (0)
+
+
+#define DEFAULT_LOOPS 10000000
+
+static int ctx;
+static int DBG_OFF, DBG_ON;
+
+static trace_flag64_t DBG_OFF64;
+
+TRACE_DECLARE_MODULE(bench, "bench",
+    TRACE_FLAG("off", "always disabled flag", &DBG_OFF),
+    TRACE_FLAG("on" , "enabled flag"        , &DBG_ON));
+
+TRACE_DECLARE_MODULE64(bench64, "bench64",
+    TRACE_FLAG("off", "always disabled flag", &DBG_OFF64));
+
+static int nevaluated;
+
+
+static inline double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int __attribute__((noinline))
+expensive_argument(int i)
+{
+    nevaluated++;
+    return i * 2;
+}
+
+
+static void
+report(const char *what, double start, double end, long loops)
+{
+    info("%-32s %10.2f ns/call", what, (end - start) / loops);
+}
+
+
+/********************
+ * bench_disabled
+ ********************/
+static void
+bench_disabled(long loops)
+{
+    double start, end;
+    long   i;
+
+    nevaluated = 0;
+    start = now_ns();
+    for (i = 0; i < loops; i++)
+        trace_write(DBG_OFF, "disabled %d", expensive_argument(i));
+    end = now_ns();
+    report("trace_write, disabled flag", start, end, loops);
+    info("%-32s %10d", "  arguments evaluated", nevaluated);
+
+    nevaluated = 0;
+    start = now_ns();
+    for (i = 0; i < loops; i++)
+        __trace_printf(DBG_OFF, __FILE__, __LINE__, __FUNCTION__,
+                       "disabled %d\n", expensive_argument(i));
+    end = now_ns();
+    report("__trace_printf, disabled flag", start, end, loops);
+    info("%-32s %10d", "  arguments evaluated", nevaluated);
+
+    nevaluated = 0;
+    start = now_ns();
+    for (i = 0; i < loops; i++)
+        trace_write64(DBG_OFF64, "disabled %d", expensive_argument(i));
+    end = now_ns();
+    report("trace_write64, disabled flag", start, end, loops);
+    info("%-32s %10d", "  arguments evaluated", nevaluated);
+}
+
+
+/********************
+ * bench_modes
+ ********************/
+static void
+bench_modes(long loops)
+{
+    static const char *modes[] = {
+        TRACE_MODE_DIRECT, TRACE_MODE_RING, TRACE_MODE_BINARY, NULL
+    };
+    double start, end;
+    long   i;
+    int    m;
+
+    for (m = 0; modes[m] != NULL; m++) {
+        if (trace_context_mode(ctx, modes[m]) != 0)
+            fatal(1, "failed to set output mode %s", modes[m]);
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "enabled %ld", i);
+        trace_context_mode(ctx, TRACE_MODE_DIRECT);   /* flush */
+        end = now_ns();
+        info("%-24s %-7s %10.2f ns/call", "trace_write, enabled", modes[m],
+             (end - start) / loops);
+    }
+}
+
+
+/********************
+ * bench_stamp
+ ********************/
+static void
+bench_stamp(long loops)
+{
+    static const char *formats[] = {
+        "%M"   , "no time stamp",
+        "%U %M", "absolute time stamp",
+        "%u %M", "delta time stamp",
+        NULL
+    };
+    double start, end;
+    long   i;
+    int    f;
+
+    for (f = 0; formats[f] != NULL; f += 2) {
+        if (trace_context_format(ctx, formats[f]) != 0)
+            fatal(1, "failed to set format '%s'", formats[f]);
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "enabled %ld", i);
+        end = now_ns();
+        report(formats[f + 1], start, end, loops);
+    }
+
+    trace_context_format(ctx, TRACE_DEFAULT_FORMAT);
+}
+
+
+/********************
+ * bench_gather
+ ********************/
+static void
+bench_gather(long loops)
+{
+    static const char *formats[] = {
+        "%M"                      , "message only",
+        "[%c] %m.%f: %M"          , "names prefix",
+        "[%c] %m.%f %W: %M"       , "names and location prefix",
+        NULL
+    };
+    double start, end;
+    long   i;
+    int    f;
+
+    for (f = 0; formats[f] != NULL; f += 2) {
+        if (trace_context_format(ctx, formats[f]) != 0)
+            fatal(1, "failed to set format '%s'", formats[f]);
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "enabled %ld", i);
+        end = now_ns();
+        report(formats[f + 1], start, end, loops);
+    }
+
+    trace_context_format(ctx, TRACE_DEFAULT_FORMAT);
+}
+
+
+/********************
+ * bench_long
+ ********************/
+static void
+bench_long(long loops)
+{
+    static char msg[64 * 1024];
+    int         sizes[] = { 100, 1000, 10000, 60000, 0 };
+    double      start, end;
+    char        what[64];
+    long        i;
+    int         s;
+
+    for (s = 0; sizes[s] != 0; s++) {
+        memset(msg, 'x', sizes[s]);
+        msg[sizes[s]] = '\0';
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "%s", msg);
+        end = now_ns();
+        snprintf(what, sizeof(what), "%d byte message", sizes[s]);
+        report(what, start, end, loops);
+    }
+}
+
+
+/********************
+ * bench_clocks
+ ********************/
+static void
+bench_clocks(long loops)
+{
+    static const char *clocks[] = {
+        TRACE_CLOCK_REALTIME, TRACE_CLOCK_MONOTONIC,
+        TRACE_CLOCK_MONOTONIC_RAW, TRACE_CLOCK_TSC,
+        NULL
+    };
+    double start, end;
+    long   i;
+    int    c, err;
+
+    /* time stamps are taken by the caller in binary mode, formatting not */
+    if (trace_context_format(ctx, "%N %M") != 0 ||
+        trace_context_mode(ctx, TRACE_MODE_BINARY) != 0)
+        fatal(1, "failed to set up context for clock benchmark");
+
+    for (c = 0; clocks[c] != NULL; c++) {
+        if ((err = trace_context_clock(ctx, clocks[c])) != 0) {
+            info("%-24s %-13s %s", "clock", clocks[c], strerror(-err));
+            continue;
+        }
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "enabled %ld", i);
+        end = now_ns();
+        info("%-24s %-13s %10.2f ns/call", "%N time stamp", clocks[c],
+             (end - start) / loops);
+    }
+
+    trace_context_mode(ctx, TRACE_MODE_DIRECT);
+    trace_context_clock(ctx, TRACE_CLOCK_MONOTONIC);
+    trace_context_format(ctx, TRACE_DEFAULT_FORMAT);
+}
+
+
+/********************
+ * bench_flush
+ ********************/
+static void
+bench_flush(long loops)
+{
+    static const char *policies[] = {
+        TRACE_FLUSH_LINE, TRACE_FLUSH_SIZE("4k"), TRACE_FLUSH_SIZE("64k"),
+        TRACE_FLUSH_INTERVAL("10ms"), NULL
+    };
+    double start, end;
+    long   i;
+    int    p;
+
+    for (p = 0; policies[p] != NULL; p++) {
+        if (trace_context_flush(ctx, policies[p]) != 0)
+            fatal(1, "failed to set flush policy %s", policies[p]);
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "enabled %ld", i);
+        trace_context_flush(ctx, NULL);
+        end = now_ns();
+        info("%-24s %-13s %10.2f ns/call", "trace_write, flush", policies[p],
+             (end - start) / loops);
+    }
+
+    trace_context_flush(ctx, TRACE_FLUSH_LINE);
+}
+
+
+/********************
+ * bench_mmap
+ ********************/
+static void
+bench_mmap(long loops)
+{
+#define BENCH_MMAP_FILE "/tmp/trace-bench.trace"
+    double start, end;
+    long   i;
+
+    if (trace_context_target(ctx, TRACE_TO_MMAP(BENCH_MMAP_FILE, "16m")) != 0)
+        fatal(1, "failed to set mmap target %s", BENCH_MMAP_FILE);
+
+    start = now_ns();
+    for (i = 0; i < loops; i++)
+        trace_write(DBG_ON, "enabled %ld", i);
+    end = now_ns();
+    report("trace_write, mmap target", start, end, loops);
+
+    trace_context_target(ctx, "/dev/null");
+    unlink(BENCH_MMAP_FILE);
+}
+
+
+/********************
+ * bench_stats
+ ********************/
+static void
+bench_stats(long loops)
+{
+    static const char *states[] = {
+        TRACE_STATS_OFF, TRACE_STATS_ON, NULL
+    };
+    double start, end;
+    long   i;
+    int    s;
+
+    for (s = 0; states[s] != NULL; s++) {
+        if (trace_context_stats(ctx, states[s]) != 0)
+            fatal(1, "failed to turn statistics %s", states[s]);
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "enabled %ld", i);
+        end = now_ns();
+        info("%-24s %-7s %10.2f ns/call", "trace_write, stats", states[s],
+             (end - start) / loops);
+    }
+
+    trace_context_stats(ctx, TRACE_STATS_OFF);
+}
+
+
+/********************
+ * bench_limit
+ ********************/
+static void
+bench_limit(long loops)
+{
+    double start, end;
+    long   i;
+
+    if (trace_flag_limit(DBG_ON, 1000) != 0)
+        fatal(1, "failed to set rate limit");
+
+    start = now_ns();
+    for (i = 0; i < loops; i++)
+        trace_write(DBG_ON, "enabled %ld", i);
+    end = now_ns();
+    report("trace_write, limited to 1000/s", start, end, loops);
+
+    trace_flag_limit(DBG_ON, 0);
+}
+
+
+/********************
+ * bench_sample
+ ********************/
+static void
+bench_sample(long loops)
+{
+    static const int random[] = { FALSE, TRUE, -1 };
+    double start, end;
+    long   i;
+    int    r;
+
+    for (r = 0; random[r] >= 0; r++) {
+        if (trace_flag_sample(DBG_ON, 1000, random[r]) != 0)
+            fatal(1, "failed to set sampling");
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write(DBG_ON, "enabled %ld", i);
+        end = now_ns();
+        info("%-24s %-7s %10.2f ns/call", "trace_write, 1/1000",
+             random[r] ? "random" : "nth", (end - start) / loops);
+    }
+
+    trace_flag_sample(DBG_ON, 0, FALSE);
+}
+
+
+/********************
+ * bench_tags
+ ********************/
+static void
+bench_tags(long loops)
+{
+    static const int counts[] = { 1, 10, 100, 1000, -1 };
+    TRACE_DECLARE_TAGS(tags, 3, 64);
+    TRACE_DECLARE_TAGS(filter, 2, 64);
+    char   user[32];
+    double start, end;
+    long   i;
+    int    c, n;
+
+    trace_tag_add(&tags, "user", "nobody");
+    trace_tag_add(&tags, "session", "1234");
+    trace_tag_addf(&tags, "pid", "%d", getpid());
+
+    for (c = n = 0; counts[c] >= 0; c++) {
+        for ( ; n < counts[c]; n++) {
+            filter.ntag = filter.used = 0;
+            snprintf(user, sizeof(user), "user%d", n);
+            trace_tag_add(&filter, "user", user);
+            trace_tag_add(&filter, "session", TRACE_FILTER_ANY);
+            if (trace_add_simple_filter(ctx, &filter) != 0)
+                fatal(1, "failed to add tag filter");
+        }
+
+        start = now_ns();
+        for (i = 0; i < loops; i++)
+            trace_write_tags(DBG_ON, &tags, "filtered %ld", i);
+        end = now_ns();
+        info("%-24s %5d filters %10.2f ns/call", "trace_write_tags",
+             n, (end - start) / loops);
+    }
+
+    trace_reset_filters(ctx);
+}
+
+
+/********************
+ * bench_async
+ ********************/
+#define BENCH_FIFO     "/tmp/trace-bench.fifo"
+#define BENCH_DRAIN    4096                  /* bytes drained per period */
+#define BENCH_THROTTLE 1000                  /* drain period (us) */
+
+static volatile int throttling;
+
+static void *
+throttled_sink(void *data)
+{
+    char buf[BENCH_DRAIN];
+    int  fd = *(int *)data;
+
+    while (throttling) {
+        if (read(fd, buf, sizeof(buf)) < 0 && errno != EAGAIN)
+            break;
+        usleep(BENCH_THROTTLE);
+    }
+
+    return NULL;
+}
+
+static void
+bench_async(long loops)
+{
+    static const char *policies[] = {
+        TRACE_OVERFLOW_DROP_NEWEST, TRACE_OVERFLOW_DROP_OLDEST,
+        TRACE_OVERFLOW_SPILL, TRACE_OVERFLOW_BLOCK, NULL
+    };
+    pthread_t   tid;
+    uint64_t    dropped, before;
+    double      start, end, t, max;
+    const char *mode, *policy;
+    long        i;
+    int         fd, p;
+
+    /* a fifo drained at about 4 MB/s stands for a slow target */
+    unlink(BENCH_FIFO);
+    if (mkfifo(BENCH_FIFO, 0600) != 0 ||
+        (fd = open(BENCH_FIFO, O_RDONLY | O_NONBLOCK)) < 0)
+        fatal(1, "failed to create fifo %s", BENCH_FIFO);
+    if (trace_context_target(ctx, TRACE_TO_FILE(BENCH_FIFO)) != 0)
+        fatal(1, "failed to set fifo target %s", BENCH_FIFO);
+
+    throttling = TRUE;
+    pthread_create(&tid, NULL, throttled_sink, &fd);
+
+    loops /= 100;                            /* direct mode is throttled */
+    if (loops == 0)
+        loops = 1;
+
+    /* direct mode first, then async mode with every overflow policy */
+    for (p = -1; p < 0 || policies[p] != NULL; p++) {
+        mode   = p < 0 ? TRACE_MODE_DIRECT : TRACE_MODE_ASYNC;
+        policy = p < 0 ? TRACE_OVERFLOW_DROP_NEWEST : policies[p];
+
+        if (trace_context_mode(ctx, mode) != 0 ||
+            trace_context_overflow(ctx, policy) != 0)
+            fatal(1, "failed to set %s mode with %s overflow", mode, policy);
+
+        trace_context_dropped(ctx, &before);
+        max   = 0;
+        start = now_ns();
+        for (i = 0; i < loops; i++) {
+            t = now_ns();
+            trace_write(DBG_ON, "enabled %ld", i);
+            if ((t = now_ns() - t) > max)
+                max = t;
+        }
+        end = now_ns();
+        trace_context_dropped(ctx, &dropped);
+
+        info("%-24s %-11s %10.2f ns/call, max %10.2f us, %llu dropped",
+             "trace_write, throttled", p < 0 ? mode : policy,
+             (end - start) / loops, max / 1000,
+             (unsigned long long)(dropped - before));
+    }
+
+    trace_context_mode(ctx, TRACE_MODE_DIRECT);
+    trace_context_target(ctx, "/dev/null");
+    throttling = FALSE;
+    pthread_join(tid, NULL);
+    close(fd);
+    unlink(BENCH_FIFO);
+}
+
+
+/********************
+ * bench_register
+ ********************/
+static void
+bench_register(long loops)
+{
+#define BENCH_FLAGS 200
+    static trace_flag64_t ids[BENCH_FLAGS];
+    static char           names[BENCH_FLAGS][16];
+    trace_flagdef64_t     flags[BENCH_FLAGS + 1];
+    trace_moduledef64_t   mod = { "register", flags, BENCH_FLAGS + 1 };
+    double                start, end;
+    long                  i;
+    int                   f;
+
+    for (f = 0; f < BENCH_FLAGS; f++) {
+        snprintf(names[f], sizeof(names[f]), "flag%d", f);
+        flags[f].name    = names[f];
+        flags[f].descr   = "benchmark flag";
+        flags[f].flagptr = ids + f;
+    }
+    memset(flags + BENCH_FLAGS, 0, sizeof(flags[0]));
+
+    loops /= 1000;
+    if (loops == 0)
+        loops = 1;
+
+    start = now_ns();
+    for (i = 0; i < loops; i++) {
+        if (trace_add_module64(ctx, &mod) != 0)
+            fatal(1, "failed to add %d-flag module", BENCH_FLAGS);
+        trace_del_module(ctx, mod.name);
+    }
+    end = now_ns();
+    info("%-32s %10.2f us/call", "add and delete 200-flag module",
+         (end - start) / loops / 1000);
+}
+
+
+/********************
+ * bench_memory
+ ********************/
+#define MEMORY_MODULES 50
+#define MEMORY_FLAGS   200                   /* 10k flags in all */
+#define MEMORY_PERCTX  20                    /* 4k flags per context */
+#define MEMORY_CONTEXTS ((MEMORY_MODULES + MEMORY_PERCTX - 1) / MEMORY_PERCTX)
+
+static size_t
+heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo  mi = mallinfo();
+#endif
+
+    return (size_t)mi.uordblks + (size_t)mi.hblkhd;
+}
+
+static void
+bench_memory(long loops)
+{
+    static trace_flag64_t      ids[MEMORY_MODULES][MEMORY_FLAGS];
+    static char                names[MEMORY_FLAGS][16];
+    static char                modnames[MEMORY_MODULES][16];
+    static trace_flagdef64_t   flags[MEMORY_FLAGS + 1];
+    static trace_moduledef64_t mods[MEMORY_MODULES];
+    static char                ctxnames[MEMORY_CONTEXTS][16];
+    size_t                     before, after;
+    double                     start, added, closed;
+    long                       i;
+    int                        cids[MEMORY_CONTEXTS], c, m, f;
+
+    for (f = 0; f < MEMORY_FLAGS; f++) {
+        snprintf(names[f], sizeof(names[f]), "flag%d", f);
+        flags[f].name  = names[f];
+        flags[f].descr = "benchmark flag";
+    }
+    memset(flags + MEMORY_FLAGS, 0, sizeof(flags[0]));
+
+    loops /= 100000;
+    if (loops == 0)
+        loops = 1;
+
+    before = after = 0;
+    start  = added = closed = 0;
+
+    for (i = 0; i < loops; i++) {
+        before = heap_used();
+        start  = now_ns();
+
+        for (c = 0; c < MEMORY_CONTEXTS; c++) {
+            snprintf(ctxnames[c], sizeof(ctxnames[c]), "memory%d", c);
+            if ((cids[c] = trace_context_open(ctxnames[c])) < 0)
+                fatal(1, "failed to open context %d", c);
+        }
+
+        for (m = 0; m < MEMORY_MODULES; m++) {
+            snprintf(modnames[m], sizeof(modnames[m]), "module%d", m);
+            mods[m].name  = modnames[m];
+            mods[m].flags = flags;
+            mods[m].nflag = MEMORY_FLAGS + 1;
+            for (f = 0; f < MEMORY_FLAGS; f++)
+                flags[f].flagptr = &ids[m][f];
+            if (trace_add_module64(cids[m / MEMORY_PERCTX], mods + m) != 0)
+                fatal(1, "failed to add module %d", m);
+        }
+
+        added = now_ns();
+        after = heap_used();
+
+        for (c = 0; c < MEMORY_CONTEXTS; c++)
+            trace_context_close(cids[c]);
+        closed = now_ns();
+    }
+
+    info("%-32s %10zu kB heap", "registry of 10k flags",
+         (after - before) / 1024);
+    info("%-32s %10.2f us", "open contexts, add 50 modules",
+         (added - start) / 1000);
+    info("%-32s %10.2f us", "close contexts", (closed - added) / 1000);
+}
+
+
+static struct {
+    const char *name;
+    void      (*run)(long);
+    const char *descr;
+} benchmarks[] = {
+    { "disabled", bench_disabled, "cost of disabled trace points" },
+    { "modes"   , bench_modes   , "cost of enabled trace points"  },
+    { "stamp"   , bench_stamp   , "cost of time stamp formatting" },
+    { "gather"  , bench_gather  , "cost of message prefixes"      },
+    { "long"    , bench_long    , "cost of long messages"         },
+    { "clocks"  , bench_clocks  , "cost of clock sources"         },
+    { "flush"   , bench_flush   , "cost of flush policies"        },
+    { "mmap"    , bench_mmap    , "cost of mmap target"           },
+    { "stats"   , bench_stats   , "cost of flag statistics"       },
+    { "limit"   , bench_limit   , "cost of rate limited flags"    },
+    { "sample"  , bench_sample  , "cost of sampled flags"         },
+    { "tags"    , bench_tags    , "cost of tag filters"           },
+    { "async"   , bench_async   , "latency with a throttled sink" },
+    { "register", bench_register, "cost of module registration"   },
+    { "memory"  , bench_memory  , "footprint of a 10k flag registry" },
+    { NULL, NULL, NULL }
+};
+
+
+int main(int argc, char *argv[])
+{
+    const char *which;
+    long        loops;
+    int         i, found;
+
+    which = argc > 1 ? argv[1] : "all";
+    loops = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_LOOPS;
+
+    if (loops <= 0)
+        fatal(1, "invalid number of loops '%s'", argv[2]);
+
+    trace_init();
+
+    if ((ctx = trace_context_open("bench")) < 0)
+        fatal(1, "failed to create benchmark trace context");
+
+    if (trace_add_module(ctx, &bench) != 0)
+        fatal(1, "failed to add trace module bench (%d: %s)",
+              errno, strerror(errno));
+
+    if (trace_add_module64(ctx, &bench64) != 0)
+        fatal(1, "failed to add trace module bench64");
+
+    trace_context_enable(ctx);
+    trace_context_target(ctx, "/dev/null");
+    trace_flag_set(DBG_ON);
+
+    for (i = found = 0; benchmarks[i].name != NULL; i++) {
+        if (strcmp(which, "all") && strcmp(which, benchmarks[i].name))
+            continue;
+        info("%s: %s (%ld loops)", benchmarks[i].name, benchmarks[i].descr,
+             loops);
+        benchmarks[i].run(loops);
+        found = TRUE;
+    }
+
+    if (!found)
+        fatal(1, "unknown benchmark '%s'", which);
+
+    trace_exit();
+
+    return 0;
+}
+
+
+
+
+/*
+ * Local Variables:
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ * vim:set expandtab shiftwidth=4:
+ */